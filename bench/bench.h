@@ -0,0 +1,251 @@
+// Benchmark driver, included by each schema benchmark once it has defined Sample and Fill()
+// Prints one JSON object per operation on stdout, see build_bench.sh
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#ifdef BENCH_CONNECTION
+#include <sys/socket.h>
+#endif
+
+#ifndef BENCH_SCHEMA
+#define BENCH_SCHEMA "unknown"
+#endif
+
+// Every allocation goes through these, to count allocations per message
+static uint64_t allocationCount = 0;
+
+void* operator new(size_t size)
+{
+    ++allocationCount;
+    void* p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace
+{
+
+// Distinct messages, processed in turn
+const uint32_t kMessageCount = 1024;
+// Minimum duration of a throughput measurement
+const double kMinSeconds = 0.2;
+// Operations timed one by one for the latency percentiles, which include reading the clock
+const uint32_t kLatencySamples = 20000;
+// Messages compressed together, like a batch (see BENCH_COMPRESSOR), or sent together over a
+// connection (see BENCH_CONNECTION)
+const uint32_t kBlockMessages = 64;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Result
+{
+    double messagesPerSecond;
+    double bytesPerSecond;
+    double allocationsPerMessage;
+    double p50;
+    double p99;
+};
+
+// Keep the compiler from dropping the work done on value, which is never read otherwise
+template <class T>
+void KeepAlive(T& value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+double Seconds(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Run op(i) for i below opCount, processing all the messages, bytes is the serialized size of all of them
+template <class Op>
+Result Measure(Op op, uint64_t bytes, uint32_t opCount = kMessageCount)
+{
+    for(uint32_t i = 0; i < opCount; ++i)
+        op(i);
+
+    Result result;
+    uint64_t allocations = allocationCount;
+    uint64_t rounds = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed;
+    do
+    {
+        for(uint32_t i = 0; i < opCount; ++i)
+            op(i);
+        ++rounds;
+        elapsed = Seconds(start, Clock::now());
+    } while(elapsed < kMinSeconds);
+    result.messagesPerSecond = rounds * kMessageCount / elapsed;
+    result.bytesPerSecond = rounds * bytes / elapsed;
+    result.allocationsPerMessage = (double)(allocationCount - allocations) / (rounds * kMessageCount);
+
+    std::vector<double> samples(kLatencySamples);
+    for(uint32_t i = 0; i < kLatencySamples; ++i)
+    {
+        Clock::time_point before = Clock::now();
+        op(i % opCount);
+        samples[i] = Seconds(before, Clock::now()) * 1e9;
+    }
+    std::nth_element(samples.begin(), samples.begin() + kLatencySamples / 2, samples.end());
+    result.p50 = samples[kLatencySamples / 2];
+    std::nth_element(samples.begin(), samples.begin() + kLatencySamples * 99 / 100, samples.end());
+    result.p99 = samples[kLatencySamples * 99 / 100];
+    return result;
+}
+
+void Print(const char* op, const Result& result)
+{
+    printf("{\"schema\": \"%s\", \"op\": \"%s\", \"msgs_per_s\": %.0f, \"gb_per_s\": %.3f, \"allocs_per_msg\": %.3f, \"p50_ns\": %.0f, \"p99_ns\": %.0f}\n",
+           BENCH_SCHEMA, op, result.messagesPerSecond, result.bytesPerSecond / 1e9, result.allocationsPerMessage, result.p50, result.p99);
+}
+
+}
+
+int main()
+{
+    std::vector<Sample> messages(kMessageCount);
+    for(uint32_t i = 0; i < kMessageCount; ++i)
+        Fill(messages[i], i);
+
+    // All the messages serialized back to back
+    std::vector<uint32_t> offsets(kMessageCount + 1, 0);
+    std::string input;
+    for(uint32_t i = 0; i < kMessageCount; ++i)
+    {
+        messages[i].AppendTo(input);
+        offsets[i + 1] = (uint32_t)input.size();
+    }
+    std::vector<char> output(input.size());
+    uint64_t bytes = input.size();
+
+    // Regression check: every message must decode back to itself
+    Sample decoded;
+    for(uint32_t i = 0; i < kMessageCount; ++i)
+    {
+        uint32_t size = offsets[i + 1] - offsets[i];
+        if(Bench::MessageFactory::ParseInto(decoded, &input[offsets[i]], size) != Bench::MessageFactory::NOERROR
+           || decoded.ToStringBuffer() != input.substr(offsets[i], size))
+        {
+            fprintf(stderr, "%s: message %u doesn't decode back to itself\n", BENCH_SCHEMA, i);
+            return 1;
+        }
+    }
+
+    Print("memcpy", Measure([&](uint32_t i) {
+        memcpy(&output[offsets[i]], &input[offsets[i]], offsets[i + 1] - offsets[i]);
+        KeepAlive(output);
+    }, bytes));
+    Print("encode", Measure([&](uint32_t i) {
+        messages[i].ToBuffer(&output[offsets[i]], offsets[i + 1] - offsets[i]);
+        KeepAlive(output);
+    }, bytes));
+    Print("decode", Measure([&](uint32_t i) {
+        Bench::MessageFactory::ParseInto(decoded, &input[offsets[i]], offsets[i + 1] - offsets[i]);
+        KeepAlive(decoded);
+    }, bytes));
+    Print("decode_new", Measure([&](uint32_t i) {
+        delete Bench::MessageFactory::CreateFromBufferChecked(&input[offsets[i]], offsets[i + 1] - offsets[i]);
+    }, bytes));
+
+#ifdef BENCH_CHECKSUM
+    // The checksum alone, of every message
+    Print("crc32c", Measure([&](uint32_t i) {
+        uint32_t crc = BENCH_CHECKSUM::Compute(&input[offsets[i]], offsets[i + 1] - offsets[i]);
+        KeepAlive(crc);
+    }, bytes));
+#endif
+
+#ifdef BENCH_COMPRESSOR
+    // Blocks of kBlockMessages messages compressed one by one, the latency is the one of a block
+    const uint32_t blockCount = kMessageCount / kBlockMessages;
+    std::vector<std::string> blocks(blockCount);
+    std::vector<char> compressed(BENCH_COMPRESSOR::GetMaxCompressedSize((uint32_t)bytes));
+    uint64_t compressedBytes = 0;
+    for(uint32_t i = 0; i < blockCount; ++i)
+    {
+        uint32_t begin = offsets[i * kBlockMessages], size = offsets[(i + 1) * kBlockMessages] - begin;
+        blocks[i].assign(&compressed[0], BENCH_COMPRESSOR::Compress(&input[begin], size, &compressed[0]));
+        compressedBytes += blocks[i].size();
+        if(!BENCH_COMPRESSOR::Decompress(blocks[i].data(), (uint32_t)blocks[i].size(), &output[begin], size)
+           || memcmp(&output[begin], &input[begin], size) != 0)
+        {
+            fprintf(stderr, "%s: block %u doesn't decompress back to itself\n", BENCH_SCHEMA, i);
+            return 1;
+        }
+    }
+    fprintf(stderr, "%s: blocks compressed to %.1f%%\n", BENCH_SCHEMA, 100.0 * compressedBytes / bytes);
+    Print("compress", Measure([&](uint32_t i) {
+        uint32_t begin = offsets[i * kBlockMessages];
+        BENCH_COMPRESSOR::Compress(&input[begin], offsets[(i + 1) * kBlockMessages] - begin, &compressed[0]);
+        KeepAlive(compressed);
+    }, bytes, blockCount));
+    Print("decompress", Measure([&](uint32_t i) {
+        uint32_t begin = offsets[i * kBlockMessages];
+        BENCH_COMPRESSOR::Decompress(blocks[i].data(), (uint32_t)blocks[i].size(), &output[begin], offsets[(i + 1) * kBlockMessages] - begin);
+        KeepAlive(output);
+    }, bytes, blockCount));
+#endif
+
+#ifdef BENCH_CONNECTION
+    // Blocks of kBlockMessages messages sent over a socketpair and received in place on the other
+    // end, by the same thread: the latency is the one of a block
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        fprintf(stderr, "%s: socketpair failed\n", BENCH_SCHEMA);
+        return 1;
+    }
+    BENCH_CONNECTION sender(fds[0]), receiver(fds[1]);
+    // Copies every frame received at the offset of the message it should be
+    struct Receiver
+    {
+        std::vector<char>& output;
+        std::vector<uint32_t>& offsets;
+        uint32_t next;
+        void OnFrame(const BENCH_CONNECTION::Frame& frame)
+        {
+            if(offsets[next] + frame.size <= output.size())
+                memcpy(&output[offsets[next]], frame.data, frame.size);
+            ++next;
+        }
+    };
+    Receiver frames = { output, offsets, 0 };
+    auto transfer = [&](uint32_t i) {
+        for(uint32_t j = i * kBlockMessages; j < (i + 1) * kBlockMessages; ++j)
+            sender.Send(messages[j]);
+        sender.Flush();
+        frames.next = i * kBlockMessages;
+        while(frames.next < (i + 1) * kBlockMessages && receiver.ReceiveFrames(frames))
+            ;
+    };
+    memset(&output[0], 0, output.size());
+    for(uint32_t i = 0; i < kMessageCount / kBlockMessages; ++i)
+        transfer(i);
+    if(memcmp(&output[0], &input[0], output.size()) != 0)
+    {
+        fprintf(stderr, "%s: messages aren't received as sent\n", BENCH_SCHEMA);
+        return 1;
+    }
+    Print("connection", Measure(transfer, bytes, kMessageCount / kBlockMessages));
+#endif
+
+    return output == std::vector<char>(input.begin(), input.end()) ? 0 : 1;
+}
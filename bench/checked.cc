@@ -0,0 +1,21 @@
+// The arrays of arrays.cc, each message ending with a CRC32C: the difference with arrays is the
+// cost of the checksum
+#include "checked.h"
+
+typedef Bench::Sample Sample;
+
+void Fill(Sample& message, uint32_t i)
+{
+    message.id = i;
+    for(int j = 0; j < 64; ++j)
+        message.levels[j] = (int32_t)(i * 64 + j);
+    message.prices.resize(64 + i % 64);
+    for(size_t j = 0; j < message.prices.size(); ++j)
+        message.prices[j] = 100.0 + j * 0.25;
+    message.sizes.resize(128 + i % 128);
+    for(size_t j = 0; j < message.sizes.size(); ++j)
+        message.sizes[j] = (uint16_t)(i + j);
+}
+
+#define BENCH_CHECKSUM Bench::MessageCrc32c
+#include "bench.h"
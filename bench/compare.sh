@@ -0,0 +1,34 @@
+#!/bin/sh
+# Compare two benchmark results (see build_bench.sh) and fail if a throughput dropped
+# Usage: bench/compare.sh old.json new.json [max drop in percent, default 10]
+if [ $# -lt 2 ]
+then
+    echo "Usage: $0 old.json new.json [max drop in percent]"
+    exit 2
+fi
+awk -v threshold="${3:-10}" '
+    function field(line, name,    start)
+    {
+        start = index(line, "\"" name "\": ")
+        if(!start)
+            return ""
+        line = substr(line, start + length(name) + 4)
+        gsub(/^"/, "", line)
+        match(line, /^[^",}]*/)
+        return substr(line, 1, RLENGTH)
+    }
+    {
+        key = field($0, "schema") " " field($0, "op")
+        if(FNR == NR)
+            old[key] = field($0, "msgs_per_s")
+        else if(key in old && old[key] > 0)
+        {
+            change = (field($0, "msgs_per_s") / old[key] - 1) * 100
+            status = (change < -threshold) ? "REGRESSION" : "ok"
+            if(status != "ok")
+                failed = 1
+            printf("%-24s %14.0f -> %14.0f msgs/s %+7.1f%% %s\n", key, old[key], field($0, "msgs_per_s"), change, status)
+        }
+    }
+    END { exit failed }
+' "$1" "$2"
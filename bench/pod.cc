@@ -0,0 +1,19 @@
+// All fixed size members, serialized with the fixed size fast path
+#include "pod.h"
+
+typedef Bench::Sample Sample;
+
+void Fill(Sample& message, uint32_t i)
+{
+    message.id = i;
+    message.timestamp = 1600000000000000000LL + i;
+    message.price = 100.25 + i % 100;
+    message.quantity = 10 + i % 7;
+    message.venue = (uint16_t)(i % 12);
+    message.side = (uint8_t)(i & 1);
+    message.flags = (int32_t)(i * 31);
+    message.weight = 0.5f;
+    message.orderId = 0x100000000ULL + i;
+}
+
+#include "bench.h"
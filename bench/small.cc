@@ -0,0 +1,17 @@
+// Many tiny messages, where the per message overhead dominates
+#include "small.h"
+
+typedef Bench::Sample Sample;
+
+void Fill(Sample& message, uint32_t i)
+{
+    message.id = i;
+    message.quantity = (uint16_t)(i % 1000);
+    message.side = (uint8_t)(i & 1);
+}
+
+// Batches of tiny messages are the ones worth compressing
+#define BENCH_COMPRESSOR Bench::MessageCompressor
+// and the ones sent one by one over a connection
+#define BENCH_CONNECTION Bench::MessageConnection
+#include "bench.h"
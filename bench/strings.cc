@@ -0,0 +1,16 @@
+// Mostly strings of various lengths
+#include "strings.h"
+
+typedef Bench::Sample Sample;
+
+void Fill(Sample& message, uint32_t i)
+{
+    message.id = i;
+    message.symbol = std::string(3 + i % 6, 'S');
+    message.account = "ACCOUNT-" + std::string(8 + i % 9, '0' + i % 10);
+    message.comment = std::string(i % 97, 'c');
+    for(int j = 0; j < 4; ++j)
+        message.tags[j] = std::string(1 + (i + j) % 12, 't');
+}
+
+#include "bench.h"
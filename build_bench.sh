@@ -0,0 +1,13 @@
+#!/bin/sh
+# Build the generator and the benchmarks of bench/, then run them
+# Results are written to bin/bench.json (one JSON object per line), see bench/compare.sh
+set -e
+mkdir -p bin/bench
+g++ -O2 *.cc -o ./bin/msgbuf
+: > bin/bench.json
+for schema in pod strings arrays checked small
+do
+    ./bin/msgbuf bench/$schema.mb bin/bench/$schema.h > /dev/null
+    g++ -std=c++11 -O2 -Wall -Wextra -DBENCH_SCHEMA=\"$schema\" -Ibench -Ibin/bench bench/$schema.cc -o bin/bench/$schema
+    ./bin/bench/$schema | tee -a bin/bench.json
+done
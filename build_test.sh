@@ -0,0 +1,11 @@
+#!/bin/sh
+# Build the generator and the tests of test/, then run them with the address and undefined behavior sanitizers
+set -e
+mkdir -p bin/test
+g++ -O2 *.cc -o ./bin/msgbuf
+for schema in connection shmring log
+do
+    ./bin/msgbuf test/$schema.mb bin/test/$schema.h > /dev/null
+    g++ -std=c++11 -O1 -g -fsanitize=address,undefined -fno-sanitize-recover=undefined -Itest -Ibin/test test/$schema.cc -o bin/test/$schema
+    ./bin/test/$schema
+done
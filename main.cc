@@ -1,6 +1,10 @@
+#include <cctype>
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <map>
 #include <sstream>
 #include <vector>
 #include <stdint.h>
@@ -53,25 +57,63 @@ struct DataMember
     std::string nativeType;
     std::string name;
     int count;
+    bool optional; // may be absent from the wire, see presenceIndex
+    int presenceIndex; // bit in the presence bitmap, -1 if not optional
+    std::string elementType; // type of the elements of a vec
+    bool nested; // type is another message, stored inline (body without header)
+    int nestedMinSize; // minimum body size of the nested message
+    int bits; // width of a bit packed member (bool, enum, ranged integer), 0 otherwise
+    int bitWord; // 64 bits word of the packed bits holding the first element
+    int bitShift; // position of the first element in that word
+    int elementsPerWord; // elements of an array stored in each word
 
-    DataMember() : count(1) {}
+    DataMember() : count(1), optional(false), presenceIndex(-1), nested(false), nestedMinSize(0), bits(0), bitWord(0), bitShift(0), elementsPerWord(1) {}
 };
 
 struct Message
 {
     std::string name;
+    int id; // value in the MESSAGE_TYPE enum
+    int optionalCount; // number of optional members
+    int packedSize; // bytes of packed bits following the presence bitmap
 
     typedef std::vector<DataMember> MemberList;
     MemberList memberList;
+    std::vector<std::string> containerList; // messages having this one as a nested member
+
+    Message() : id(0), optionalCount(0), packedSize(0) {}
+};
+
+struct Enum
+{
+    std::string name;
+    std::vector<std::string> nameList;
+    std::vector<uint32_t> valueList;
+    int bits; // enough to store the biggest value
+    int line; // where it's declared, for the errors
 };
 
+typedef std::vector<Enum> EnumList;
+
 struct Options
 {
     uint32_t version;
     std::string package;
     std::string baseclass;
+    bool compact; // varint encoding of integers, string lengths and header
+    std::string byteorder; // wire byte order: big, little or native
+    bool framed; // the header starts with the total size of the message
+    bool shmRing; // generate the shared memory ring transport
+    bool log; // generate the message log writer and reader
+    bool split; // one header per message, see WriteOutput
+    bool compression; // generate the block compressor, used by batches and logs
+    bool checksum; // a CRC32C follows every message and batch
+    bool connection; // generate the non-blocking socket connection and its poller
+    bool delta; // generate SerializeDelta / ApplyDelta for every message
+    bool columns; // generate the columnar batch (FooColumns) of every message
+    bool views; // generate the read-only view (FooView) of every message
 
-    Options() : version(0), package("Msg"), baseclass("Message") {}
+    Options() : version(0), package("Msg"), baseclass("Message"), compact(false), byteorder("big"), framed(false), shmRing(false), log(false), split(false), compression(false), checksum(false), connection(false), delta(false), columns(false), views(false) {}
 };
 
 typedef std::vector<Message> MessageList;
@@ -98,37 +140,36 @@ Type typeList[] = {
     {"str", "std::string", 0, 4},
 };
 
-std::string ConvertType(const std::string& type)
+// Entry of typeList for type, 0 for an unknown type (a message, an enum or a syntax error)
+const Type* FindType(const std::string& type)
 {
-    for(size_t i = 0; i < sizeof(typeList) / sizeof(Type); ++i)
+    static std::map<std::string, const Type*> typeMap;
+    if(typeMap.empty())
     {
-        if(std::string(typeList[i].type) == type)
-            return typeList[i].nativeType;
+        for(size_t i = 0; i < sizeof(typeList) / sizeof(Type); ++i)
+            typeMap[typeList[i].type] = &typeList[i];
     }
 
-    return "";
+    std::map<std::string, const Type*>::const_iterator it = typeMap.find(type);
+    return it != typeMap.end() ? it->second : 0;
 }
 
-int GetTypeStorageSize(const std::string& type)
+std::string ConvertType(const std::string& type)
 {
-    for(size_t i = 0; i < sizeof(typeList) / sizeof(Type); ++i)
-    {
-        if(std::string(typeList[i].type) == type)
-            return typeList[i].typeSize + typeList[i].storageOverhead;
-    }
+    const Type* t = FindType(type);
+    return t ? t->nativeType : "";
+}
 
-    return 0;
+int GetTypeStorageSize(const std::string& type)
+{
+    const Type* t = FindType(type);
+    return t ? t->typeSize + t->storageOverhead : 0;
 }
 
 int GetTypeSize(const std::string& type)
 {
-    for(size_t i = 0; i < sizeof(typeList) / sizeof(Type); ++i)
-    {
-        if(std::string(typeList[i].type) == type)
-            return typeList[i].typeSize;
-    }
-
-    return 0;
+    const Type* t = FindType(type);
+    return t ? t->typeSize : 0;
 }
 
 std::string GetSwapByteSuffix(const std::string& type)
@@ -140,461 +181,5891 @@ std::string GetSwapByteSuffix(const std::string& type)
     return swapByteSuffix;
 }
 
-bool ProcessInputFile(const std::string& filename, MessageList& messageList, Options& options)
+// Returns the expression to access a member, indexed by the loop variable when it's an array
+std::string MemberExpr(const DataMember& member)
 {
-    std::ifstream f(filename.c_str());
-    if(!f.is_open())
-        return false;
-
-    Message currentMessage;
+    return member.name + (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "");
+}
 
-    std::string line;
-    while(std::getline(f, line))
+int VarintSize(uint64_t v)
+{
+    int size = 1;
+    while(v >= 0x80)
     {
-        line = Trim(line);
+        v >>= 7;
+        ++size;
+    }
 
-        if(line.length() == 0)
-            continue;
+    return size;
+}
 
-        if(line[0] == '#')
-        {
-            // Skip comment
-            continue;
-        }
-        else if(line[0] == '.')
-        {
-            if(currentMessage.name != "")
-                messageList.push_back(currentMessage);
+// With the compact encoding, integers wider than a byte are stored as LEB128 varints
+// (zigzag encoded when signed)
+bool IsVarint(const DataMember& member, const Options& options)
+{
+    return options.compact && member.type != "str" && member.type != "float" && member.type != "double" && GetTypeSize(member.type) > 1;
+}
 
-            currentMessage = Message();
-            currentMessage.name = line.substr(1);
-        }
-        else if(line[0] == '!')
-        {
-            std::string::size_type pos = line.find(' ');
-            if(pos == std::string::npos)
-            {
-                std::cout << "Invalid option line: " << line << std::endl;
-                return false;
-            }
+bool IsSigned(const DataMember& member)
+{
+    return member.type[0] == 'i';
+}
 
-            std::string option = Trim(line.substr(1, pos - 1));
-            std::string value = Trim(line.substr(pos + 1));
+// The storage size of each element of a member depends on its value (and not only on its type)
+bool IsValueSized(const DataMember& member, const Options& options)
+{
+    return member.type == "str" || member.type == "vec" || member.nested || IsVarint(member, options);
+}
 
-            std::cout << "'" << option << "' = '" << value << "'" << std::endl;
+// Stored in the packed bits following the presence bitmap (bool, enum, ranged integer)
+bool IsPacked(const DataMember& member)
+{
+    return member.bits > 0;
+}
 
-            if(option == "version")
-                options.version = ToNumber<uint32_t>(Trim(value));
-            else if(option == "package")
-                options.package = Trim(value);
-            else if(option == "baseclass")
-                options.baseclass = Trim(value);
-        }
-        else
-        {
-            if(currentMessage.name == "")
-            {
-                std::cout << "Invalid, not in message block" << std::endl;
-                return false;
-            }
+// The storage size of a member isn't known at generation time: value sized, or optional
+bool IsVariableSize(const DataMember& member, const Options& options)
+{
+    return member.optional || IsValueSized(member, options);
+}
 
-            std::string::size_type pos = line.rfind('\t');
-            if(pos == std::string::npos)
-                pos = line.rfind(' ');
-            if(pos == std::string::npos)
-            {
-                std::cout << "Invalid line: " << line << std::endl;
-                return false;
-            }
+// Minimum number of bytes used by one element of a member
+int GetMinStorageSize(const DataMember& member, const Options& options)
+{
+    if(member.type == "str" || member.type == "vec")
+        return options.compact ? 1 : 4; // length prefix
+    if(member.nested)
+        return member.nestedMinSize;
+    if(IsVarint(member, options))
+        return 1;
 
-            DataMember dataMember;
-            dataMember.name = Trim(line.substr(pos));
+    return GetTypeStorageSize(member.type);
+}
 
-            std::string::size_type posLen1 = line.find('[');
-            if(posLen1 != std::string::npos)
-            {
-                pos = posLen1;
+// Minimum number of bytes used by a member (all its elements), 0 when optional
+int GetMinMemberSize(const DataMember& member, const Options& options)
+{
+    if(member.optional)
+        return 0;
 
-                posLen1++;
-                std::string::size_type posLen2 = line.find(']');
-                if(posLen2 == std::string::npos)
-                {
-                    std::cout << "Invalid line, bad array size syntax: " << line << std::endl;
-                    return false;
-                }
+    return GetMinStorageSize(member, options) * member.count;
+}
 
-                std::string sizeStr = line.substr(posLen1, posLen2 - posLen1);
-                dataMember.count = ToNumber<int>(sizeStr);
-                if(dataMember.count == 0)
-                {
-                    std::cout << "Invalid line, bad array size (" << sizeStr << ")" << std::endl;
-                    return false;
-                }
-            }
+// Size of the presence bitmap starting the body of messages having optional members
+int GetPresenceBitmapSize(const Message& msg)
+{
+    return (msg.optionalCount + 7) / 8;
+}
 
-            dataMember.type = Trim(line.substr(0, pos));
-            dataMember.nativeType = ConvertType(dataMember.type);
-            if(dataMember.nativeType == "")
-            {
-                std::cout << "Invalid type on line: " << line << std::endl;
-                return false;
-            }
+// Minimum size of the body of a message (all the optional members absent, empty strings...)
+int GetMinBodySize(const Message& msg, const Options& options)
+{
+    int size = GetPresenceBitmapSize(msg) + msg.packedSize;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+        size += GetMinMemberSize(msg.memberList[j], options);
 
-            currentMessage.memberList.push_back(dataMember);
-        }
+    return size;
+}
 
-        std::cout << line << std::endl;
-    }
+// Expression testing the presence bit of an optional member in bitmap
+std::string PresenceTest(const DataMember& member, const std::string& bitmap)
+{
+    return "(" + bitmap + "[" + ToString(member.presenceIndex / 8) + "] & " + ToString(1 << (member.presenceIndex % 8)) + ")";
+}
 
-    if(currentMessage.name != "")
-        messageList.push_back(currentMessage);
+// A message has a fixed size when none of its members has a variable length
+bool HasFixedSize(const Message& msg, const Options& options)
+{
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        if(IsVariableSize(msg.memberList[j], options))
+            return false;
+    }
 
-    f.close();
     return true;
 }
 
-bool WriteOutput(const std::string& output, const MessageList& messageList, const Options& options)
+// Size of the frame size (if any), version and message type
+int GetHeaderSize(const Message& msg, const Options& options)
 {
-    std::ofstream f(output.c_str());
-    if(!f.is_open())
-        return false;
-
-    std::string includeGuard = "MSGBUF_" + options.package + "_" + options.baseclass + "_" + ToString(options.version) + "_INCLUDED__";
-    f << "#ifndef " << includeGuard << std::endl;
-    f << "#define " << includeGuard << std::endl;
+    int frameSize = (options.framed ? 4 : 0);
+    if(options.compact)
+        return frameSize + VarintSize(options.version) + VarintSize(msg.id);
 
-    f << std::endl;
-    f << "// DO NOT MODIFY, THIS FILE WAS AUTO-GENERATED BY MSGBUF" << std::endl;
-
-    f << std::endl;
-    f << "#include <string>" << std::endl;
-    f << "#include <cstring>" << std::endl;
-    f << "#include <stdint.h>" << std::endl;
+    return frameSize + 8; // version(4  bytes) and message type (4 bytes)
+}
 
-    f << std::endl;
-    f << "namespace " << options.package << " {" << std::endl;
+// Part of the storage size of a member known at generation time (string length prefixes
+// and fixed width values), excluding what depends on the values
+int GetMemberStaticStorageSize(const DataMember& member, const Options& options)
+{
+    if(IsVarint(member, options) || member.nested)
+        return 0;
+    if(member.type == "str" || member.type == "vec")
+        return options.compact ? 0 : 4 * member.count;
 
-    f << std::endl;
-    f << "class " << options.baseclass << "Factory;" << std::endl;
-    f << std::endl;
+    return GetTypeStorageSize(member.type) * member.count;
+}
 
-    f << "class " << options.baseclass << std::endl;
-    f << "{" << std::endl;
-    f << "    public:" << std::endl;
-    f << "        enum MESSAGE_TYPE {";
-    for(size_t i = 0; i < messageList.size(); ++i)
+// Size known at generation time: header, presence bitmap and every mandatory member,
+// excluding what depends on the values
+int GetStaticStorageSize(const Message& msg, const Options& options)
+{
+    int size = GetHeaderSize(msg, options) + GetPresenceBitmapSize(msg) + msg.packedSize;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
     {
-        const Message& msg = messageList[i];
-        f << "MT_" << msg.name;
-        if(i != messageList.size() - 1)
-            f << ", ";
+        const DataMember& member = msg.memberList[j];
+        if(!member.optional)
+            size += GetMemberStaticStorageSize(member, options);
     }
-    f << "};" << std::endl;
-    f << "    public:" << std::endl;
-    f << "        virtual MESSAGE_TYPE GetType() const = 0;" << std::endl;
-    f << "        // Output to a user-allocated buffer, make sure there is enough" << std::endl;
-    f << "        // len must be greater or equal to the value returned by CalculateNeededSerializationSize)" << std::endl;
-    f << "        // returns the length stored in buffer" << std::endl;
-    f << "        uint32_t ToBuffer(char* buffer, uint32_t len) const" << std::endl;
-    f << "        {" << std::endl;
-    f << "             return InternalSerializeToBuffer(buffer, len);" << std::endl;
-    f << "        }" << std::endl;
-    f << "        std::string ToStringBuffer() const" << std::endl;
-    f << "        {" << std::endl;
-    f << "             return InternalSerializeToStringBuffer();" << std::endl;
-    f << "        }" << std::endl;
-    f << "        static uint32_t GetVersion()" << std::endl;
-    f << "        {" << std::endl;
-    f << "             return " << options.version << ";" << std::endl;
-    f << "        }" << std::endl;
-    f << "        uint32_t CalculateNeededSerializationSize() const" << std::endl;
-    f << "        {" << std::endl;
-    f << "             return InternalCalculateNeededSerializationSize();" << std::endl;
-    f << "        }" << std::endl;
-    f << "    protected:" << std::endl;
-    f << "        virtual uint32_t InternalSerializeToBuffer(char* p, uint32_t len) const = 0;" << std::endl;
-    f << "        virtual std::string InternalSerializeToStringBuffer() const = 0;" << std::endl;
-    f << "        virtual void InternalCreateFromBuffer(const char* p) = 0;" << std::endl;
-    f << "        virtual uint32_t InternalCalculateNeededSerializationSize() const = 0;" << std::endl;
-    f << "    protected:" << std::endl;
-    f << "        static bool ShouldSwap()" << std::endl;
-    f << "        {" << std::endl;
-    f << "             static const uint16_t swapTest = 1;" << std::endl;
-    f << "             return (*((char*)&swapTest) == 1);" << std::endl;
-    f << "        }" << std::endl;
-    f << "        static uint16_t SwapByte2(uint16_t v)" << std::endl;
-    f << "        {" << std::endl;
-    f << "             if(ShouldSwap())" << std::endl;
-    f << "                 return (v >> 8) | (v << 8);" << std::endl;
-    f << "             return v;" << std::endl;
-    f << "        }" << std::endl;
-    f << "        static uint32_t SwapByte4(uint32_t v)" << std::endl;
-    f << "        {" << std::endl;
-    f << "             if(ShouldSwap())" << std::endl;
-    f << "                 return (SwapByte2(v & 0xffff) << 16) | (SwapByte2( v >> 16));" << std::endl;
-    f << "             return v;" << std::endl;
-    f << "        }" << std::endl;
-    f << "        static uint64_t SwapByte8(uint64_t v)" << std::endl;
-    f << "        {" << std::endl;
-    f << "             if(ShouldSwap())" << std::endl;
-    f << "                 return (((uint64_t)SwapByte4((uint32_t)(v & 0xffffffffull))) << 32) | (SwapByte4((uint32_t)(v >> 32)));" << std::endl;
-    f << "             return v;" << std::endl;
-    f << "        }" << std::endl;
-    f << "        static void SwapBytes(uint8_t& v1, uint8_t& v2)" << std::endl;
-    f << "        {" << std::endl;
-    f << "            uint8_t tmp = v1;" << std::endl;
-    f << "            v1 = v2;" << std::endl;
-    f << "            v2 = tmp;" << std::endl;
-    f << "        }" << std::endl;
-    f << "        static float SwapByte4f(float v)" << std::endl;
-    f << "        {" << std::endl;
-    f << "             union { float f; uint8_t c[4]; };" << std::endl;
-    f << "             f = v;" << std::endl;
-    f << "             if(ShouldSwap())" << std::endl;
-    f << "             {" << std::endl;
-    f << "                 SwapBytes(c[0], c[3]);" << std::endl;
-    f << "                 SwapBytes(c[1], c[2]);" << std::endl;
-    f << "             }" << std::endl;
-    f << "             return f;" << std::endl;
-    f << "        }" << std::endl;
-    f << "        static double SwapByte8f(double v)" << std::endl;
-    f << "        {" << std::endl;
-    f << "             union { double f; uint8_t c[8]; };" << std::endl;
-    f << "             f = v;" << std::endl;
-    f << "             if(ShouldSwap())" << std::endl;
-    f << "             {" << std::endl;
-    f << "                 SwapBytes(c[0], c[7]);" << std::endl;
-    f << "                 SwapBytes(c[1], c[6]);" << std::endl;
-    f << "                 SwapBytes(c[2], c[5]);" << std::endl;
-    f << "                 SwapBytes(c[3], c[4]);" << std::endl;
-    f << "             }" << std::endl;
-    f << "             return f;" << std::endl;
-    f << "        }" << std::endl;
-    f << "    friend class " << options.baseclass << "Factory;" << std::endl;
-    f << "};" << std::endl;
 
+    return size;
+}
 
+// Expression decoding one element of a (non str) member stored at location
+// scope qualifies the swap helpers when used outside of the message classes
+std::string LoadExpr(const DataMember& member, const std::string& location, const std::string& scope)
+{
+    if(GetTypeStorageSize(member.type) == 1)
+        return "(" + member.nativeType + ")*(" + location + ")";
 
+    return "(" + member.nativeType + ")" + scope + "Load" + GetSwapByteSuffix(member.type) + "(" + location + ")";
+}
 
+// Statement encoding value, one element of a (non str) member, at location
+std::string StoreStatement(const DataMember& member, const std::string& location, const std::string& value)
+{
+    if(GetTypeStorageSize(member.type) == 1)
+        return "*(" + location + ") = *((char*)&" + value + ");";
 
+    std::string wireType = member.nativeType;
+    if(member.type != "float" && member.type != "double")
+        wireType = "uint" + ToString(GetTypeSize(member.type) * 8) + "_t";
 
+    return "Store" + GetSwapByteSuffix(member.type) + "(" + location + ", (" + wireType + ")" + value + ");";
+}
 
+// Mask of the bits of a packed member, as a literal
+std::string GetBitMask(const DataMember& member)
+{
+    if(member.bits == 64)
+        return "~(uint64_t)0";
+    if(member.bits > 31)
+        return "(((uint64_t)1 << " + ToString(member.bits) + ") - 1)";
 
+    std::ostringstream mask;
+    mask << "0x" << std::hex << ((1u << member.bits) - 1);
+    return mask.str();
+}
 
-    for(size_t i = 0; i < messageList.size(); ++i)
+// Expression decoding a packed member from the word bits, where it's at shift
+std::string PackedLoadExpr(const DataMember& member, const std::string& bits, const std::string& shift)
+{
+    std::string value = (shift == "0" ? bits : "(" + bits + " >> " + shift + ")");
+    if(member.bits < 64)
+        value = "(" + value + " & " + GetBitMask(member) + ")";
+    if(member.type == "bool")
+        return value + " != 0";
+    if(IsSigned(member) && member.type.find(':') != std::string::npos)
     {
-        const Message& msg = messageList[i];
-        f << "class " << msg.name << " : public " << options.baseclass << std::endl;
-        f << "{" << std::endl;
+        // Sign extension of the member.bits bits value
+        std::string sign = (member.bits > 32 ? "((uint64_t)1 << " + ToString(member.bits - 1) + ")" : "(uint64_t)" + ToString(1u << (member.bits - 1)) + "u");
+        if(member.bits < 64)
+            value = "((" + value + " ^ " + sign + ") - " + sign + ")";
+    }
 
-        f << "    public:" << std::endl;
-        for(size_t j = 0; j < msg.memberList.size(); ++j)
-        {
-            const DataMember& member = msg.memberList[j];
-            f << "        " << member.nativeType << " " << member.name;
-            if(member.count != 1)
-                f << "[" << member.count << "]";
-            f << ";" << std::endl;
-        }
-        f << "        " << msg.name << "() {}" << std::endl;
-        std::string ctorParams;
-        std::string ctorInitializer;
+    return "(" + member.nativeType + ")" + value;
+}
+
+// Expression of a packed member, given by value, placed at shift in its word
+std::string PackedStoreExpr(const DataMember& member, const std::string& value, const std::string& shift)
+{
+    std::string bits = "(uint64_t)" + value;
+    if(member.bits < 64 && member.type != "bool")
+        bits = "(" + bits + " & " + GetBitMask(member) + ")";
+
+    return (shift == "0" ? bits : "(" + bits + " << " + shift + ")");
+}
+
+// Store (or load) every packed member, in the packed bits at location (which isn't moved)
+void WritePackedCopy(std::ostream& f, const Message& msg, const std::string& location, bool load, const std::string& indent)
+{
+    std::string bits = MangleInternalKeyword("bits");
+    int wordCount = (msg.packedSize + 7) / 8;
+
+    f << indent << "// Packed bits" << std::endl;
+    for(int w = 0; w < wordCount; ++w)
+    {
+        std::string wordLocation = location + (w > 0 ? " + " + ToString(w * 8) : "");
+        int byteCount = (msg.packedSize - w * 8 < 8 ? msg.packedSize - w * 8 : 8);
+        std::string declaration = (w == 0 ? "uint64_t " : "");
+        if(load)
+            f << indent << declaration << bits << " = InternalLoadBits(" << wordLocation << ", " << byteCount << ");" << std::endl;
+        else
+            f << indent << declaration << bits << " = 0;" << std::endl;
         for(size_t j = 0; j < msg.memberList.size(); ++j)
         {
             const DataMember& member = msg.memberList[j];
-            if(member.count == 1)
-                ctorParams += "const " + member.nativeType + "& n_" + MangleInternalKeyword(member.name);
-            else
-                ctorParams += "const " + member.nativeType + " n_" + MangleInternalKeyword(member.name) + "[" + ToString(member.count) + "]";
-            if(member.count == 1)
+            for(int k = 0; IsPacked(member) && k < member.count; ++k)
             {
-                ctorInitializer +=  member.name + "(n_" + MangleInternalKeyword(member.name) + ")";
-                if(j != msg.memberList.size() - 1)
-                    ctorInitializer += ", ";
+                if(member.bitWord + k / member.elementsPerWord != w)
+                    continue;
+                std::string shift = ToString(member.bitShift + k % member.elementsPerWord * member.bits);
+                std::string value = member.name + (member.count > 1 ? "[" + ToString(k) + "]" : "");
+                if(load)
+                    f << indent << value << " = " << PackedLoadExpr(member, bits, shift) << ";" << std::endl;
+                else if(member.optional)
+                {
+                    // An absent member might not be initialized, it is stored as 0
+                    f << indent << "if(" << PresenceTest(member, MangleInternalKeyword("presence")) << ")" << std::endl;
+                    f << indent << "    " << bits << " |= " << PackedStoreExpr(member, value, shift) << ";" << std::endl;
+                }
+                else
+                    f << indent << bits << " |= " << PackedStoreExpr(member, value, shift) << ";" << std::endl;
             }
-            if(j != msg.memberList.size() - 1)
-                ctorParams += ", ";
         }
-        f << "        " << msg.name << "(" << ctorParams << ") : " << ctorInitializer << std::endl;
-        f << "        {" << std::endl;
-        for(size_t j = 0; j < msg.memberList.size(); ++j)
-        {
-            const DataMember& member = msg.memberList[j];
-            if(member.count > 1)
-            {
-                f << "             for(int " << MangleInternalKeyword("i") << " = 0; " << MangleInternalKeyword("i") << " < " << member.count << "; ++" << MangleInternalKeyword("i") << ")" << std::endl;
-                f << "                 " << member.name << "[" << MangleInternalKeyword("i") << "] = n_" << MangleInternalKeyword(member.name) << "[" << MangleInternalKeyword("i") << "];" << std::endl;
+        if(!load)
+            f << indent << "InternalStoreBits(" << wordLocation << ", " << bits << ", " << byteCount << ");" << std::endl;
+    }
+}
+
+// Store (or load) a member of a fixed size message at a constant offset, no pointer arithmetic
+void WriteFixedMemberCopy(std::ostream& f, const DataMember& member, int offset, bool load)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string i = MangleInternalKeyword("i");
+    int size = GetTypeStorageSize(member.type);
+
+    f << "             // " << member.name << std::endl;
+    if(size == 1 && member.count > 1)
+    {
+        // Bytes don't need swapping, copy the whole array at once
+        if(load)
+            f << "             memcpy(" << member.name << ", " << p << " + " << offset << ", " << member.count << ");" << std::endl;
+        else
+            f << "             memcpy(" << p << " + " << offset << ", " << member.name << ", " << member.count << ");" << std::endl;
+        return;
+    }
+
+    if(member.count > 1)
+    {
+        // Byte swap the whole array at once
+        if(load)
+            f << "             InternalCopyBlock((char*)" << member.name << ", " << p << " + " << offset << ", " << member.count << ", " << size << ");" << std::endl;
+        else
+            f << "             InternalCopyBlock(" << p << " + " << offset << ", (const char*)" << member.name << ", " << member.count << ", " << size << ");" << std::endl;
+        return;
+    }
+
+    std::string location = p + " + " + ToString(offset);
+    if(load)
+        f << "             " << MemberExpr(member) << " = " << LoadExpr(member, location, "") << ";" << std::endl;
+    else
+        f << "             " << StoreStatement(member, location, MemberExpr(member)) << std::endl;
+}
+
+// Index of the first member which doesn't have a constant offset in the body, or the
+// number of members when all of them do
+size_t GetFirstVariableMember(const Message& msg, const Options& options)
+{
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        if(IsVariableSize(msg.memberList[j], options) && !IsPacked(msg.memberList[j]))
+            return j;
+    }
+
+    return msg.memberList.size();
+}
+
+// Members located after a variable size member can't have a constant offset: they get an
+// entry in the offset table filled by InternalMeasureBody (one per element for variable size
+// members). Returns the index of each member in that table, -1 when its offset is constant (or
+// when it's in the packed bits)
+std::vector<int> GetOffsetTableIndexList(const Message& msg, const Options& options, int* tableSize)
+{
+    std::vector<int> indexList;
+    size_t first = GetFirstVariableMember(msg, options);
+    *tableSize = 0;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(j < first || IsPacked(member))
+        {
+            indexList.push_back(-1);
+            continue;
+        }
+        indexList.push_back(*tableSize);
+        *tableSize += (IsValueSized(member, options) ? member.count : 1);
+    }
+
+    return indexList;
+}
+
+// Read-only accessor class decoding fields straight from a serialized buffer, on demand
+// Members located after a variable size member can't have a constant offset, their offsets
+// are found once (and the buffer bounds validated) by the bounds pass in the constructor
+void WriteView(std::ostream& f, const Message& msg, const Options& options)
+{
+    // The base class helpers are reached through the message, whose friend the view is
+    std::string scope = msg.name + "::";
+    std::string viewName = msg.name + "View";
+    int headerSize = GetHeaderSize(msg, options);
+
+    int tableSize;
+    std::vector<int> tableIndexList = GetOffsetTableIndexList(msg, options, &tableSize);
+    std::string offsetsArg = (tableSize > 0 ? ", view.m_offsets" : "");
+
+    f << "class " << viewName << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // Invalid view" << std::endl;
+    f << "        " << viewName << "() : m_body(0), m_headerSize(0), m_bodySize(0) {}" << std::endl;
+    f << "        // buffer must stay alive as long as the view is used, nothing is copied" << std::endl;
+    f << "        " << viewName << "(const char* buffer, uint32_t len) : m_body(0), m_headerSize(0), m_bodySize(0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t version, type;" << std::endl;
+    f << "             if(" << scope << "InternalReadHeader(buffer, len, &version, &type) != " << headerSize << " || version != " << scope << "GetVersion() || type != (uint32_t)" << scope << "MT_" << msg.name << ")" << std::endl;
+    f << "                 return;" << std::endl;
+    if(options.framed)
+    {
+        f << "             if(len < " << scope << "Load4(buffer))" << std::endl;
+        f << "                 return;" << std::endl;
+        f << "             len = " << scope << "Load4(buffer);" << std::endl;
+        if(options.checksum)
+        {
+            f << "             if(len < " << headerSize << " + " << scope << "kChecksumSize || !" << scope << "InternalCheckChecksum(buffer, len))" << std::endl;
+            f << "                 return;" << std::endl;
+            f << "             len -= " << scope << "kChecksumSize;" << std::endl;
+        }
+    }
+    f << "             if(!" << msg.name << "::InternalMeasureBody(buffer + " << headerSize << ", len - " << headerSize << ", &m_bodySize" << (tableSize > 0 ? ", m_offsets" : "") << "))" << std::endl;
+    f << "                 return;" << std::endl;
+    if(options.checksum && !options.framed)
+    {
+        f << "             if(len - " << headerSize << " - m_bodySize < " << scope << "kChecksumSize || !" << scope << "InternalCheckChecksum(buffer, " << headerSize << " + m_bodySize + " << scope << "kChecksumSize))" << std::endl;
+        f << "                 return;" << std::endl;
+    }
+    f << "             m_body = buffer + " << headerSize << ";" << std::endl;
+    f << "             m_headerSize = " << headerSize << ";" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // View of a " << msg.name << " nested in another message (a body without header)" << std::endl;
+    f << "        static " << viewName << " FromBody(const char* body, uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             " << viewName << " view;" << std::endl;
+    f << "             if(" << msg.name << "::InternalMeasureBody(body, len, &view.m_bodySize" << offsetsArg << "))" << std::endl;
+    f << "                 view.m_body = body;" << std::endl;
+    f << "             return view;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // The accessors must only be used on a valid view" << std::endl;
+    f << "        bool IsValid() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_body != 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Length of the serialized message (of its body for a nested view), the buffer might" << std::endl;
+    f << "        // hold more data after it" << std::endl;
+    f << "        uint32_t GetSize() const" << std::endl;
+    f << "        {" << std::endl;
+    if(options.checksum)
+        f << "             return m_headerSize ? m_headerSize + m_bodySize + " << scope << "kChecksumSize : m_bodySize;" << std::endl;
+    else
+        f << "             return m_headerSize + m_bodySize;" << std::endl;
+    f << "        }" << std::endl;
+
+    int bitmapSize = GetPresenceBitmapSize(msg);
+    int offset = bitmapSize + msg.packedSize;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string presence = PresenceTest(member, "m_body");
+        if(member.optional)
+        {
+            f << "        bool has_" << member.name << "() const" << std::endl;
+            f << "        {" << std::endl;
+            f << "             return " << presence << " != 0;" << std::endl;
+            f << "        }" << std::endl;
+        }
+
+        if(IsPacked(member))
+        {
+            if(member.optional)
+                f << "        // Returns " << (member.type == "bool" ? "false" : "0") << " when absent" << std::endl;
+            f << "        " << member.nativeType << " " << member.name << "(" << (member.count > 1 ? "int i" : "") << ") const" << std::endl;
+            f << "        {" << std::endl;
+            if(member.optional)
+            {
+                f << "             if(!" << presence << ")" << std::endl;
+                f << "                 return " << member.nativeType << "();" << std::endl;
             }
+            std::string packedLocation = "m_body + " + ToString(bitmapSize);
+            std::string lastByteCount = ToString(msg.packedSize - (msg.packedSize - 1) / 8 * 8);
+            if(member.count > 1 && member.elementsPerWord < member.count)
+            {
+                // The elements of the array span several words
+                f << "             int word = " << member.bitWord << " + i / " << member.elementsPerWord << ";" << std::endl;
+                f << "             uint64_t bits = " << scope << "InternalLoadBits(" << packedLocation << " + word * 8, word < " << (msg.packedSize - 1) / 8 << " ? 8 : " << lastByteCount << ");" << std::endl;
+                f << "             return " << PackedLoadExpr(member, "bits", "(" + ToString(member.bitShift) + " + i % " + ToString(member.elementsPerWord) + " * " + ToString(member.bits) + ")") << ";" << std::endl;
+            }
+            else
+            {
+                std::string byteCount = (member.bitWord == (msg.packedSize - 1) / 8 ? lastByteCount : "8");
+                f << "             uint64_t bits = " << scope << "InternalLoadBits(" << packedLocation << (member.bitWord > 0 ? " + " + ToString(member.bitWord * 8) : "") << ", " << byteCount << ");" << std::endl;
+                std::string shift = ToString(member.bitShift);
+                if(member.count > 1)
+                    shift = "(" + shift + " + i * " + ToString(member.bits) + ")";
+                f << "             return " << PackedLoadExpr(member, "bits", shift) << ";" << std::endl;
+            }
+            f << "        }" << std::endl;
+            continue;
         }
-        f << "        }" << std::endl;
-        //---------------------------------------------------------------------
-        f << "        virtual " << options.baseclass << "::MESSAGE_TYPE GetType() const { return " << options.baseclass << "::MT_" << msg.name << "; }" << std::endl;
-        f << "    protected:" << std::endl;
 
-        //---------------------------------------------------------------------
-        f << "        virtual uint32_t InternalSerializeToBuffer(char* " << MangleInternalKeyword("p") << ", uint32_t " << MangleInternalKeyword("len") << ") const" << std::endl;
+        // Offset of the member (of its element i for arrays) in the body
+        std::string offsetExpr;
+        if(tableIndexList[j] < 0)
+            offsetExpr = ToString(offset);
+        else if(IsValueSized(member, options) && member.count > 1)
+            offsetExpr = "m_offsets[" + ToString(tableIndexList[j]) + " + i]";
+        else
+            offsetExpr = "m_offsets[" + ToString(tableIndexList[j]) + "]";
+        if(!IsValueSized(member, options) && member.count > 1)
+            offsetExpr += " + i * " + ToString(GetTypeStorageSize(member.type));
+        offset += GetTypeStorageSize(member.type) * member.count;
+        std::string location = "m_body + " + offsetExpr;
+
+        std::string returnType = member.nativeType;
+        if(member.type == "str")
+            returnType = scope + "StringRef";
+        else if(member.type == "vec")
+            returnType = scope + "ArrayRef<" + ConvertType(member.elementType) + ">";
+        else if(member.nested)
+            returnType = member.type + "View";
+        if(member.optional)
+            f << "        // Returns " << (member.type == "str" || member.type == "vec" ? "an empty " + member.type : member.nested ? "an invalid view" : "0") << " when absent" << std::endl;
+        f << "        " << returnType << " " << member.name << "(" << (member.count > 1 ? "int i" : "") << ") const" << std::endl;
         f << "        {" << std::endl;
-        f << "             uint32_t " << MangleInternalKeyword("storageSize") << " = InternalCalculateNeededSerializationSize();" << std::endl;
+        if(member.optional)
+        {
+            f << "             if(!" << presence << ")" << std::endl;
+            f << "                 return " << returnType << "();" << std::endl;
+        }
+        if((member.type == "str" || member.type == "vec") && options.compact)
+        {
+            f << "             uint64_t length;" << std::endl;
+            f << "             const char* p = " << scope << "ReadVarint(" << location << ", &length);" << std::endl;
+            f << "             return " << returnType << "(p, (uint32_t)length);" << std::endl;
+        }
+        else if(member.type == "str" || member.type == "vec")
+            f << "             return " << returnType << "(" << location << " + 4, " << scope << "Load4(" << location << "));" << std::endl;
+        else if(member.nested)
+            f << "             return " << returnType << "::FromBody(" << location << ", m_bodySize - (" << offsetExpr << "));" << std::endl;
+        else if(IsVarint(member, options))
+        {
+            f << "             uint64_t value;" << std::endl;
+            f << "             " << scope << "ReadVarint(" << location << ", &value);" << std::endl;
+            if(IsSigned(member))
+                f << "             return (" << member.nativeType << ")" << scope << "UnZigZag(value);" << std::endl;
+            else
+                f << "             return (" << member.nativeType << ")value;" << std::endl;
+        }
+        else
+            f << "             return " << LoadExpr(member, location, scope) << ";" << std::endl;
+        f << "        }" << std::endl;
+    }
+
+    f << "    private:" << std::endl;
+    f << "        const char* m_body;" << std::endl;
+    f << "        uint32_t m_headerSize;" << std::endl;
+    f << "        uint32_t m_bodySize;" << std::endl;
+    if(tableSize > 0)
+        f << "        uint32_t m_offsets[" << tableSize << "];" << std::endl;
+    f << "};" << std::endl;
+}
+
+// Bounds check one element of a value sized member in the body bounds pass (see WriteMeasure)
+// rest is the minimum size of what follows the element, index its entry in the offset table
+void WriteElementMeasure(std::ostream& f, const DataMember& member, const Options& options, const std::string& indent, const std::string& rest, bool hasRest, const std::string& index)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string len = MangleInternalKeyword("len");
+    std::string size = MangleInternalKeyword("size");
+    std::string offsets = MangleInternalKeyword("offsets");
+    std::string offset = MangleInternalKeyword("offset");
+
+    f << indent << "if(" << offsets << ")" << std::endl;
+    f << indent << "    " << offsets << "[" << index << "] = " << offset << ";" << std::endl;
+
+    if(member.nested)
+    {
+        // The nested message checks its own body, in what remains once the rest is reserved
+        std::string bodySize = MangleInternalKeyword("size_" + member.name);
+        f << indent << "uint32_t " << bodySize << ";" << std::endl;
+        f << indent << "if(!" << member.type << "::InternalMeasureBody(" << p << " + " << offset << ", " << len << " - " << offset << " - " << rest << ", &" << bodySize << "))" << std::endl;
+        f << indent << "{" << std::endl;
+        f << indent << "    *" << size << " = SaturateSize((uint64_t)" << offset << " + " << bodySize << " + " << rest << ");" << std::endl;
+        f << indent << "    return false;" << std::endl;
+        f << indent << "}" << std::endl;
+        f << indent << offset << " += " << bodySize << ";" << std::endl;
+        return;
+    }
+
+    std::string varintLen = MangleInternalKeyword("n_" + member.name);
+    if(options.compact)
+    {
+        // Varint (value or string length): its end must be in the buffer
+        f << indent << "uint32_t " << varintLen << " = MeasureVarint(" << p << " + " << offset << ", " << len << " - " << offset << ");" << std::endl;
+        f << indent << "if(!" << varintLen << ")" << std::endl;
+        f << indent << "{" << std::endl;
+        f << indent << "    *" << size << " = SaturateSize((uint64_t)" << len << " + 1 + " << rest << ");" << std::endl;
+        f << indent << "    return false;" << std::endl;
+        f << indent << "}" << std::endl;
+    }
+
+    if(member.type == "str" || member.type == "vec")
+    {
+        // Length prefix (number of elements for a vec) followed by the data
+        std::string strLen = MangleInternalKeyword("len_" + member.name);
+        int width = (member.type == "vec" ? GetTypeStorageSize(member.elementType) : 1);
+        if(options.compact)
+        {
+            f << indent << "uint64_t " << strLen << ";" << std::endl;
+            f << indent << "ReadVarint(" << p << " + " << offset << ", &" << strLen << ");" << std::endl;
+            f << indent << offset << " += " << varintLen << ";" << std::endl;
+            if(hasRest)
+            {
+                f << indent << "if(" << rest << " > " << len << " - " << offset << ")" << std::endl;
+                f << indent << "{" << std::endl;
+                f << indent << "    *" << size << " = SaturateSize((uint64_t)" << offset << " + " << rest << ");" << std::endl;
+                f << indent << "    return false;" << std::endl;
+                f << indent << "}" << std::endl;
+            }
+        }
+        else
+        {
+            f << indent << "uint32_t " << strLen << " = Load4(" << p << " + " << offset << ");" << std::endl;
+            f << indent << offset << " += 4;" << std::endl;
+        }
+        if(width == 1)
+        {
+            f << indent << "if(" << strLen << " > " << len << " - " << offset << " - " << rest << ")" << std::endl;
+            f << indent << "{" << std::endl;
+            f << indent << "    *" << size << " = SaturateSize((uint64_t)" << offset << " + " << strLen << " + " << rest << ");" << std::endl;
+            f << indent << "    return false;" << std::endl;
+            f << indent << "}" << std::endl;
+            f << indent << offset << " += (uint32_t)" << strLen << ";" << std::endl;
+        }
+        else
+        {
+            // Divide instead of multiplying the element count, which could overflow
+            f << indent << "if(" << strLen << " > (" << len << " - " << offset << " - " << rest << ") / " << width << ")" << std::endl;
+            f << indent << "{" << std::endl;
+            std::string count = options.compact ? "(" + strLen + " > 0xffffffff ? 0xffffffff : " + strLen + ")" : strLen;
+            f << indent << "    *" << size << " = SaturateSize((uint64_t)" << offset << " + (uint64_t)" << count << " * " << width << " + " << rest << ");" << std::endl;
+            f << indent << "    return false;" << std::endl;
+            f << indent << "}" << std::endl;
+            f << indent << offset << " += (uint32_t)" << strLen << " * " << width << ";" << std::endl;
+        }
+    }
+    else
+    {
+        f << indent << offset << " += " << varintLen << ";" << std::endl;
+        if(hasRest)
+        {
+            f << indent << "if(" << rest << " > " << len << " - " << offset << ")" << std::endl;
+            f << indent << "{" << std::endl;
+            f << indent << "    *" << size << " = SaturateSize((uint64_t)" << offset << " + " << rest << ");" << std::endl;
+            f << indent << "    return false;" << std::endl;
+            f << indent << "}" << std::endl;
+        }
+    }
+}
+
+// Bounds pass over a serialized message body: walks the variable size members (if any) without
+// decoding anything, so that the decoding functions can then trust the buffer
+void WriteMeasure(std::ostream& f, const Message& msg, const Options& options)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string len = MangleInternalKeyword("len");
+    std::string size = MangleInternalKeyword("size");
+    std::string offsets = MangleInternalKeyword("offsets");
+    std::string offset = MangleInternalKeyword("offset");
+    std::string i = MangleInternalKeyword("i");
+
+    f << "        // Returns true if the whole message body (what follows the header) fits in len bytes" << std::endl;
+    f << "        // size receives the body size, or the minimum needed size when false is returned" << std::endl;
+    f << "        // offsets, if not null, receives the offsets of the members without a constant one" << std::endl;
+    f << "        static bool InternalMeasureBody(const char* " << p << ", uint32_t " << len << ", uint32_t* " << size << ", uint32_t* " << offsets << " = 0)" << std::endl;
+    f << "        {" << std::endl;
+    if(HasFixedSize(msg, options))
+    {
+        f << "             (void)" << p << ";" << std::endl;
+        f << "             (void)" << offsets << ";" << std::endl;
+        f << "             *" << size << " = kWireSize - " << GetHeaderSize(msg, options) << (options.checksum ? " - kChecksumSize" : "") << ";" << std::endl;
+        f << "             return " << len << " >= *" << size << ";" << std::endl;
+        f << "        }" << std::endl;
+        return;
+    }
+
+    // Minimum size of the members following each member
+    std::vector<int> minRestList(msg.memberList.size() + 1, 0);
+    for(size_t j = msg.memberList.size(); j > 0; --j)
+        minRestList[j - 1] = minRestList[j] + GetMinMemberSize(msg.memberList[j - 1], options);
+
+    size_t first = GetFirstVariableMember(msg, options);
+    int constantOffset = GetPresenceBitmapSize(msg) + msg.packedSize;
+    for(size_t j = 0; j < first; ++j)
+        constantOffset += GetTypeStorageSize(msg.memberList[j].type) * msg.memberList[j].count;
+
+    // Invariant: before each member, the buffer is big enough to hold the minimum size of the
+    // remaining members, so fixed size members and string length prefixes are always readable
+    f << "             *" << size << " = " << constantOffset + minRestList[first] << ";" << std::endl;
+    f << "             if(" << len << " < *" << size << ")" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             uint32_t " << offset << " = " << constantOffset << ";" << std::endl;
+
+    int tableIndex = 0;
+    for(size_t j = first; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string indent = "             ";
+        if(IsPacked(member))
+            continue;
+        f << "             // " << member.name << std::endl;
+        if(member.optional)
+        {
+            // Absent optional members take no space, when present restore the invariant
+            f << "             if(" << PresenceTest(member, p) << ")" << std::endl;
+            f << "             {" << std::endl;
+            indent += "    ";
+            int needed = GetMinStorageSize(member, options) * member.count;
+            f << indent << "if(" << needed << " + " << minRestList[j + 1] << " > " << len << " - " << offset << ")" << std::endl;
+            f << indent << "{" << std::endl;
+            f << indent << "    *" << size << " = SaturateSize((uint64_t)" << offset << " + " << needed + minRestList[j + 1] << ");" << std::endl;
+            f << indent << "    return false;" << std::endl;
+            f << indent << "}" << std::endl;
+        }
+
+        if(!IsValueSized(member, options))
+        {
+            f << indent << "if(" << offsets << ")" << std::endl;
+            f << indent << "    " << offsets << "[" << tableIndex << "] = " << offset << ";" << std::endl;
+            f << indent << offset << " += " << GetTypeStorageSize(member.type) * member.count << ";" << std::endl;
+            if(member.optional)
+                f << "             }" << std::endl;
+            tableIndex++;
+            continue;
+        }
+
+        std::string elementIndent = indent;
+        std::string rest = ToString(minRestList[j + 1]);
+        // Whether anything remains to be checked after the member
+        bool hasRest = (minRestList[j + 1] > 0 || member.count > 1);
+        std::string index = ToString(tableIndex);
+        if(member.count > 1)
+        {
+            f << indent << "for(int " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+            f << indent << "{" << std::endl;
+            elementIndent += "    ";
+            rest = "(uint32_t)(" + rest + " + (" + ToString(member.count - 1) + " - " + i + ") * " + ToString(GetMinStorageSize(member, options)) + ")";
+            index += " + " + i;
+        }
+        WriteElementMeasure(f, member, options, elementIndent, rest, hasRest, index);
+        if(member.count > 1)
+            f << indent << "}" << std::endl;
+        if(member.optional)
+            f << "             }" << std::endl;
+        tableIndex += member.count;
+    }
+    f << "             *" << size << " = " << offset << ";" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+}
+
+// Serialize (or deserialize, if load is true) a member of a variable size message, moving p past it
+// baseIndent is the indentation of the generated statements
+void WriteMemberCopy(std::ostream& f, const DataMember& member, const Options& options, bool load, const std::string& baseIndent = "             ")
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string i = MangleInternalKeyword("i");
+    std::string indent = baseIndent;
+
+    f << baseIndent << "// " << member.name << std::endl;
+    if(member.count > 1 && !IsValueSized(member, options))
+    {
+        // Fixed width array, copied (and byte swapped) as a whole
+        int size = GetTypeStorageSize(member.type);
+        if(size == 1 && load)
+            f << baseIndent << "memcpy(" << member.name << ", " << p << ", " << member.count << ");" << std::endl;
+        else if(size == 1)
+            f << baseIndent << "memcpy(" << p << ", " << member.name << ", " << member.count << ");" << std::endl;
+        else if(load)
+            f << baseIndent << "InternalCopyBlock((char*)" << member.name << ", " << p << ", " << member.count << ", " << size << ");" << std::endl;
+        else
+            f << baseIndent << "InternalCopyBlock(" << p << ", (const char*)" << member.name << ", " << member.count << ", " << size << ");" << std::endl;
+        f << baseIndent << p << " += " << size * member.count << ";" << std::endl;
+        return;
+    }
+    if(member.count > 1)
+    {
+        f << baseIndent << "for(int " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+        f << baseIndent << "{" << std::endl;
+        indent += "    ";
+    }
+
+    if(member.nested && load)
+        f << indent << p << " = " << MemberExpr(member) << "." << member.type << "::InternalCreateFromBuffer(" << p << ");" << std::endl;
+    else if(member.nested)
+        f << indent << p << " = " << MemberExpr(member) << "." << member.type << "::InternalSerializeBody(" << p << ");" << std::endl;
+    else if(member.type == "vec" && load)
+    {
+        // Element count, then the elements copied (and byte swapped) as a whole
+        std::string count = "count_" + member.name;
+        int width = GetTypeStorageSize(member.elementType);
+        if(options.compact)
+        {
+            f << indent << "uint64_t " << count << ";" << std::endl;
+            f << indent << p << " = ReadVarint(" << p << ", &" << count << ");" << std::endl;
+        }
+        else
+        {
+            f << indent << "uint32_t " << count << " = Load4(" << p << ");" << std::endl;
+            f << indent << p << " += 4;" << std::endl;
+        }
+        // resize() reuses the capacity of the vector when decoding into an existing message
+        f << indent << member.name << ".resize((size_t)" << count << ");" << std::endl;
+        f << indent << "if(" << count << ")" << std::endl;
+        f << indent << "    InternalCopyBlock((char*)&" << member.name << "[0], " << p << ", (uint32_t)" << count << ", " << width << ");" << std::endl;
+        f << indent << p << " += " << count << " * " << width << ";" << std::endl;
+    }
+    else if(member.type == "vec")
+    {
+        int width = GetTypeStorageSize(member.elementType);
+        if(options.compact)
+            f << indent << p << " = WriteVarint(" << p << ", " << member.name << ".size());" << std::endl;
+        else
+        {
+            f << indent << "Store4(" << p << ", (uint32_t)" << member.name << ".size());" << std::endl;
+            f << indent << p << " += 4;" << std::endl;
+        }
+        f << indent << "if(!" << member.name << ".empty())" << std::endl;
+        f << indent << "    InternalCopyBlock(" << p << ", (const char*)&" << member.name << "[0], (uint32_t)" << member.name << ".size(), " << width << ");" << std::endl;
+        f << indent << p << " += " << member.name << ".size() * " << width << ";" << std::endl;
+    }
+    else if(member.type == "str" && load)
+    {
+        std::string strLen = "len_" + member.name;
+        if(options.compact)
+        {
+            f << indent << "uint64_t " << strLen << ";" << std::endl;
+            f << indent << p << " = ReadVarint(" << p << ", &" << strLen << ");" << std::endl;
+        }
+        else
+        {
+            f << indent << "uint32_t " << strLen << " = Load4(" << p << ");" << std::endl;
+            f << indent << p << " += 4;" << std::endl;
+        }
+        // assign() reuses the capacity of the string when decoding into an existing message
+        f << indent << MemberExpr(member) << ".assign(" << p << ", (size_t)" << strLen << ");" << std::endl;
+        f << indent << p << " += " << strLen << ";" << std::endl;
+    }
+    else if(member.type == "str")
+    {
+        if(options.compact)
+            f << indent << p << " = WriteVarint(" << p << ", " << MemberExpr(member) << ".length());" << std::endl;
+        else
+        {
+            f << indent << "Store4(" << p << ", (uint32_t)" << MemberExpr(member) << ".length());" << std::endl;
+            f << indent << p << " += 4;" << std::endl;
+        }
+        f << indent << "memcpy(" << p << ", " << MemberExpr(member) << ".c_str(), " << MemberExpr(member) << ".length());" << std::endl;
+        f << indent << p << " += " << MemberExpr(member) << ".length();" << std::endl;
+    }
+    else if(IsVarint(member, options) && load)
+    {
+        std::string value = "value_" + member.name;
+        f << indent << "uint64_t " << value << ";" << std::endl;
+        f << indent << p << " = ReadVarint(" << p << ", &" << value << ");" << std::endl;
+        if(IsSigned(member))
+            f << indent << MemberExpr(member) << " = (" << member.nativeType << ")UnZigZag(" << value << ");" << std::endl;
+        else
+            f << indent << MemberExpr(member) << " = (" << member.nativeType << ")" << value << ";" << std::endl;
+    }
+    else if(IsVarint(member, options))
+    {
+        if(IsSigned(member))
+            f << indent << p << " = WriteVarint(" << p << ", ZigZag(" << MemberExpr(member) << "));" << std::endl;
+        else
+            f << indent << p << " = WriteVarint(" << p << ", " << MemberExpr(member) << ");" << std::endl;
+    }
+    else
+    {
+        if(load)
+            f << indent << MemberExpr(member) << " = " << LoadExpr(member, p, "") << ";" << std::endl;
+        else
+            f << indent << StoreStatement(member, p, MemberExpr(member)) << std::endl;
+        f << indent << p << " += " << GetTypeStorageSize(member.type) << ";" << std::endl;
+    }
+
+    if(member.count > 1)
+        f << baseIndent << "}" << std::endl;
+}
+
+// Add the part of the storage size of a member which isn't known at generation time
+void WriteMemberSizeComputation(std::ostream& f, const DataMember& member, const Options& options)
+{
+    std::string size = MangleInternalKeyword("size");
+    std::string i = MangleInternalKeyword("i");
+    std::string indent = "             ";
+
+    if(!IsVariableSize(member, options) || IsPacked(member))
+        return;
+
+    if(member.optional)
+    {
+        // Nothing is stored for absent members
+        f << "             if(" << PresenceTest(member, MangleInternalKeyword("presence")) << ")" << std::endl;
+        f << "             {" << std::endl;
+        indent += "    ";
+        if(GetMemberStaticStorageSize(member, options) > 0)
+            f << indent << size << " += " << GetMemberStaticStorageSize(member, options) << ";" << std::endl;
+    }
+    if(IsValueSized(member, options))
+    {
+        std::string elementIndent = indent;
+        if(member.count > 1)
+        {
+            f << indent << "for(int " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+            elementIndent += "    ";
+        }
+        if(member.nested)
+            f << elementIndent << size << " += " << MemberExpr(member) << "." << member.type << "::InternalCalculateNeededSerializationSize() - InternalHeaderSize(" << options.baseclass << "::MT_" << member.type << ");" << std::endl;
+        else if(member.type == "vec" && options.compact)
+            f << elementIndent << size << " += VarintSize(" << member.name << ".size()) + " << member.name << ".size() * " << GetTypeStorageSize(member.elementType) << ";" << std::endl;
+        else if(member.type == "vec")
+            f << elementIndent << size << " += " << member.name << ".size() * " << GetTypeStorageSize(member.elementType) << ";" << std::endl;
+        else if(member.type == "str" && options.compact)
+            f << elementIndent << size << " += VarintSize(" << MemberExpr(member) << ".length()) + " << MemberExpr(member) << ".length();" << std::endl;
+        else if(member.type == "str")
+            f << elementIndent << size << " += " << MemberExpr(member) << ".length();" << std::endl;
+        else if(IsSigned(member))
+            f << elementIndent << size << " += VarintSize(ZigZag(" << MemberExpr(member) << "));" << std::endl;
+        else
+            f << elementIndent << size << " += VarintSize(" << MemberExpr(member) << ");" << std::endl;
+    }
+    if(member.optional)
+        f << "             }" << std::endl;
+}
+
+// Serialize (or deserialize, if load is true) the body of a variable size message: the presence
+// bitmap and the packed bits, if any, then every other member present
+void WriteBodyCopy(std::ostream& f, const Message& msg, const Options& options, bool load)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string presence = MangleInternalKeyword("presence");
+    int bitmapSize = GetPresenceBitmapSize(msg);
+
+    if(bitmapSize > 0)
+    {
+        f << "             // Presence bitmap" << std::endl;
+        if(load)
+            f << "             memcpy(" << presence << ", " << p << ", " << bitmapSize << ");" << std::endl;
+        else
+            f << "             memcpy(" << p << ", " << presence << ", " << bitmapSize << ");" << std::endl;
+        f << "             " << p << " += " << bitmapSize << ";" << std::endl;
+    }
+    if(msg.packedSize > 0)
+    {
+        WritePackedCopy(f, msg, p, load, "             ");
+        f << "             " << p << " += " << msg.packedSize << ";" << std::endl;
+    }
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(IsPacked(member))
+            continue;
+        if(!member.optional)
+        {
+            WriteMemberCopy(f, member, options, load);
+            continue;
+        }
+        f << "             if(" << PresenceTest(member, presence) << ")" << std::endl;
+        f << "             {" << std::endl;
+        WriteMemberCopy(f, member, options, load, "                 ");
+        f << "             }" << std::endl;
+    }
+}
+
+// Number of bytes of the changed member bitmap starting a delta
+int GetDeltaBitmapSize(const Message& msg)
+{
+    return (int)(msg.memberList.size() + 7) / 8;
+}
+
+// Returns the condition telling whether a member differs from the same member of other, after
+// writing the statements it needs (if any)
+std::string WriteMemberChanged(std::ostream& f, const DataMember& member, const std::string& other)
+{
+    std::string i = MangleInternalKeyword("i");
+    std::string presence = MangleInternalKeyword("presence");
+    std::string changed;
+    if((member.type == "str" || member.nested) && member.count > 1)
+    {
+        // Compare the elements one by one
+        changed = MangleInternalKeyword("changed_" + member.name);
+        std::string elementChanged;
+        if(member.nested)
+            elementChanged = "!" + member.name + "[" + i + "]." + member.type + "::InternalEquals(" + other + "." + member.name + "[" + i + "])";
+        else
+            elementChanged = member.name + "[" + i + "] != " + other + "." + member.name + "[" + i + "]";
+        f << "             bool " << changed << " = false;" << std::endl;
+        f << "             for(int " << i << " = 0; " << i << " < " << member.count << " && !" << changed << "; ++" << i << ")" << std::endl;
+        f << "                 " << changed << " = (" << elementChanged << ");" << std::endl;
+    }
+    else if(member.nested)
+        changed = "!" + member.name + "." + member.type + "::InternalEquals(" + other + "." + member.name + ")";
+    else if(member.type == "str")
+        changed = member.name + " != " + other + "." + member.name;
+    else if(member.type == "vec")
+    {
+        // Bitwise comparison of the elements, like the other numbers
+        changed = member.name + ".size() != " + other + "." + member.name + ".size() || (!" + member.name + ".empty() && memcmp(&" + member.name + "[0], &" + other + "." + member.name + "[0], " + member.name + ".size() * " + ToString(GetTypeStorageSize(member.elementType)) + ") != 0)";
+    }
+    else if(member.count > 1)
+        changed = "memcmp(" + member.name + ", " + other + "." + member.name + ", sizeof(" + member.name + ")) != 0";
+    else
+    {
+        // Bitwise comparison, so that NaN doesn't look changed forever
+        changed = "memcmp(&" + member.name + ", &" + other + "." + member.name + ", sizeof(" + member.name + ")) != 0";
+    }
+    if(member.optional)
+    {
+        // Changed when added, removed, or present with another value
+        std::string has = "(" + PresenceTest(member, presence) + " != 0)";
+        std::string hadBefore = "(" + PresenceTest(member, other + "." + presence) + " != 0)";
+        changed = has + " != " + hadBefore + " || (" + has + " && (" + changed + "))";
+    }
+
+    return changed;
+}
+
+// Field-level delta encoding against a previous state of the message: a bitmap of the changed
+// members, followed by the changed members only (encoded like in the message body)
+void WriteDelta(std::ostream& f, const Message& msg, const Options& options)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string prev = MangleInternalKeyword("prev");
+    std::string out = MangleInternalKeyword("out");
+    std::string presence = MangleInternalKeyword("presence");
+    int bitmapSize = GetDeltaBitmapSize(msg);
+
+    f << "        // A delta starts with a bitmap of the changed members (bit j % 8 of byte j / 8 for the" << std::endl;
+    f << "        // member j, in declaration order) followed by the changed members, without any header" << std::endl;
+    if(msg.optionalCount > 0)
+        f << "        // The presence bitmap follows the changed member bitmap, absent members aren't stored" << std::endl;
+    if(msg.packedSize > 0)
+        f << "        // All the packed bits are stored (before the other members) when any packed member changed" << std::endl;
+    f << "        static const uint32_t kDeltaBitmapSize = " << bitmapSize << ";" << std::endl;
+    f << "        // Size of the biggest possible delta (when every member changed)" << std::endl;
+    f << "        uint32_t CalculateNeededDeltaSize() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return kDeltaBitmapSize + InternalCalculateNeededSerializationSize() - InternalHeaderSize(" << options.baseclass << "::MT_" << msg.name << ");" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Encode the members which differ from " << prev << ", out must hold at least" << std::endl;
+    f << "        // CalculateNeededDeltaSize() bytes, returns the length of the delta" << std::endl;
+    f << "        uint32_t SerializeDelta(const " << msg.name << "& " << prev << ", char* " << out << ") const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             memset(" << out << ", 0, kDeltaBitmapSize);" << std::endl;
+    f << "             char* " << p << " = " << out << " + kDeltaBitmapSize;" << std::endl;
+    if(msg.optionalCount > 0)
+    {
+        f << "             memcpy(" << p << ", " << presence << ", " << GetPresenceBitmapSize(msg) << ");" << std::endl;
+        f << "             " << p << " += " << GetPresenceBitmapSize(msg) << ";" << std::endl;
+    }
+    if(msg.packedSize > 0)
+    {
+        // The packed bits are stored as a whole when any packed member changed
+        std::string packed = MangleInternalKeyword("packed");
+        f << "             bool " << packed << " = false;" << std::endl;
+        for(size_t j = 0; j < msg.memberList.size(); ++j)
+        {
+            const DataMember& member = msg.memberList[j];
+            if(!IsPacked(member))
+                continue;
+            f << "             if(" << WriteMemberChanged(f, member, prev) << ")" << std::endl;
+            f << "             {" << std::endl;
+            f << "                 " << out << "[" << j / 8 << "] |= (char)" << (1 << (j % 8)) << ";" << std::endl;
+            f << "                 " << packed << " = true;" << std::endl;
+            f << "             }" << std::endl;
+        }
+        f << "             if(" << packed << ")" << std::endl;
+        f << "             {" << std::endl;
+        WritePackedCopy(f, msg, p, false, "                 ");
+        f << "                 " << p << " += " << msg.packedSize << ";" << std::endl;
+        f << "             }" << std::endl;
+    }
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(IsPacked(member))
+            continue;
+        std::string changed = WriteMemberChanged(f, member, prev);
+        f << "             if(" << changed << ")" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 " << out << "[" << j / 8 << "] |= (char)" << (1 << (j % 8)) << ";" << std::endl;
+        if(member.optional)
+        {
+            f << "                 if(" << PresenceTest(member, presence) << ")" << std::endl;
+            f << "                 {" << std::endl;
+            WriteMemberCopy(f, member, options, false, "                     ");
+            f << "                 }" << std::endl;
+        }
+        else
+            WriteMemberCopy(f, member, options, false, "                 ");
+        f << "             }" << std::endl;
+    }
+    f << "             return (uint32_t)(" << p << " - " << out << ");" << std::endl;
+    f << "        }" << std::endl;
+
+    f << "        // Update target (which must be in the state the delta was computed from) with a delta" << std::endl;
+    f << "        // returns the length of the delta, or 0 if it doesn't fit in len bytes (target is then unchanged)" << std::endl;
+    f << "        static uint32_t ApplyDelta(" << msg.name << "& target, const char* in, uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size = " << msg.name << "::InternalMeasureDelta(in, len);" << std::endl;
+    f << "             if(size)" << std::endl;
+    f << "                 target." << msg.name << "::InternalApplyDelta(in);" << std::endl;
+    f << "             return size;" << std::endl;
+    f << "        }" << std::endl;
+}
+
+// Bounds check a member of a delta, moving p past it (returns 0 from the generated function if it doesn't fit)
+void WriteMemberMeasure(std::ostream& f, const DataMember& member, const Options& options, const std::string& baseIndent)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string end = MangleInternalKeyword("end");
+    std::string i = MangleInternalKeyword("i");
+    std::string indent = baseIndent;
+
+    if(!IsValueSized(member, options))
+    {
+        int size = GetTypeStorageSize(member.type) * member.count;
+        f << indent << "if(" << end << " - " << p << " < " << size << ")" << std::endl;
+        f << indent << "    return 0;" << std::endl;
+        f << indent << p << " += " << size << ";" << std::endl;
+        return;
+    }
+
+    if(member.count > 1)
+    {
+        f << indent << "for(int " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+        f << indent << "{" << std::endl;
+        indent += "    ";
+    }
+    if(member.nested)
+    {
+        std::string bodySize = MangleInternalKeyword("size_" + member.name);
+        f << indent << "uint32_t " << bodySize << ";" << std::endl;
+        f << indent << "if(!" << member.type << "::InternalMeasureBody(" << p << ", (uint32_t)(" << end << " - " << p << "), &" << bodySize << "))" << std::endl;
+        f << indent << "    return 0;" << std::endl;
+        f << indent << p << " += " << bodySize << ";" << std::endl;
+        if(member.count > 1)
+            f << baseIndent << "}" << std::endl;
+        return;
+    }
+    std::string varintLen = MangleInternalKeyword("n_" + member.name);
+    if(options.compact)
+    {
+        f << indent << "uint32_t " << varintLen << " = MeasureVarint(" << p << ", (uint32_t)(" << end << " - " << p << "));" << std::endl;
+        f << indent << "if(!" << varintLen << ")" << std::endl;
+        f << indent << "    return 0;" << std::endl;
+    }
+    if(member.type == "str" || member.type == "vec")
+    {
+        int width = (member.type == "vec" ? GetTypeStorageSize(member.elementType) : 1);
+        std::string strLen = MangleInternalKeyword("len_" + member.name);
+        if(options.compact)
+        {
+            f << indent << "uint64_t " << strLen << ";" << std::endl;
+            f << indent << "ReadVarint(" << p << ", &" << strLen << ");" << std::endl;
+            f << indent << p << " += " << varintLen << ";" << std::endl;
+        }
+        else
+        {
+            f << indent << "if(" << end << " - " << p << " < 4)" << std::endl;
+            f << indent << "    return 0;" << std::endl;
+            f << indent << "uint32_t " << strLen << " = Load4(" << p << ");" << std::endl;
+            f << indent << p << " += 4;" << std::endl;
+        }
+        if(width == 1)
+        {
+            f << indent << "if((uint64_t)(" << end << " - " << p << ") < " << strLen << ")" << std::endl;
+            f << indent << "    return 0;" << std::endl;
+            f << indent << p << " += " << strLen << ";" << std::endl;
+        }
+        else
+        {
+            f << indent << "if((uint64_t)(" << end << " - " << p << ") / " << width << " < " << strLen << ")" << std::endl;
+            f << indent << "    return 0;" << std::endl;
+            f << indent << p << " += " << strLen << " * " << width << ";" << std::endl;
+        }
+    }
+    else
+        f << indent << p << " += " << varintLen << ";" << std::endl;
+    if(member.count > 1)
+        f << baseIndent << "}" << std::endl;
+}
+
+// Protected part of the delta encoding: bounds pass and decoding
+void WriteDeltaInternals(std::ostream& f, const Message& msg, const Options& options)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string end = MangleInternalKeyword("end");
+    std::string in = MangleInternalKeyword("in");
+    std::string len = MangleInternalKeyword("len");
+    std::string presence = MangleInternalKeyword("presence");
+    int bitmapSize = GetPresenceBitmapSize(msg);
+
+    // Condition telling whether any packed member changed
+    std::string packedChanged;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        if(IsPacked(msg.memberList[j]))
+            packedChanged += std::string(packedChanged == "" ? "" : " || ") + "(" + in + "[" + ToString(j / 8) + "] & " + ToString(1 << (j % 8)) + ")";
+    }
+
+    f << "        // Returns the length of the delta, or 0 if it doesn't fit in len bytes" << std::endl;
+    f << "        static uint32_t InternalMeasureDelta(const char* " << in << ", uint32_t " << len << ")" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(" << len << " < kDeltaBitmapSize + " << bitmapSize << ")" << std::endl;
+    f << "                 return 0;" << std::endl;
+    f << "             const char* " << p << " = " << in << " + kDeltaBitmapSize + " << bitmapSize << ";" << std::endl;
+    f << "             const char* " << end << " = " << in << " + " << len << ";" << std::endl;
+    if(msg.packedSize > 0)
+    {
+        f << "             // Packed bits" << std::endl;
+        f << "             if(" << packedChanged << ")" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 if(" << end << " - " << p << " < " << msg.packedSize << ")" << std::endl;
+        f << "                     return 0;" << std::endl;
+        f << "                 " << p << " += " << msg.packedSize << ";" << std::endl;
+        f << "             }" << std::endl;
+    }
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(IsPacked(member))
+            continue;
+        f << "             // " << member.name << std::endl;
+        std::string test = in + "[" + ToString(j / 8) + "] & " + ToString(1 << (j % 8));
+        if(member.optional)
+            test += " && " + PresenceTest(member, "(" + in + " + kDeltaBitmapSize)");
+        f << "             if(" << test << ")" << std::endl;
+        f << "             {" << std::endl;
+        WriteMemberMeasure(f, member, options, "                 ");
+        f << "             }" << std::endl;
+    }
+    f << "             return (uint32_t)(" << p << " - " << in << ");" << std::endl;
+    f << "        }" << std::endl;
+
+    f << "        // The delta must have been validated with InternalMeasureDelta" << std::endl;
+    f << "        void InternalApplyDelta(const char* " << in << ")" << std::endl;
+    f << "        {" << std::endl;
+    f << "             const char* " << p << " = " << in << " + kDeltaBitmapSize + " << bitmapSize << ";" << std::endl;
+    if(msg.packedSize > 0)
+    {
+        // Unchanged packed members have the same value in the delta
+        f << "             if(" << packedChanged << ")" << std::endl;
+        f << "             {" << std::endl;
+        WritePackedCopy(f, msg, p, true, "                 ");
+        f << "                 " << p << " += " << msg.packedSize << ";" << std::endl;
+        f << "             }" << std::endl;
+    }
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(IsPacked(member) && !member.optional)
+            continue;
+        f << "             if(" << in << "[" << j / 8 << "] & " << (1 << (j % 8)) << ")" << std::endl;
+        f << "             {" << std::endl;
+        if(member.optional && IsPacked(member))
+        {
+            // Only the presence bit, the value is in the packed bits
+            std::string byte = presence + "[" + ToString(member.presenceIndex / 8) + "]";
+            int bit = 1 << (member.presenceIndex % 8);
+            f << "                 if(" << PresenceTest(member, "(" + in + " + kDeltaBitmapSize)") << ")" << std::endl;
+            f << "                     " << byte << " |= " << bit << ";" << std::endl;
+            f << "                 else" << std::endl;
+            f << "                     " << byte << " &= (uint8_t)~" << bit << ";" << std::endl;
+        }
+        else if(member.optional)
+        {
+            // Added, removed or modified
+            std::string byte = presence + "[" + ToString(member.presenceIndex / 8) + "]";
+            int bit = 1 << (member.presenceIndex % 8);
+            f << "                 if(" << PresenceTest(member, "(" + in + " + kDeltaBitmapSize)") << ")" << std::endl;
+            f << "                 {" << std::endl;
+            f << "                     " << byte << " |= " << bit << ";" << std::endl;
+            WriteMemberCopy(f, member, options, true, "                     ");
+            f << "                 }" << std::endl;
+            f << "                 else" << std::endl;
+            f << "                     " << byte << " &= (uint8_t)~" << bit << ";" << std::endl;
+        }
+        else
+            WriteMemberCopy(f, member, options, true, "                 ");
+        f << "             }" << std::endl;
+    }
+    f << "        }" << std::endl;
+}
+
+// Comparison used when the message is nested in another one, same rules as the delta encoding
+void WriteEquals(std::ostream& f, const Message& msg)
+{
+    std::string other = MangleInternalKeyword("other");
+
+    f << "        bool InternalEquals(const " << msg.name << "& " << other << ") const" << std::endl;
+    f << "        {" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        std::string changed = WriteMemberChanged(f, msg.memberList[j], other);
+        f << "             if(" << changed << ")" << std::endl;
+        f << "                 return false;" << std::endl;
+    }
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+}
+
+// Fast path for messages without variable size members: the size is a compile-time constant and
+// every member lives at a constant offset, so no size computation or pointer bumping is needed
+void WriteFixedSerialization(std::ostream& f, const Message& msg, const Options& options)
+{
+    std::string p = MangleInternalKeyword("p");
+    std::string version = MangleInternalKeyword("version");
+    std::string type = MangleInternalKeyword("type");
+    int headerSize = GetHeaderSize(msg, options);
+
+    f << "        // Serialize to buffer, which must hold at least kWireSize bytes" << std::endl;
+    f << "        // returns the length stored in buffer (always kWireSize)" << std::endl;
+    f << "        uint32_t SerializeFixed(char* " << p << ") const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             InternalWriteHeader(" << p << ", " << options.baseclass << "::MT_" << msg.name << ", kWireSize);" << std::endl;
+    f << "             " << msg.name << "::InternalSerializeBody(" << p << " + " << headerSize << ");" << std::endl;
+    if(options.checksum)
+        f << "             InternalStoreChecksum(" << p << ", kWireSize);" << std::endl;
+    f << "             return kWireSize;" << std::endl;
+    f << "        }" << std::endl;
+
+    f << "        // Same as SerializeFixed(char*), but fails to compile if buffer is smaller than kWireSize" << std::endl;
+    f << "        template <size_t N>" << std::endl;
+    f << "        uint32_t SerializeFixedChecked(char (&buffer)[N]) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             (void)sizeof(char[(N >= kWireSize) ? 1 : -1]);" << std::endl;
+    f << "             return SerializeFixed(buffer);" << std::endl;
+    f << "        }" << std::endl;
+
+    f << "        // Load from a buffer holding at least kWireSize bytes" << std::endl;
+    f << "        // returns false if the buffer doesn't contain a " << msg.name << " of the current version" << (options.checksum ? " (or if its checksum is wrong)" : "") << std::endl;
+    f << "        bool ParseFixed(const char* " << p << ")" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t " << version << ", " << type << ";" << std::endl;
+    f << "             if(InternalReadHeader(" << p << ", kWireSize, &" << version << ", &" << type << ") != " << headerSize << " || " << version << " != GetVersion() || " << type << " != (uint32_t)" << options.baseclass << "::MT_" << msg.name << ")" << std::endl;
+    f << "                 return false;" << std::endl;
+    if(options.checksum)
+    {
+        f << "             if(!InternalCheckChecksum(" << p << ", kWireSize))" << std::endl;
+        f << "                 return false;" << std::endl;
+    }
+    f << "             " << msg.name << "::InternalDecode(" << p << " + " << headerSize << ", " << headerSize << (options.checksum ? " + kChecksumSize" : "") << ");" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+}
+
+// A C++ identifier
+bool IsIdentifier(const std::string& name)
+{
+    if(name.empty() || isdigit((unsigned char)name[0]))
+        return false;
+    for(size_t i = 0; i < name.size(); ++i)
+    {
+        if(!isalnum((unsigned char)name[i]) && name[i] != '_')
+            return false;
+    }
+    return true;
+}
+
+// Enum (or enum value) already using name, 0 if none. The enum values share the scope of the
+// enums, messages and message types (MT_Name)
+const Enum* FindEnumName(const std::string& name, const EnumList& enumList)
+{
+    for(size_t i = 0; i < enumList.size(); ++i)
+    {
+        if(enumList[i].name == name)
+            return &enumList[i];
+        for(size_t j = 0; j < enumList[i].nameList.size(); ++j)
+        {
+            if(enumList[i].nameList[j] == name)
+                return &enumList[i];
+        }
+    }
+    return 0;
+}
+
+// Parse "enum Name { A, B = 4, C }", values follow the previous one unless given
+bool ParseEnum(const std::string& line, int lineNumber, const MessageList& messageList, EnumList& enumList)
+{
+    std::string::size_type open = line.find('{');
+    std::string::size_type close = line.find('}');
+    if(open == std::string::npos || close == std::string::npos || close < open)
+    {
+        std::cout << "Invalid enum line: " << line << std::endl;
+        return false;
+    }
+
+    Enum e;
+    e.name = Trim(line.substr(5, open - 5));
+    e.line = lineNumber;
+    bool used = (e.name == "" || ConvertType(e.name) != "" || e.name == "bool");
+    for(size_t i = 0; i < messageList.size(); ++i)
+        used = used || (messageList[i].name == e.name);
+    used = used || FindEnumName(e.name, enumList);
+    if(used)
+    {
+        std::cout << "Invalid or already used enum name: " << line << std::endl;
+        return false;
+    }
+
+    std::string values = line.substr(open + 1, close - open - 1);
+    // 64 bits so that the value following 2^32 - 1 is caught
+    uint64_t value = 0;
+    uint32_t maxValue = 0;
+    while(Trim(values) != "")
+    {
+        std::string::size_type comma = values.find(',');
+        std::string item = Trim(values.substr(0, comma));
+        values = (comma == std::string::npos ? "" : values.substr(comma + 1));
+
+        std::string::size_type equal = item.find('=');
+        if(equal != std::string::npos)
+        {
+            std::string number = Trim(item.substr(equal + 1));
+            if(number.empty() || number.size() > 10 || number.find_first_not_of("0123456789") != std::string::npos
+               || ToNumber<uint64_t>(number) > 0xffffffff)
+            {
+                std::cout << "Invalid enum value on line " << lineNumber << " (should be a number below 2^32): " << line << std::endl;
+                return false;
+            }
+            value = ToNumber<uint64_t>(number);
+            item = Trim(item.substr(0, equal));
+        }
+        else if(value > 0xffffffff)
+        {
+            std::cout << "Invalid enum value on line " << lineNumber << " (should be a number below 2^32): " << line << std::endl;
+            return false;
+        }
+        bool clash = (item == e.name || FindEnumName(item, enumList) != 0);
+        for(size_t i = 0; i < e.nameList.size(); ++i)
+            clash = clash || (e.nameList[i] == item);
+        for(size_t i = 0; i < messageList.size(); ++i)
+            clash = clash || (messageList[i].name == item || "MT_" + messageList[i].name == item);
+        if(!IsIdentifier(item) || clash)
+        {
+            std::cout << "Invalid or already used enum value name on line " << lineNumber << ": " << line << std::endl;
+            return false;
+        }
+        e.nameList.push_back(item);
+        e.valueList.push_back((uint32_t)value);
+        if(value > maxValue)
+            maxValue = (uint32_t)value;
+        value++;
+    }
+    if(e.nameList.empty())
+    {
+        std::cout << "Empty enum: " << line << std::endl;
+        return false;
+    }
+
+    e.bits = 1;
+    while(e.bits < 32 && (maxValue >> e.bits) != 0)
+        e.bits++;
+    enumList.push_back(e);
+    return true;
+}
+
+// Assign a position in the packed bits to each bit packed member, in declaration order. An
+// element never straddles two 64 bits words, arrays not fitting in the current word start a new one
+void LayoutPackedMembers(Message& msg)
+{
+    int pos = 0;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        DataMember& member = msg.memberList[j];
+        if(member.bits == 0)
+            continue;
+
+        if(pos % 64 + member.bits * member.count <= 64)
+        {
+            member.elementsPerWord = member.count;
+            member.bitWord = pos / 64;
+            member.bitShift = pos % 64;
+            pos += member.bits * member.count;
+        }
+        else if(member.count == 1)
+        {
+            pos = (pos + 63) / 64 * 64;
+            member.bitWord = pos / 64;
+            member.bitShift = 0;
+            pos += member.bits;
+        }
+        else
+        {
+            pos = (pos + 63) / 64 * 64;
+            member.elementsPerWord = 64 / member.bits;
+            member.bitWord = pos / 64;
+            member.bitShift = 0;
+            pos += member.count / member.elementsPerWord * 64 + member.count % member.elementsPerWord * member.bits;
+        }
+    }
+    msg.packedSize = pos / 64 * 8 + (pos % 64 + 7) / 8;
+}
+
+bool ProcessInputFile(const std::string& filename, MessageList& messageList, EnumList& enumList, Options& options)
+{
+    std::ifstream f(filename.c_str());
+    if(!f.is_open())
+        return false;
+
+    Message currentMessage;
+    // Position of the messages and enums in their list, by name
+    std::map<std::string, size_t> messageIndex;
+    std::map<std::string, size_t> enumIndex;
+
+    std::string line;
+    int lineNumber = 0;
+    while(std::getline(f, line))
+    {
+        line = Trim(line);
+        ++lineNumber;
+
+        if(line.length() == 0)
+            continue;
+
+        if(line[0] == '#')
+        {
+            // Skip comment
+            continue;
+        }
+        else if(line.compare(0, 5, "enum ") == 0)
+        {
+            if(!ParseEnum(line, lineNumber, messageList, enumList))
+                return false;
+            enumIndex[enumList.back().name] = enumList.size() - 1;
+        }
+        else if(line[0] == '.')
+        {
+            if(currentMessage.name != "")
+            {
+                messageIndex[currentMessage.name] = messageList.size();
+                messageList.push_back(currentMessage);
+            }
+
+            currentMessage = Message();
+            currentMessage.id = (int)messageList.size();
+            currentMessage.name = line.substr(1);
+            // Enum values declared before would clash with the message or its type (MT_Name)
+            for(size_t i = 0; i < enumList.size(); ++i)
+            {
+                const std::vector<std::string>& nameList = enumList[i].nameList;
+                for(size_t j = 0; j < nameList.size(); ++j)
+                {
+                    if(nameList[j] == currentMessage.name || nameList[j] == "MT_" + currentMessage.name)
+                    {
+                        std::cout << "Invalid message name on line " << lineNumber << ", used by enum " << enumList[i].name << " (line " << enumList[i].line << "): " << line << std::endl;
+                        return false;
+                    }
+                }
+            }
+        }
+        else if(line[0] == '!')
+        {
+            std::string::size_type pos = line.find(' ');
+            if(pos == std::string::npos)
+            {
+                std::cout << "Invalid option line: " << line << std::endl;
+                return false;
+            }
+
+            std::string option = Trim(line.substr(1, pos - 1));
+            std::string value = Trim(line.substr(pos + 1));
+
+            std::cout << "'" << option << "' = '" << value << "'" << std::endl;
+
+            if(option == "version")
+                options.version = ToNumber<uint32_t>(Trim(value));
+            else if(option == "package")
+                options.package = Trim(value);
+            else if(option == "baseclass")
+                options.baseclass = Trim(value);
+            else if(option == "encoding")
+            {
+                if(value != "compact" && value != "fixed")
+                {
+                    std::cout << "Invalid encoding (should be compact or fixed): " << value << std::endl;
+                    return false;
+                }
+                options.compact = (value == "compact");
+            }
+            else if(option == "byteorder")
+            {
+                if(value != "big" && value != "little" && value != "native")
+                {
+                    std::cout << "Invalid byte order (should be big, little or native): " << value << std::endl;
+                    return false;
+                }
+                options.byteorder = value;
+            }
+            else if(option == "framing")
+            {
+                if(value != "length" && value != "none")
+                {
+                    std::cout << "Invalid framing (should be length or none): " << value << std::endl;
+                    return false;
+                }
+                options.framed = (value == "length");
+            }
+            else if(option == "shmring")
+            {
+                if(value != "on" && value != "off")
+                {
+                    std::cout << "Invalid shmring (should be on or off): " << value << std::endl;
+                    return false;
+                }
+                options.shmRing = (value == "on");
+            }
+            else if(option == "log")
+            {
+                if(value != "on" && value != "off")
+                {
+                    std::cout << "Invalid log (should be on or off): " << value << std::endl;
+                    return false;
+                }
+                options.log = (value == "on");
+            }
+            else if(option == "output")
+            {
+                if(value != "single" && value != "split")
+                {
+                    std::cout << "Invalid output (should be single or split): " << value << std::endl;
+                    return false;
+                }
+                options.split = (value == "split");
+            }
+            else if(option == "compression")
+            {
+                if(value != "on" && value != "off")
+                {
+                    std::cout << "Invalid compression (should be on or off): " << value << std::endl;
+                    return false;
+                }
+                options.compression = (value == "on");
+            }
+            else if(option == "checksum")
+            {
+                if(value != "crc32c" && value != "none")
+                {
+                    std::cout << "Invalid checksum (should be crc32c or none): " << value << std::endl;
+                    return false;
+                }
+                options.checksum = (value == "crc32c");
+            }
+            else if(option == "connection")
+            {
+                if(value != "on" && value != "off")
+                {
+                    std::cout << "Invalid connection (should be on or off): " << value << std::endl;
+                    return false;
+                }
+                options.connection = (value == "on");
+            }
+            else if(option == "delta")
+            {
+                if(value != "on" && value != "off")
+                {
+                    std::cout << "Invalid delta (should be on or off): " << value << std::endl;
+                    return false;
+                }
+                options.delta = (value == "on");
+            }
+            else if(option == "columns")
+            {
+                if(value != "on" && value != "off")
+                {
+                    std::cout << "Invalid columns (should be on or off): " << value << std::endl;
+                    return false;
+                }
+                options.columns = (value == "on");
+            }
+            else if(option == "views")
+            {
+                if(value != "on" && value != "off")
+                {
+                    std::cout << "Invalid views (should be on or off): " << value << std::endl;
+                    return false;
+                }
+                options.views = (value == "on");
+            }
+        }
+        else
+        {
+            if(currentMessage.name == "")
+            {
+                std::cout << "Invalid, not in message block" << std::endl;
+                return false;
+            }
+
+            // Optional qualifier
+            bool optional = false;
+            if(line.compare(0, 4, "opt ") == 0 || line.compare(0, 4, "opt\t") == 0)
+            {
+                optional = true;
+                line = Trim(line.substr(4));
+            }
+
+            std::string::size_type pos = line.rfind('\t');
+            if(pos == std::string::npos)
+                pos = line.rfind(' ');
+            if(pos == std::string::npos)
+            {
+                std::cout << "Invalid line: " << line << std::endl;
+                return false;
+            }
+
+            DataMember dataMember;
+            dataMember.name = Trim(line.substr(pos));
+
+            std::string::size_type posLen1 = line.find('[');
+            if(posLen1 != std::string::npos)
+            {
+                pos = posLen1;
+
+                posLen1++;
+                std::string::size_type posLen2 = line.find(']');
+                if(posLen2 == std::string::npos)
+                {
+                    std::cout << "Invalid line, bad array size syntax: " << line << std::endl;
+                    return false;
+                }
+
+                std::string sizeStr = line.substr(posLen1, posLen2 - posLen1);
+                dataMember.count = ToNumber<int>(sizeStr);
+                if(dataMember.count == 0)
+                {
+                    std::cout << "Invalid line, bad array size (" << sizeStr << ")" << std::endl;
+                    return false;
+                }
+            }
+
+            dataMember.type = Trim(line.substr(0, pos));
+            dataMember.nativeType = ConvertType(dataMember.type);
+            std::string::size_type colon = dataMember.type.find(':');
+            if(dataMember.type == "bool")
+            {
+                dataMember.nativeType = "bool";
+                dataMember.bits = 1;
+            }
+            else if(colon != std::string::npos)
+            {
+                // Ranged integer, stored on the given number of bits
+                std::string baseType = Trim(dataMember.type.substr(0, colon));
+                dataMember.bits = ToNumber<int>(Trim(dataMember.type.substr(colon + 1)));
+                if(baseType == "float" || baseType == "double" || baseType == "str" || ConvertType(baseType) == "" || dataMember.bits <= 0 || dataMember.bits > GetTypeSize(baseType) * 8)
+                {
+                    std::cout << "Invalid ranged integer on line (should be like u32:5): " << line << std::endl;
+                    return false;
+                }
+                dataMember.nativeType = ConvertType(baseType);
+            }
+            else if(dataMember.type.compare(0, 4, "vec<") == 0 && dataMember.type[dataMember.type.length() - 1] == '>')
+            {
+                // Variable length array of numbers
+                dataMember.elementType = Trim(dataMember.type.substr(4, dataMember.type.length() - 5));
+                if(ConvertType(dataMember.elementType) == "" || dataMember.elementType == "str" || dataMember.count != 1)
+                {
+                    std::cout << "Invalid vec on line (elements must be numbers, and it can't be an array): " << line << std::endl;
+                    return false;
+                }
+                dataMember.type = "vec";
+                dataMember.nativeType = "std::vector<" + ConvertType(dataMember.elementType) + ">";
+            }
+            else if(dataMember.nativeType == "")
+            {
+                // Message or enum declared above
+                if(messageIndex.count(dataMember.type))
+                {
+                    dataMember.nested = true;
+                    dataMember.nativeType = dataMember.type;
+                }
+                std::map<std::string, size_t>::const_iterator it = enumIndex.find(dataMember.type);
+                if(it != enumIndex.end())
+                {
+                    dataMember.bits = enumList[it->second].bits;
+                    dataMember.nativeType = dataMember.type;
+                }
+            }
+            if(dataMember.nativeType == "")
+            {
+                std::cout << "Invalid type on line: " << line << std::endl;
+                return false;
+            }
+
+            if(optional)
+            {
+                dataMember.optional = true;
+                dataMember.presenceIndex = currentMessage.optionalCount++;
+            }
+            currentMessage.memberList.push_back(dataMember);
+        }
+
+        std::cout << line << "\n";
+    }
+
+    if(currentMessage.name != "")
+    {
+        messageIndex[currentMessage.name] = messageList.size();
+        messageList.push_back(currentMessage);
+    }
+
+    // Nested messages are declared before the messages using them, and all the options are known
+    for(size_t i = 0; i < messageList.size(); ++i)
+    {
+        LayoutPackedMembers(messageList[i]);
+        for(size_t j = 0; j < messageList[i].memberList.size(); ++j)
+        {
+            DataMember& member = messageList[i].memberList[j];
+            if(!member.nested)
+                continue;
+            Message& nestedMsg = messageList[messageIndex[member.type]];
+            member.nestedMinSize = GetMinBodySize(nestedMsg, options);
+            if(nestedMsg.containerList.empty() || nestedMsg.containerList.back() != messageList[i].name)
+                nestedMsg.containerList.push_back(messageList[i].name);
+        }
+    }
+
+    f.close();
+    return true;
+}
+
+// Read and check the header of the message in buffer (of len bytes), in the factory functions
+// returning an ERROR and the needed size: version, type and headerSize are declared. With the
+// framing, len is reduced to the frame size and size receives it (the checksum, if any, is then
+// verified and excluded from len)
+void WriteReadFrameHeader(std::ostream& f, const Options& options)
+{
+    std::string base = options.baseclass;
+
+    f << "             uint32_t version, type;" << std::endl;
+    if(options.framed)
+    {
+        f << "             if(len < 4)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 *size = 4;" << std::endl;
+        f << "                 return NEED_MORE_DATA;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             *size = PeekSize(buffer);" << std::endl;
+        f << "             if(len < *size)" << std::endl;
+        f << "                 return NEED_MORE_DATA;" << std::endl;
+        f << "             len = *size;" << std::endl;
+        if(options.checksum)
+        {
+            f << "             if(len < 4 + " << base << "::kChecksumSize)" << std::endl;
+            f << "                 return BAD_SIZE;" << std::endl;
+            f << "             if(!" << base << "::InternalCheckChecksum(buffer, len))" << std::endl;
+            f << "                 return BAD_CHECKSUM;" << std::endl;
+            f << "             len -= " << base << "::kChecksumSize;" << std::endl;
+        }
+        f << "             uint32_t headerSize = " << base << "::InternalReadHeader(buffer, len, &version, &type);" << std::endl;
+        f << "             if(!headerSize)" << std::endl;
+        f << "                 return BAD_SIZE;" << std::endl;
+    }
+    else
+    {
+        f << "             uint32_t headerSize = " << base << "::InternalReadHeader(buffer, len, &version, &type);" << std::endl;
+        f << "             if(!headerSize)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 *size = " << (options.compact ? "len + 1" : "8") << ";" << std::endl;
+        f << "                 return NEED_MORE_DATA;" << std::endl;
+        f << "             }" << std::endl;
+    }
+    f << "             if(version != " << base << "::GetVersion())" << std::endl;
+    f << "                 return BAD_VERSION;" << std::endl;
+}
+
+// Once the body has been measured in size (with an ERROR in error), make size the size of the
+// whole message. With the framing it's the frame size, and the body not fitting in it is an error.
+// Without it, the checksum (if any) follows the body and is verified once the body is complete
+void WriteFrameSize(std::ostream& f, const Options& options, const std::string& indent)
+{
+    std::string base = options.baseclass;
+
+    if(options.framed)
+    {
+        f << indent << "*size = len" << (options.checksum ? " + " + base + "::kChecksumSize" : "") << ";" << std::endl;
+        f << indent << "if(error == NEED_MORE_DATA)" << std::endl;
+        f << indent << "    error = BAD_SIZE;" << std::endl;
+    }
+    else if(options.checksum)
+    {
+        f << indent << "*size = " << base << "::SaturateSize((uint64_t)*size + headerSize + " << base << "::kChecksumSize);" << std::endl;
+        f << indent << "if(error == NOERROR && len < *size)" << std::endl;
+        f << indent << "    error = NEED_MORE_DATA;" << std::endl;
+        f << indent << "else if(error == NOERROR && !" << base << "::InternalCheckChecksum(buffer, *size))" << std::endl;
+        f << indent << "    error = BAD_CHECKSUM;" << std::endl;
+    }
+    else
+        f << indent << "*size = " << base << "::SaturateSize((uint64_t)*size + headerSize);" << std::endl;
+}
+
+// Type of the elements of the column of a member, or of its pool for a vec member
+std::string GetColumnType(const DataMember& member)
+{
+    if(member.type == "bool")
+        return "uint8_t";
+    if(IsPacked(member) && member.type.find(':') == std::string::npos)
+        return "uint32_t"; // enum
+    if(member.type == "vec")
+        return ConvertType(member.elementType);
+
+    return member.nativeType;
+}
+
+// Storage size of the elements of the column of a member (see GetColumnType)
+int GetColumnWidth(const DataMember& member)
+{
+    if(member.type == "bool")
+        return 1;
+    if(member.type == "vec")
+        return GetTypeStorageSize(member.elementType);
+    if(IsPacked(member) && member.type.find(':') == std::string::npos)
+        return 4;
+    if(IsPacked(member))
+        return GetTypeSize(member.type.substr(0, member.type.find(':')));
+
+    return GetTypeStorageSize(member.type);
+}
+
+// Members with variable size elements, stored in a pool indexed by an offset column
+bool HasPool(const DataMember& member)
+{
+    return member.type == "str" || member.type == "vec" || member.nested;
+}
+
+// Columnar batch: one contiguous column per member for many messages of the same type
+void WriteColumns(std::ostream& f, const Message& msg, const Options& options)
+{
+    // The base class helpers are reached through the message, whose friend the columns are
+    std::string scope = msg.name + "::";
+    std::string factory = options.baseclass + "Factory";
+    std::string className = msg.name + "Columns";
+    std::string i = MangleInternalKeyword("i");
+    std::string k = MangleInternalKeyword("k");
+    std::string n = MangleInternalKeyword("n");
+    std::string p = MangleInternalKeyword("p");
+    std::string end = MangleInternalKeyword("end");
+    std::string size = MangleInternalKeyword("size");
+
+    f << "// Structure of arrays holding many " << msg.name << " messages, with one contiguous column per member" << std::endl;
+    f << "// The columns are in host byte order, so the raw spans can be handed to vectorized scan code" << std::endl;
+    f << "// Strings and nested messages (serialized) are in a pool indexed by an offset column with" << std::endl;
+    f << "// GetCount() * N + 1 entries, vec elements likewise with GetCount() + 1 entries" << std::endl;
+    f << "// Serialized as a header: version (4 bytes), message type (4 bytes) and row count (4 bytes)," << std::endl;
+    f << "// followed by each member in order: its presence bytes if optional, then its column with fixed" << std::endl;
+    f << "// size values, or the end offsets of the elements (4 bytes each) followed by the pool" << std::endl;
+    f << "class " << className << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        " << className << "()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Clear();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void Clear()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             m_rowCount = 0;" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(member.optional)
+            f << "             m_" << member.name << "Presence.clear();" << std::endl;
+        if(HasPool(member))
+        {
+            f << "             m_" << member.name << "Offsets.assign(1, 0);" << std::endl;
+            f << "             m_" << member.name << "Pool.clear();" << std::endl;
+        }
+        else
+            f << "             m_" << member.name << ".clear();" << std::endl;
+    }
+    f << "        }" << std::endl;
+    f << "        uint32_t GetCount() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_rowCount;" << std::endl;
+    f << "        }" << std::endl;
+
+    // Encoder
+    f << "        // Add message as the last row, absent optional members are stored as 0 or empty" << std::endl;
+    f << "        // Returns false, without adding it, if the serialized batch wouldn't fit in 32 bits anymore" << std::endl;
+    f << "        bool Append(const " << msg.name << "& message)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             // What the row adds to the serialized size, at most" << std::endl;
+    f << "             uint64_t " << size << " = 0;" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string value = "message." + member.name;
+        if(member.optional)
+            f << "             " << size << " += 1;" << std::endl;
+        if(member.type == "vec")
+            f << "             " << size << " += 4 + (uint64_t)" << value << ".size() * " << GetColumnWidth(member) << ";" << std::endl;
+        else if(HasPool(member))
+        {
+            std::string elementSize = member.nested ? ".CalculateNeededSerializationSize()" : ".size()";
+            if(member.count > 1)
+            {
+                f << "             for(int " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+                f << "                 " << size << " += 4 + (uint64_t)" << value << "[" << i << "]" << elementSize << ";" << std::endl;
+            }
+            else
+                f << "             " << size << " += 4 + (uint64_t)" << value << elementSize << ";" << std::endl;
+        }
+        else
+            f << "             " << size << " += " << member.count * GetColumnWidth(member) << ";" << std::endl;
+    }
+    f << "             if(m_rowCount == 0xffffffff || InternalSize() + " << size << " > 0xffffffff)" << std::endl;
+    f << "                 return false;" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string column = "m_" + member.name;
+        std::string value = "message." + member.name;
+        std::string has = "message.has_" + member.name + "()";
+        if(member.optional)
+            f << "             " << column << "Presence.push_back(" << has << " ? 1 : 0);" << std::endl;
+        if(member.type == "vec")
+        {
+            if(member.optional)
+                f << "             if(" << has << ")" << std::endl << "    ";
+            f << "             " << column << "Pool.insert(" << column << "Pool.end(), " << value << ".begin(), " << value << ".end());" << std::endl;
+            f << "             " << column << "Offsets.push_back((uint32_t)" << column << "Pool.size());" << std::endl;
+        }
+        else if(HasPool(member))
+        {
+            std::string indent = "             ";
+            std::string element = value + (member.count > 1 ? "[" + i + "]" : "");
+            if(member.count > 1)
+            {
+                f << "             for(int " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+                f << "             {" << std::endl;
+                indent += "    ";
+            }
+            if(member.optional)
+                f << indent << "if(" << has << ")" << std::endl;
+            f << indent << (member.optional ? "    " : "") << (member.nested ? element + ".AppendTo(" + column + "Pool);" : column + "Pool.append(" + element + ");") << std::endl;
+            f << indent << column << "Offsets.push_back((uint32_t)" << column << "Pool.size());" << std::endl;
+            if(member.count > 1)
+                f << "             }" << std::endl;
+        }
+        else if(member.count > 1)
+        {
+            if(member.optional)
+            {
+                f << "             if(!" << has << ")" << std::endl;
+                f << "                 " << column << ".resize(" << column << ".size() + " << member.count << ");" << std::endl;
+                f << "             else" << std::endl;
+                f << "    ";
+            }
+            f << "             " << column << ".insert(" << column << ".end(), " << value << ", " << value << " + " << member.count << ");" << std::endl;
+        }
+        else if(member.optional)
+            f << "             " << column << ".push_back(" << has << " ? (" << GetColumnType(member) << ")" << value << " : 0);" << std::endl;
+        else
+            f << "             " << column << ".push_back((" << GetColumnType(member) << ")" << value << ");" << std::endl;
+    }
+    f << "             ++m_rowCount;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+
+    // Row decoder
+    f << "        // Materialize a single row, row must be lower than GetCount()" << std::endl;
+    f << "        void GetRow(uint32_t row, " << msg.name << "& message) const" << std::endl;
+    f << "        {" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string column = "m_" + member.name;
+        std::string indent = "             ";
+        // Optional members are set through their accessor to update the presence bitmap
+        std::string target = member.optional ? "message.mutable_" + member.name + "()" : "message." + member.name;
+        if(member.optional)
+        {
+            f << "             if(!" << column << "Presence[row])" << std::endl;
+            f << "                 message.clear_" << member.name << "();" << std::endl;
+            f << "             else" << std::endl;
+            if(member.count > 1)
+                f << "             {" << std::endl;
+            indent += "    ";
+        }
+        if(member.type == "vec")
+        {
+            f << indent << target << ".assign(" << column << "Pool.begin() + " << column << "Offsets[row], " << column << "Pool.begin() + " << column << "Offsets[row + 1]);" << std::endl;
+        }
+        else if(HasPool(member))
+        {
+            std::string element = target + (member.count > 1 ? "[" + i + "]" : "");
+            std::string elementIndent = indent;
+            std::string index = member.count > 1 ? "row * " + ToString(member.count) + " + " + i : "row";
+            if(member.count > 1)
+            {
+                if(member.optional)
+                    f << indent << member.nativeType << "* " << MangleInternalKeyword(member.name) << " = " << target << ";" << std::endl;
+                if(member.optional)
+                    element = MangleInternalKeyword(member.name) + "[" + i + "]";
+                f << indent << "for(uint32_t " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+                elementIndent += "    ";
+            }
+            if(member.nested)
+                f << elementIndent << factory << "::ParseInto(" << element << ", &" << column << "Pool[0] + " << column << "Offsets[" << index << "], " << column << "Offsets[" << index << " + 1] - " << column << "Offsets[" << index << "]);" << std::endl;
+            else
+                f << elementIndent << element << ".assign(" << column << "Pool, " << column << "Offsets[" << index << "], " << column << "Offsets[" << index << " + 1] - " << column << "Offsets[" << index << "]);" << std::endl;
+        }
+        else if(member.count > 1)
+        {
+            f << indent << member.nativeType << "* " << MangleInternalKeyword(member.name) << " = " << target << ";" << std::endl;
+            f << indent << "for(uint32_t " << i << " = 0; " << i << " < " << member.count << "; ++" << i << ")" << std::endl;
+            f << indent << "    " << MangleInternalKeyword(member.name) << "[" << i << "] = (" << member.nativeType << ")" << column << "[row * " << member.count << " + " << i << "];" << std::endl;
+        }
+        else if(member.type == "bool")
+            f << indent << target << " = (" << column << "[row] != 0);" << std::endl;
+        else
+            f << indent << target << " = (" << member.nativeType << ")" << column << "[row];" << std::endl;
+        if(member.optional && member.count > 1)
+            f << "             }" << std::endl;
+    }
+    f << "        }" << std::endl;
+
+    // Column accessors
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string column = "m_" + member.name;
+        if(member.optional)
+        {
+            f << "        // One byte per row, 0 when " << member.name << " is absent" << std::endl;
+            f << "        const uint8_t* has_" << member.name << "() const" << std::endl;
+            f << "        {" << std::endl;
+            f << "             return " << column << "Presence.empty() ? 0 : &" << column << "Presence[0];" << std::endl;
+            f << "        }" << std::endl;
+        }
+        if(member.type == "str")
+        {
+            f << "        " << scope << "StringRef " << member.name << "(uint32_t row" << (member.count > 1 ? ", uint32_t index" : "") << ") const" << std::endl;
+            f << "        {" << std::endl;
+            f << "             uint32_t " << k << " = row" << (member.count > 1 ? " * " + ToString(member.count) + " + index" : "") << ";" << std::endl;
+            f << "             return " << scope << "StringRef(" << column << "Pool.data() + " << column << "Offsets[" << k << "], " << column << "Offsets[" << k << " + 1] - " << column << "Offsets[" << k << "]);" << std::endl;
+            f << "        }" << std::endl;
+        }
+        else if(member.type == "vec")
+        {
+            f << "        const " << GetColumnType(member) << "* " << member.name << "(uint32_t row, uint32_t* count) const" << std::endl;
+            f << "        {" << std::endl;
+            f << "             *count = " << column << "Offsets[row + 1] - " << column << "Offsets[row];" << std::endl;
+            f << "             return " << member.name << "_values() + " << column << "Offsets[row];" << std::endl;
+            f << "        }" << std::endl;
+        }
+        else if(!HasPool(member))
+        {
+            if(member.count > 1)
+                f << "        // " << member.count << " values per row, row r starting at index r * " << member.count << std::endl;
+            f << "        const " << GetColumnType(member) << "* " << member.name << "() const" << std::endl;
+            f << "        {" << std::endl;
+            f << "             return " << column << ".empty() ? 0 : &" << column << "[0];" << std::endl;
+            f << "        }" << std::endl;
+        }
+        if(HasPool(member))
+        {
+            f << "        const uint32_t* " << member.name << "_offsets() const" << std::endl;
+            f << "        {" << std::endl;
+            f << "             return &" << column << "Offsets[0];" << std::endl;
+            f << "        }" << std::endl;
+            f << "        const " << (member.type == "vec" ? GetColumnType(member) : std::string("char")) << "* " << member.name << (member.type == "vec" ? "_values" : "_bytes") << "() const" << std::endl;
+            f << "        {" << std::endl;
+            f << "             return " << column << "Pool.empty() ? 0 : " << (member.type == "vec" ? "&" + column + "Pool[0]" : column + "Pool.data()") << ";" << std::endl;
+            f << "        }" << std::endl;
+        }
+    }
+
+    // Serialization
+    f << "        // 0 if the batch doesn't fit in 32 bits, which Append() prevents" << std::endl;
+    f << "        uint32_t CalculateNeededSerializationSize() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t " << size << " = InternalSize();" << std::endl;
+    f << "             return " << size << " > 0xffffffff ? 0 : (uint32_t)" << size << ";" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // buffer must hold CalculateNeededSerializationSize() bytes, returns the size written (0 if" << std::endl;
+    f << "        // nothing was written, see CalculateNeededSerializationSize)" << std::endl;
+    f << "        uint32_t SerializeTo(char* buffer) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(InternalSize() > 0xffffffff)" << std::endl;
+    f << "                 return 0;" << std::endl;
+    f << "             " << scope << "Store4(buffer, " << scope << "GetVersion());" << std::endl;
+    f << "             " << scope << "Store4(buffer + 4, (uint32_t)" << scope << "MT_" << msg.name << ");" << std::endl;
+    f << "             " << scope << "Store4(buffer + 8, m_rowCount);" << std::endl;
+    f << "             char* " << p << " = buffer + 12;" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string column = "m_" + member.name;
+        if(member.optional)
+        {
+            f << "             if(m_rowCount)" << std::endl;
+            f << "                 memcpy(" << p << ", &" << column << "Presence[0], m_rowCount);" << std::endl;
+            f << "             " << p << " += m_rowCount;" << std::endl;
+        }
+        if(HasPool(member))
+        {
+            f << "             " << scope << "InternalCopyBlock(" << p << ", (const char*)&" << column << "Offsets[1], (uint32_t)" << column << "Offsets.size() - 1, 4);" << std::endl;
+            f << "             " << p << " += (" << column << "Offsets.size() - 1) * 4;" << std::endl;
+            f << "             if(!" << column << "Pool.empty())" << std::endl;
+            if(member.type == "vec")
+                f << "                 " << scope << "InternalCopyBlock(" << p << ", (const char*)&" << column << "Pool[0], (uint32_t)" << column << "Pool.size(), " << GetColumnWidth(member) << ");" << std::endl;
+            else
+                f << "                 memcpy(" << p << ", " << column << "Pool.data(), " << column << "Pool.size());" << std::endl;
+            f << "             " << p << " += " << column << "Pool.size()" << (member.type == "vec" ? " * " + ToString(GetColumnWidth(member)) : "") << ";" << std::endl;
+        }
+        else
+        {
+            f << "             if(!" << column << ".empty())" << std::endl;
+            f << "                 " << scope << "InternalCopyBlock(" << p << ", (const char*)&" << column << "[0], (uint32_t)" << column << ".size(), " << GetColumnWidth(member) << ");" << std::endl;
+            f << "             " << p << " += " << column << ".size() * " << GetColumnWidth(member) << ";" << std::endl;
+        }
+    }
+    f << "             return (uint32_t)(" << p << " - buffer);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Serialize at the end of buffer, returns the size appended" << std::endl;
+    f << "        uint32_t AppendTo(std::string& buffer) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             size_t offset = buffer.size();" << std::endl;
+    f << "             buffer.resize(offset + CalculateNeededSerializationSize());" << std::endl;
+    f << "             return SerializeTo(&buffer[offset]);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        std::string ToStringBuffer() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             std::string buffer;" << std::endl;
+    f << "             AppendTo(buffer);" << std::endl;
+    f << "             return buffer;" << std::endl;
+    f << "        }" << std::endl;
+
+    // Deserialization
+    f << "        // Replace the content with the batch in buffer, size is set to the size of the batch" << std::endl;
+    f << "        // NEED_MORE_DATA means buffer doesn't hold the whole batch, the content is cleared on error" << std::endl;
+    f << "        " << factory << "::ERROR Parse(const char* buffer, uint32_t len, uint32_t* size = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             " << factory << "::ERROR error = InternalParse(buffer, len, size);" << std::endl;
+    f << "             if(error != " << factory << "::NOERROR)" << std::endl;
+    f << "                 Clear();" << std::endl;
+    f << "             return error;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        // Serialized size" << std::endl;
+    f << "        uint64_t InternalSize() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t " << size << " = 12;" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string column = "m_" + member.name;
+        if(member.optional)
+            f << "             " << size << " += " << column << "Presence.size();" << std::endl;
+        if(member.type == "vec")
+            f << "             " << size << " += (" << column << "Offsets.size() - 1) * 4 + " << column << "Pool.size() * " << GetColumnWidth(member) << ";" << std::endl;
+        else if(HasPool(member))
+            f << "             " << size << " += (" << column << "Offsets.size() - 1) * 4 + " << column << "Pool.size();" << std::endl;
+        else
+            f << "             " << size << " += " << column << ".size() * " << GetColumnWidth(member) << ";" << std::endl;
+    }
+    f << "             return " << size << ";" << std::endl;
+    f << "        }" << std::endl;
+    f << "        " << factory << "::ERROR InternalParse(const char* buffer, uint32_t len, uint32_t* size)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(len < 12)" << std::endl;
+    f << "                 return " << factory << "::NEED_MORE_DATA;" << std::endl;
+    f << "             if(" << scope << "Load4(buffer) != " << scope << "GetVersion())" << std::endl;
+    f << "                 return " << factory << "::BAD_VERSION;" << std::endl;
+    f << "             if(" << scope << "Load4(buffer + 4) != (uint32_t)" << scope << "MT_" << msg.name << ")" << std::endl;
+    f << "                 return " << factory << "::INVALID_TYPE;" << std::endl;
+    f << "             uint32_t rowCount = " << scope << "Load4(buffer + 8);" << std::endl;
+    f << "             const char* " << p << " = buffer + 12;" << std::endl;
+    f << "             const char* " << end << " = buffer + len;" << std::endl;
+    f << "             uint64_t " << n << ";" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        std::string column = "m_" + member.name;
+        std::string count = member.type == "vec" ? "" : " * " + ToString(member.count);
+        f << "             // " << member.name << std::endl;
+        if(member.optional)
+        {
+            f << "             if((uint64_t)(" << end << " - " << p << ") < rowCount)" << std::endl;
+            f << "                 return " << factory << "::NEED_MORE_DATA;" << std::endl;
+            f << "             " << column << "Presence.assign(" << p << ", " << p << " + rowCount);" << std::endl;
+            f << "             " << p << " += rowCount;" << std::endl;
+        }
+        f << "             " << n << " = (uint64_t)rowCount" << (member.count > 1 ? count : "") << ";" << std::endl;
+        if(HasPool(member))
+        {
+            f << "             if((uint64_t)(" << end << " - " << p << ") / 4 < " << n << ")" << std::endl;
+            f << "                 return " << factory << "::NEED_MORE_DATA;" << std::endl;
+            f << "             " << column << "Offsets.resize((size_t)" << n << " + 1);" << std::endl;
+            f << "             " << column << "Offsets[0] = 0;" << std::endl;
+            f << "             " << scope << "InternalCopyBlock((char*)&" << column << "Offsets[1], " << p << ", (uint32_t)" << n << ", 4);" << std::endl;
+            f << "             " << p << " += " << n << " * 4;" << std::endl;
+            f << "             for(size_t " << k << " = 0; " << k << " < " << n << "; ++" << k << ")" << std::endl;
+            f << "             {" << std::endl;
+            f << "                 if(" << column << "Offsets[" << k << " + 1] < " << column << "Offsets[" << k << "])" << std::endl;
+            f << "                     return " << factory << "::BAD_SIZE;" << std::endl;
+            f << "             }" << std::endl;
+            f << "             " << n << " = " << column << "Offsets[(size_t)" << n << "];" << std::endl;
+            if(member.type == "vec")
+            {
+                f << "             if((uint64_t)(" << end << " - " << p << ") / " << GetColumnWidth(member) << " < " << n << ")" << std::endl;
+                f << "                 return " << factory << "::NEED_MORE_DATA;" << std::endl;
+                f << "             " << column << "Pool.resize((size_t)" << n << ");" << std::endl;
+                f << "             if(" << n << ")" << std::endl;
+                f << "                 " << scope << "InternalCopyBlock((char*)&" << column << "Pool[0], " << p << ", (uint32_t)" << n << ", " << GetColumnWidth(member) << ");" << std::endl;
+                f << "             " << p << " += " << n << " * " << GetColumnWidth(member) << ";" << std::endl;
+            }
+            else
+            {
+                f << "             if((uint64_t)(" << end << " - " << p << ") < " << n << ")" << std::endl;
+                f << "                 return " << factory << "::NEED_MORE_DATA;" << std::endl;
+                f << "             " << column << "Pool.assign(" << p << ", (size_t)" << n << ");" << std::endl;
+                f << "             " << p << " += " << n << ";" << std::endl;
+            }
+            if(member.nested)
+            {
+                // Checked once here, so that GetRow() can't fail
+                f << "             for(size_t " << k << " = 0; " << k << " + 1 < " << column << "Offsets.size(); ++" << k << ")" << std::endl;
+                f << "             {" << std::endl;
+                f << "                 uint32_t " << size << " = 0;" << std::endl;
+                f << "                 uint32_t elementSize = " << column << "Offsets[" << k << " + 1] - " << column << "Offsets[" << k << "];" << std::endl;
+                if(member.optional)
+                {
+                    // Absent members have no element
+                    f << "                 if(elementSize == 0 && !" << column << "Presence[" << k << (member.count > 1 ? " / " + ToString(member.count) : "") << "])" << std::endl;
+                    f << "                     continue;" << std::endl;
+                }
+                f << "                 " << member.nativeType << " element;" << std::endl;
+                f << "                 if(" << factory << "::ParseInto(element, " << column << "Pool.data() + " << column << "Offsets[" << k << "], elementSize, &" << size << ") != " << factory << "::NOERROR || " << size << " != elementSize)" << std::endl;
+                f << "                     return " << factory << "::BAD_SIZE;" << std::endl;
+                f << "             }" << std::endl;
+            }
+        }
+        else
+        {
+            f << "             if((uint64_t)(" << end << " - " << p << ") / " << GetColumnWidth(member) << " < " << n << ")" << std::endl;
+            f << "                 return " << factory << "::NEED_MORE_DATA;" << std::endl;
+            f << "             " << column << ".resize((size_t)" << n << ");" << std::endl;
+            f << "             if(" << n << ")" << std::endl;
+            f << "                 " << scope << "InternalCopyBlock((char*)&" << column << "[0], " << p << ", (uint32_t)" << n << ", " << GetColumnWidth(member) << ");" << std::endl;
+            f << "             " << p << " += " << n << " * " << GetColumnWidth(member) << ";" << std::endl;
+        }
+    }
+    f << "             m_rowCount = rowCount;" << std::endl;
+    f << "             if(size)" << std::endl;
+    f << "                 *size = (uint32_t)(" << p << " - buffer);" << std::endl;
+    f << "             return " << factory << "::NOERROR;" << std::endl;
+    f << "        }" << std::endl;
+
+    f << "        uint32_t m_rowCount;" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(member.optional)
+            f << "        std::vector<uint8_t> m_" << member.name << "Presence;" << std::endl;
+        if(HasPool(member))
+        {
+            f << "        std::vector<uint32_t> m_" << member.name << "Offsets;" << std::endl;
+            if(member.type == "vec")
+                f << "        std::vector<" << GetColumnType(member) << "> m_" << member.name << "Pool;" << std::endl;
+            else
+                f << "        std::string m_" << member.name << "Pool;" << std::endl;
+        }
+        else
+            f << "        std::vector<" << GetColumnType(member) << "> m_" << member.name << ";" << std::endl;
+    }
+    f << "};" << std::endl;
+    f << std::endl;
+}
+
+// Thread pool and parallel encoding / decoding of arrays of messages, with MSGBUF_ENABLE_THREADS and C++11
+void WriteParallelBatch(std::ostream& f, const Options& options)
+{
+    std::string factory = options.baseclass + "Factory";
+    std::string pool = options.baseclass + "ThreadPool";
+
+    f << "#ifdef MSGBUF_THREADS" << std::endl;
+    f << "// Fixed set of worker threads running ParallelFor() loops, the calling thread takes part too" << std::endl;
+    f << "class " << pool << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // threadCount includes the calling thread, 0 means one per hardware thread" << std::endl;
+    f << "        explicit " << pool << "(unsigned threadCount = 0) : m_task(0), m_count(0), m_next(0), m_active(0), m_generation(0), m_stop(false)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(threadCount == 0)" << std::endl;
+    f << "                 threadCount = std::thread::hardware_concurrency();" << std::endl;
+    f << "             for(unsigned i = 1; i < threadCount; ++i)" << std::endl;
+    f << "                 m_threadList.push_back(std::thread(&" << pool << "::Run, this));" << std::endl;
+    f << "        }" << std::endl;
+    f << "        ~" << pool << "()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 std::lock_guard<std::mutex> lock(m_mutex);" << std::endl;
+    f << "                 m_stop = true;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             m_wakeUp.notify_all();" << std::endl;
+    f << "             for(size_t i = 0; i < m_threadList.size(); ++i)" << std::endl;
+    f << "                 m_threadList[i].join();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        unsigned GetThreadCount() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return (unsigned)m_threadList.size() + 1;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Call task(i) for each i in [0, count) from all the threads, returns once every call is done" << std::endl;
+    f << "        // task must not throw, concurrent calls to ParallelFor() run one after the other" << std::endl;
+    f << "        void ParallelFor(size_t count, const std::function<void(size_t)>& task)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             std::lock_guard<std::mutex> call(m_callMutex);" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 std::lock_guard<std::mutex> lock(m_mutex);" << std::endl;
+    f << "                 m_task = &task;" << std::endl;
+    f << "                 m_count = count;" << std::endl;
+    f << "                 m_next = 0;" << std::endl;
+    f << "                 m_active = m_threadList.size();" << std::endl;
+    f << "                 ++m_generation;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             m_wakeUp.notify_all();" << std::endl;
+    f << "             Work(task, count);" << std::endl;
+    f << "             std::unique_lock<std::mutex> lock(m_mutex);" << std::endl;
+    f << "             m_finished.wait(lock, [this] { return m_active == 0; });" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        " << pool << "(const " << pool << "&);" << std::endl;
+    f << "        " << pool << "& operator=(const " << pool << "&);" << std::endl;
+    f << "        void Run()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t generation = 0;" << std::endl;
+    f << "             for(;;)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 const std::function<void(size_t)>* task;" << std::endl;
+    f << "                 size_t count;" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     std::unique_lock<std::mutex> lock(m_mutex);" << std::endl;
+    f << "                     m_wakeUp.wait(lock, [&] { return m_stop || m_generation != generation; });" << std::endl;
+    f << "                     if(m_stop)" << std::endl;
+    f << "                         return;" << std::endl;
+    f << "                     generation = m_generation;" << std::endl;
+    f << "                     task = m_task;" << std::endl;
+    f << "                     count = m_count;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 Work(*task, count);" << std::endl;
+    f << "                 std::lock_guard<std::mutex> lock(m_mutex);" << std::endl;
+    f << "                 if(--m_active == 0)" << std::endl;
+    f << "                     m_finished.notify_one();" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void Work(const std::function<void(size_t)>& task, size_t count)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(size_t i = m_next++; i < count; i = m_next++)" << std::endl;
+    f << "                 task(i);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        std::vector<std::thread> m_threadList;" << std::endl;
+    f << "        std::mutex m_callMutex;" << std::endl;
+    f << "        std::mutex m_mutex;" << std::endl;
+    f << "        std::condition_variable m_wakeUp;" << std::endl;
+    f << "        std::condition_variable m_finished;" << std::endl;
+    f << "        const std::function<void(size_t)>* m_task;" << std::endl;
+    f << "        size_t m_count;" << std::endl;
+    f << "        std::atomic<size_t> m_next;" << std::endl;
+    f << "        size_t m_active;" << std::endl;
+    f << "        uint64_t m_generation;" << std::endl;
+    f << "        bool m_stop;" << std::endl;
+    f << "};" << std::endl;
+    f << std::endl;
+
+    f << "// Run task(begin, end) over [0, count) split in a few ranges per thread, to balance the load" << std::endl;
+    f << "inline void InternalParallelRanges(size_t count, " << pool << "& pool, const std::function<void(size_t, size_t)>& task)" << std::endl;
+    f << "{" << std::endl;
+    f << "    size_t rangeCount = (size_t)pool.GetThreadCount() * 8;" << std::endl;
+    f << "    if(rangeCount > count)" << std::endl;
+    f << "        rangeCount = count;" << std::endl;
+    f << "    pool.ParallelFor(rangeCount, [&](size_t i) { task(count * i / rangeCount, count * (i + 1) / rangeCount); });" << std::endl;
+    f << "}" << std::endl;
+    f << std::endl;
+    f << "// Offset of each message once serialized back to back, offsets gets count + 1 entries" << std::endl;
+    f << "template <class T>" << std::endl;
+    f << "void InternalBatchOffsets(const T* messages, size_t count, " << pool << "& pool, std::vector<uint64_t>& offsets)" << std::endl;
+    f << "{" << std::endl;
+    f << "    offsets.resize(count + 1);" << std::endl;
+    f << "    offsets[0] = 0;" << std::endl;
+    f << "    InternalParallelRanges(count, pool, [&](size_t begin, size_t end) {" << std::endl;
+    f << "        for(size_t i = begin; i < end; ++i)" << std::endl;
+    f << "            offsets[i + 1] = messages[i].CalculateNeededSerializationSize();" << std::endl;
+    f << "    });" << std::endl;
+    f << "    for(size_t i = 0; i < count; ++i)" << std::endl;
+    f << "        offsets[i + 1] += offsets[i];" << std::endl;
+    f << "}" << std::endl;
+    f << std::endl;
+    f << "template <class T>" << std::endl;
+    f << "void InternalWriteBatch(const T* messages, size_t count, const std::vector<uint64_t>& offsets, char* out, " << pool << "& pool)" << std::endl;
+    f << "{" << std::endl;
+    f << "    InternalParallelRanges(count, pool, [&](size_t begin, size_t end) {" << std::endl;
+    f << "        for(size_t i = begin; i < end; ++i)" << std::endl;
+    f << "            messages[i].SerializeTo(out + offsets[i], (uint32_t)(offsets[i + 1] - offsets[i]));" << std::endl;
+    f << "    });" << std::endl;
+    f << "}" << std::endl;
+    f << std::endl;
+    f << "// Serialize messages back to back (each one like ToBuffer() does) using all the threads of pool" << std::endl;
+    f << "// The sizes are computed and prefix summed first, out must hold their total, which is returned" << std::endl;
+    f << "// Each message is then written with SerializeTo(), without computing its size again" << std::endl;
+    f << "template <class T>" << std::endl;
+    f << "uint64_t EncodeBatchParallel(const T* messages, size_t count, char* out, " << pool << "& pool)" << std::endl;
+    f << "{" << std::endl;
+    f << "    std::vector<uint64_t> offsets;" << std::endl;
+    f << "    InternalBatchOffsets(messages, count, pool, offsets);" << std::endl;
+    f << "    InternalWriteBatch(messages, count, offsets, out, pool);" << std::endl;
+    f << "    return offsets[count];" << std::endl;
+    f << "}" << std::endl;
+    f << std::endl;
+    f << "// Same as above, out is resized to the total size" << std::endl;
+    f << "template <class T>" << std::endl;
+    f << "void EncodeBatchParallel(const T* messages, size_t count, std::vector<char>& out, " << pool << "& pool)" << std::endl;
+    f << "{" << std::endl;
+    f << "    std::vector<uint64_t> offsets;" << std::endl;
+    f << "    InternalBatchOffsets(messages, count, pool, offsets);" << std::endl;
+    f << "    out.resize((size_t)offsets[count]);" << std::endl;
+    f << "    if(count)" << std::endl;
+    f << "        InternalWriteBatch(messages, count, offsets, &out[0], pool);" << std::endl;
+    f << "}" << std::endl;
+    f << std::endl;
+    f << "// Decode len bytes of messages of type T serialized back to back (see EncodeBatchParallel)" << std::endl;
+    f << "// The offset of each message is found first, by a single thread, then they are decoded in" << std::endl;
+    f << "// parallel, messages is left empty on error" << std::endl;
+    if(options.framed)
+        f << "// Finding an offset only reads the frame size of the message before it" << std::endl;
+    else
+    {
+        f << "// Without framing, finding an offset walks every field of the message before it, and this" << std::endl;
+        f << "// serial pass bounds the speedup: only framed batches (!framing length) scale with the threads" << std::endl;
+    }
+    f << "template <class T>" << std::endl;
+    f << factory << "::ERROR DecodeBatchParallel(const char* buffer, size_t len, std::vector<T>& messages, " << pool << "& pool)" << std::endl;
+    f << "{" << std::endl;
+    f << "    messages.clear();" << std::endl;
+    f << "    std::vector<size_t> offsets(1, 0);" << std::endl;
+    f << "    while(offsets.back() < len)" << std::endl;
+    f << "    {" << std::endl;
+    f << "        size_t left = len - offsets.back();" << std::endl;
+    f << "        uint32_t size;" << std::endl;
+    f << "        " << factory << "::ERROR error = " << factory << "::MeasureFrame(buffer + offsets.back(), left > 0xffffffff ? 0xffffffff : (uint32_t)left, &size);" << std::endl;
+    f << "        if(error != " << factory << "::NOERROR)" << std::endl;
+    f << "            return error;" << std::endl;
+    f << "        offsets.push_back(offsets.back() + size);" << std::endl;
+    f << "    }" << std::endl;
+    f << "    size_t count = offsets.size() - 1;" << std::endl;
+    f << "    messages.resize(count);" << std::endl;
+    f << "    std::atomic<int> result(" << factory << "::NOERROR);" << std::endl;
+    f << "    InternalParallelRanges(count, pool, [&](size_t begin, size_t end) {" << std::endl;
+    f << "        for(size_t i = begin; i < end; ++i)" << std::endl;
+    f << "        {" << std::endl;
+    f << "            " << factory << "::ERROR error = " << factory << "::ParseInto(messages[i], buffer + offsets[i], (uint32_t)(offsets[i + 1] - offsets[i]));" << std::endl;
+    f << "            if(error != " << factory << "::NOERROR)" << std::endl;
+    f << "                result = error;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    });" << std::endl;
+    f << "    if(result != " << factory << "::NOERROR)" << std::endl;
+    f << "        messages.clear();" << std::endl;
+    f << "    return (" << factory << "::ERROR)(int)result;" << std::endl;
+    f << "}" << std::endl;
+    f << "#endif" << std::endl;
+    f << std::endl;
+}
+
+// Lock-free ring of serialized messages in a shared memory segment, for processes on the same host
+void WriteShmRing(std::ostream& f, const Options& options)
+{
+    std::string base = options.baseclass;
+    std::string factory = options.baseclass + "Factory";
+    std::string ring = options.baseclass + "ShmRing";
+
+    f << "#ifdef MSGBUF_SHM_RING" << std::endl;
+    f << "// Ring of serialized messages in shared memory, with a single consumer and either a single" << std::endl;
+    f << "// producer (wait-free on both sides) or several ones (reservations use a compare and swap)" << std::endl;
+    f << "// Each record is its length (4 bytes, written last to publish it), the length reserved (4" << std::endl;
+    f << "// bytes) and the message as written by ToBuffer(), padded to 8 bytes. Records don't wrap, the" << std::endl;
+    f << "// end of the ring is skipped with a padding record. The consumer clears what it consumed so" << std::endl;
+    f << "// that a record is seen only once its length is published" << std::endl;
+    f << "class " << ring << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        enum MODE { SINGLE_PRODUCER, MULTI_PRODUCER };" << std::endl;
+    f << "        " << ring << "() : m_header(0), m_data(0), m_mapSize(0), m_tail(0), m_pending(0), m_tailCache(0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "        }" << std::endl;
+    f << "        ~" << ring << "()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Create the named segment (see shm_open), replacing any existing one" << std::endl;
+    f << "        // capacity is the size of the ring in bytes, a power of 2 at least 64" << std::endl;
+    f << "        bool Create(const char* name, uint32_t capacity, MODE mode = SINGLE_PRODUCER)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(!IsValidCapacity(capacity))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             shm_unlink(name);" << std::endl;
+    f << "             int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);" << std::endl;
+    f << "             if(fd < 0)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             bool result = (ftruncate(fd, kHeaderSize + capacity) == 0 && Map(fd, kHeaderSize + capacity));" << std::endl;
+    f << "             close(fd);" << std::endl;
+    f << "             if(result)" << std::endl;
+    f << "                 Initialize(capacity, mode);" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Map a segment created by Create() in another process" << std::endl;
+    f << "        bool Open(const char* name)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             int fd = shm_open(name, O_RDWR, 0);" << std::endl;
+    f << "             if(fd < 0)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             struct stat info;" << std::endl;
+    f << "             bool result = (fstat(fd, &info) == 0 && (uint64_t)info.st_size > kHeaderSize && Map(fd, (size_t)info.st_size));" << std::endl;
+    f << "             close(fd);" << std::endl;
+    f << "             if(result && (m_header->magic != kMagic || m_header->version != " << base << "::GetVersion() || kHeaderSize + (uint64_t)m_header->capacity != m_mapSize))" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 Close();" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             m_tail = m_header->tail.load(std::memory_order_acquire);" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Anonymous segment, shared with the processes forked afterwards" << std::endl;
+    f << "        bool CreateAnonymous(uint32_t capacity, MODE mode = SINGLE_PRODUCER)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(!IsValidCapacity(capacity) || !Map(-1, kHeaderSize + capacity))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             Initialize(capacity, mode);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static bool Unlink(const char* name)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return shm_unlink(name) == 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void Close()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(m_header)" << std::endl;
+    f << "                 munmap((void*)m_header, m_mapSize);" << std::endl;
+    f << "             m_header = 0;" << std::endl;
+    f << "             m_data = 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        bool IsOpen() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_header != 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Largest message that fits in the ring" << std::endl;
+    f << "        uint32_t GetMaxMessageSize() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_header->capacity - 8;" << std::endl;
+    f << "        }" << std::endl;
+
+    // Producer
+    f << "        // Producer side: reserve len bytes to serialize a message in place, returns 0 if the ring" << std::endl;
+    f << "        // is full. Several threads may only reserve at once in MULTI_PRODUCER mode" << std::endl;
+    f << "        char* Reserve(uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t capacity = m_header->capacity;" << std::endl;
+    f << "             if(len > capacity - 8)" << std::endl;
+    f << "                 return 0;" << std::endl;
+    f << "             uint32_t size = RecordSize(len);" << std::endl;
+    f << "             bool single = (m_header->mode == SINGLE_PRODUCER);" << std::endl;
+    f << "             uint64_t tail = single ? m_tailCache : m_header->tail.load(std::memory_order_acquire);" << std::endl;
+    f << "             uint64_t head = m_header->head.load(std::memory_order_relaxed);" << std::endl;
+    f << "             for(;;)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 uint32_t offset = (uint32_t)head & (capacity - 1);" << std::endl;
+    f << "                 uint32_t padding = (capacity - offset < size) ? capacity - offset : 0;" << std::endl;
+    f << "                 if(head + padding + size - tail > capacity)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     tail = m_header->tail.load(std::memory_order_acquire);" << std::endl;
+    f << "                     if(single)" << std::endl;
+    f << "                         m_tailCache = tail;" << std::endl;
+    f << "                     if(head + padding + size - tail > capacity)" << std::endl;
+    f << "                         return 0;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 if(single)" << std::endl;
+    f << "                     m_header->head.store(head + padding + size, std::memory_order_relaxed);" << std::endl;
+    f << "                 else if(!m_header->head.compare_exchange_weak(head, head + padding + size, std::memory_order_relaxed))" << std::endl;
+    f << "                     continue;" << std::endl;
+    f << "                 if(padding)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     RecordLength(offset)->store(kPadding | padding, std::memory_order_release);" << std::endl;
+    f << "                     offset = 0;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 memcpy(m_data + offset + 4, &len, 4);" << std::endl;
+    f << "                 return m_data + offset + 8;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Make a reserved message visible to the consumer" << std::endl;
+    f << "        void Publish(char* message)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t len;" << std::endl;
+    f << "             memcpy(&len, message - 4, 4);" << std::endl;
+    f << "             RecordLength((uint32_t)(message - 8 - m_data))->store(len, std::memory_order_release);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Serialize message into the ring, returns false if it's full" << std::endl;
+    f << "        bool Write(const " << base << "& message)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t len = message.CalculateNeededSerializationSize();" << std::endl;
+    f << "             char* p = Reserve(len);" << std::endl;
+    f << "             if(!p)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             message.ToBuffer(p, len);" << std::endl;
+    f << "             Publish(p);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+
+    // Consumer
+    f << "        // Consumer side: next message, or 0 if there is none yet" << std::endl;
+    f << "        // It stays in the ring (for views to point into) until Release() is called" << std::endl;
+    f << "        const char* Peek(uint32_t* len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(;;)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 uint32_t offset = (uint32_t)m_tail & (m_header->capacity - 1);" << std::endl;
+    f << "                 uint32_t length = RecordLength(offset)->load(std::memory_order_acquire);" << std::endl;
+    f << "                 if(length == 0)" << std::endl;
+    f << "                     return 0;" << std::endl;
+    f << "                 if(length & kPadding)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     m_pending = length & ~kPadding;" << std::endl;
+    f << "                     Release();" << std::endl;
+    f << "                     continue;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 m_pending = RecordSize(length);" << std::endl;
+    f << "                 *len = length;" << std::endl;
+    f << "                 return m_data + offset + 8;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Free the message returned by Peek()" << std::endl;
+    f << "        void Release()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             memset(m_data + ((uint32_t)m_tail & (m_header->capacity - 1)), 0, m_pending);" << std::endl;
+    f << "             m_tail += m_pending;" << std::endl;
+    f << "             m_pending = 0;" << std::endl;
+    f << "             m_header->tail.store(m_tail, std::memory_order_release);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Decode the next message and pass it to handler.On() (see " << factory << "::Dispatch)" << std::endl;
+    f << "        // returns false if there is none yet, error is set to the result of the decoding" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        bool DispatchNext(Handler& handler, " << factory << "::ERROR* error = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t len;" << std::endl;
+    f << "             const char* p = Peek(&len);" << std::endl;
+    f << "             if(!p)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             " << factory << "::ERROR result = " << factory << "::Dispatch(p, len, handler);" << std::endl;
+    f << "             if(error)" << std::endl;
+    f << "                 *error = result;" << std::endl;
+    f << "             Release();" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+
+    f << "    private:" << std::endl;
+    f << "        " << ring << "(const " << ring << "&);" << std::endl;
+    f << "        " << ring << "& operator=(const " << ring << "&);" << std::endl;
+    f << "        // At the start of the segment, the producer and consumer positions on their own cache lines" << std::endl;
+    f << "        struct Header" << std::endl;
+    f << "        {" << std::endl;
+    f << "            uint32_t magic;" << std::endl;
+    f << "            uint32_t version;" << std::endl;
+    f << "            uint32_t capacity;" << std::endl;
+    f << "            uint32_t mode;" << std::endl;
+    f << "            char padding1[48];" << std::endl;
+    f << "            std::atomic<uint64_t> head;" << std::endl;
+    f << "            char padding2[56];" << std::endl;
+    f << "            std::atomic<uint64_t> tail;" << std::endl;
+    f << "            char padding3[56];" << std::endl;
+    f << "        };" << std::endl;
+    f << "        static const uint32_t kHeaderSize = 192;" << std::endl;
+    f << "        static const uint32_t kMagic = 0x52424d53;" << std::endl;
+    f << "        static const uint32_t kPadding = 0x80000000;" << std::endl;
+    f << "        static bool IsValidCapacity(uint32_t capacity)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return capacity >= 64 && capacity < kPadding && (capacity & (capacity - 1)) == 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint32_t RecordSize(uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return (8 + len + 7) & ~7u;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        std::atomic<uint32_t>* RecordLength(uint32_t offset)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return reinterpret_cast<std::atomic<uint32_t>*>(m_data + offset);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        bool Map(int fd, size_t size)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "             void* p = mmap(0, size, PROT_READ | PROT_WRITE, fd < 0 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED, fd, 0);" << std::endl;
+    f << "             if(p == MAP_FAILED)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             m_header = static_cast<Header*>(p);" << std::endl;
+    f << "             m_data = static_cast<char*>(p) + kHeaderSize;" << std::endl;
+    f << "             m_mapSize = size;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // The segment is zero filled by ftruncate() / mmap()" << std::endl;
+    f << "        void Initialize(uint32_t capacity, MODE mode)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             new(&m_header->head) std::atomic<uint64_t>(0);" << std::endl;
+    f << "             new(&m_header->tail) std::atomic<uint64_t>(0);" << std::endl;
+    f << "             m_header->version = " << base << "::GetVersion();" << std::endl;
+    f << "             m_header->capacity = capacity;" << std::endl;
+    f << "             m_header->mode = (uint32_t)mode;" << std::endl;
+    f << "             std::atomic_thread_fence(std::memory_order_release);" << std::endl;
+    f << "             m_header->magic = kMagic;" << std::endl;
+    f << "             m_tail = 0;" << std::endl;
+    f << "             m_tailCache = 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        Header* m_header;" << std::endl;
+    f << "        char* m_data;" << std::endl;
+    f << "        size_t m_mapSize;" << std::endl;
+    f << "        // Consumer position, and size of the record returned by Peek()" << std::endl;
+    f << "        uint64_t m_tail;" << std::endl;
+    f << "        uint32_t m_pending;" << std::endl;
+    f << "        // Last consumer position seen by the single producer" << std::endl;
+    f << "        uint64_t m_tailCache;" << std::endl;
+    f << "};" << std::endl;
+    f << "#endif" << std::endl;
+    f << std::endl;
+}
+
+// Append-only log of messages in a file, with a sidecar index to seek by sequence number
+void WriteLog(std::ostream& f, const Options& options)
+{
+    std::string base = options.baseclass;
+    std::string factory = options.baseclass + "Factory";
+    std::string writer = options.baseclass + "LogWriter";
+    std::string reader = options.baseclass + "LogReader";
+    std::string compressor = options.baseclass + "Compressor";
+
+    f << "#ifndef _WIN32" << std::endl;
+    f << "// A log is a file of records, each one being the message size (4 bytes) followed by the" << std::endl;
+    f << "// message as written by ToBuffer(). Its index (same path followed by \".idx\") has an entry per" << std::endl;
+    f << "// record: offset of the record (8 bytes), message type (4 bytes) and 4 reserved bytes, the" << std::endl;
+    f << "// sequence number of a message being the position of its entry" << std::endl;
+    if(options.compression)
+    {
+        f << "// A record with the top bit of its size set is a compressed block of records instead: the size" << std::endl;
+        f << "// of the records (4 bytes) followed by their compression (see " << compressor << "). The index" << std::endl;
+        f << "// entry of a record in a block has the offset of the block, and the position of the record in" << std::endl;
+        f << "// the block plus one in place of the reserved bytes" << std::endl;
+    }
+    f << "// The reader maps the log, messages are returned without copy and can be read with views" << std::endl;
+    f << "class " << reader << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    if(options.compression)
+        f << "        " << reader << "() : m_log(0), m_logSize(0), m_index(0), m_indexSize(0), m_count(0), m_position(0), m_sequence(0), m_blockOffset(~(uint64_t)0), m_blockPosition(0)" << std::endl;
+    else
+        f << "        " << reader << "() : m_log(0), m_logSize(0), m_index(0), m_indexSize(0), m_count(0), m_position(0), m_sequence(0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "        }" << std::endl;
+    f << "        ~" << reader << "()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Map the log as it is now, and its index if it's in sync (see RebuildIndex otherwise)" << std::endl;
+    f << "        bool Open(const char* path)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "             if(!Map(path, &m_log, &m_logSize))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             if(m_log)" << std::endl;
+    f << "                 madvise((void*)m_log, m_logSize, MADV_SEQUENTIAL);" << std::endl;
+    f << "             if(IsIndexValid(path) && !Map((std::string(path) + \".idx\").c_str(), &m_index, &m_indexSize))" << std::endl;
+    f << "                 m_indexSize = 0;" << std::endl;
+    f << "             // Entries for records appended after the log was mapped are ignored" << std::endl;
+    f << "             m_count = m_indexSize / 16;" << std::endl;
+    f << "             while(m_count && " << base << "::Load8(m_index + (m_count - 1) * 16) >= m_logSize)" << std::endl;
+    f << "                 --m_count;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void Close()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(m_log)" << std::endl;
+    f << "                 munmap((void*)m_log, m_logSize);" << std::endl;
+    f << "             if(m_index)" << std::endl;
+    f << "                 munmap((void*)m_index, m_indexSize);" << std::endl;
+    f << "             m_log = 0;" << std::endl;
+    f << "             m_index = 0;" << std::endl;
+    f << "             m_logSize = 0;" << std::endl;
+    f << "             m_indexSize = 0;" << std::endl;
+    f << "             m_count = 0;" << std::endl;
+    f << "             m_position = 0;" << std::endl;
+    f << "             m_sequence = 0;" << std::endl;
+    if(options.compression)
+    {
+        f << "             m_block.clear();" << std::endl;
+        f << "             m_blockOffset = ~(uint64_t)0;" << std::endl;
+        f << "             m_blockPosition = 0;" << std::endl;
+    }
+    f << "        }" << std::endl;
+    f << "        // Number of messages in the index, 0 without index" << std::endl;
+    f << "        uint64_t GetCount() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_count;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Sequence number of the message Next() returns" << std::endl;
+    f << "        uint64_t GetSequence() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_sequence;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Move to a message using the index, returns false if it's not indexed" << std::endl;
+    f << "        bool Seek(uint64_t sequence)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(sequence >= GetCount())" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             m_position = " << base << "::Load8(m_index + sequence * 16);" << std::endl;
+    if(options.compression)
+    {
+        f << "             uint32_t blockPosition = " << base << "::Load4(m_index + sequence * 16 + 12);" << std::endl;
+        f << "             m_blockPosition = (blockPosition ? blockPosition - 1 : 0);" << std::endl;
+    }
+    f << "             m_sequence = sequence;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Type of an indexed message, without reading the log" << std::endl;
+    f << "        // Returns false if it's not indexed, or of a type unknown to this version" << std::endl;
+    f << "        bool GetType(uint64_t sequence, " << base << "::MESSAGE_TYPE* type) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(sequence >= GetCount())" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             uint32_t value = " << base << "::Load4(m_index + sequence * 16 + 8);" << std::endl;
+    f << "             if(value >= " << base << "::kMessageTypeCount)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             *type = (" << base << "::MESSAGE_TYPE)value;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Get the next message, see InternalNext(). Stops (returning false) at a message of a type" << std::endl;
+    f << "        // unknown to this version, which DispatchNext() reports and skips" << std::endl;
+    f << "        bool Next(" << base << "::MESSAGE_TYPE* type, const char** message, uint32_t* len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t position = m_position;" << std::endl;
+    if(options.compression)
+        f << "             uint32_t blockPosition = m_blockPosition;" << std::endl;
+    f << "             uint32_t value;" << std::endl;
+    f << "             if(!InternalNext(&value, message, len))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             if(value >= " << base << "::kMessageTypeCount)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 m_position = position;" << std::endl;
+    if(options.compression)
+        f << "                 m_blockPosition = blockPosition;" << std::endl;
+    f << "                 --m_sequence;" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             *type = (" << base << "::MESSAGE_TYPE)value;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.compression)
+    {
+        f << "        // Get the next message and its type as stored, the message points into the mapped log, or" << std::endl;
+        f << "        // into the reader for a compressed block (until the next block is read)" << std::endl;
+        f << "        // returns false at the end of the log (an incomplete last record is ignored)" << std::endl;
+        f << "        bool InternalNext(uint32_t* type, const char** message, uint32_t* len)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t size, version, messageType;" << std::endl;
+        f << "             if(!ReadRecord(m_log, m_logSize, m_position, &size))" << std::endl;
+        f << "                 return false;" << std::endl;
+        f << "             if(!(" << base << "::Load4(m_log + m_position) & kCompressed))" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 if(!" << base << "::InternalReadHeader(m_log + m_position + 4, size, &version, &messageType))" << std::endl;
+        f << "                     return false;" << std::endl;
+        f << "                 *message = m_log + m_position + 4;" << std::endl;
+        f << "                 m_position += 4 + (uint64_t)size;" << std::endl;
+        f << "                 m_blockPosition = 0;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             else" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 if(m_blockOffset != m_position)" << std::endl;
+        f << "                 {" << std::endl;
+        f << "                     m_blockOffset = ~(uint64_t)0;" << std::endl;
+        f << "                     if(!ReadBlock(m_log + m_position, size, m_block))" << std::endl;
+        f << "                         return false;" << std::endl;
+        f << "                     m_blockOffset = m_position;" << std::endl;
+        f << "                 }" << std::endl;
+        f << "                 uint32_t blockSize = size;" << std::endl;
+        f << "                 if(!ReadBlockRecord(m_block, m_blockPosition, &size, &messageType))" << std::endl;
+        f << "                     return false;" << std::endl;
+        f << "                 *message = m_block.data() + m_blockPosition + 4;" << std::endl;
+        f << "                 m_blockPosition += 4 + size;" << std::endl;
+        f << "                 if(m_blockPosition == m_block.size())" << std::endl;
+        f << "                 {" << std::endl;
+        f << "                     m_position += 4 + (uint64_t)blockSize;" << std::endl;
+        f << "                     m_blockPosition = 0;" << std::endl;
+        f << "                 }" << std::endl;
+        f << "             }" << std::endl;
+        f << "             *type = messageType;" << std::endl;
+        f << "             *len = size;" << std::endl;
+        f << "             ++m_sequence;" << std::endl;
+        f << "             return true;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    else
+    {
+        f << "        // Get the next message and its type as stored, the message points into the mapped log" << std::endl;
+        f << "        // returns false at the end of the log (an incomplete last record is ignored)" << std::endl;
+        f << "        bool InternalNext(uint32_t* type, const char** message, uint32_t* len)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t size, version, messageType;" << std::endl;
+        f << "             if(!ReadRecord(m_log, m_logSize, m_position, &size) || !" << base << "::InternalReadHeader(m_log + m_position + 4, size, &version, &messageType))" << std::endl;
+        f << "                 return false;" << std::endl;
+        f << "             *type = messageType;" << std::endl;
+        f << "             *message = m_log + m_position + 4;" << std::endl;
+        f << "             *len = size;" << std::endl;
+        f << "             m_position += 4 + (uint64_t)size;" << std::endl;
+        f << "             ++m_sequence;" << std::endl;
+        f << "             return true;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "        // Decode the next message and pass it to handler.On() (see " << factory << "::Dispatch)" << std::endl;
+    f << "        // returns false at the end of the log, error is set to the result of the decoding" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        bool DispatchNext(Handler& handler, " << factory << "::ERROR* error = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t type;" << std::endl;
+    f << "             const char* message;" << std::endl;
+    f << "             uint32_t len;" << std::endl;
+    f << "             if(!InternalNext(&type, &message, &len))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             " << factory << "::ERROR result = " << factory << "::Dispatch(message, len, handler);" << std::endl;
+    f << "             if(error)" << std::endl;
+    f << "                 *error = result;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // True if the index of the log at path has an entry for each of its records" << std::endl;
+    f << "        static bool IsIndexValid(const char* path)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             struct stat logInfo, indexInfo;" << std::endl;
+    f << "             bool logExists = (stat(path, &logInfo) == 0);" << std::endl;
+    f << "             if(stat((std::string(path) + \".idx\").c_str(), &indexInfo) != 0)" << std::endl;
+    f << "                 return !logExists;" << std::endl;
+    f << "             if(!logExists || indexInfo.st_size % 16 != 0)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             if(indexInfo.st_size == 0)" << std::endl;
+    f << "                 return logInfo.st_size == 0;" << std::endl;
+    f << "             // The last record must end the log" << std::endl;
+    f << "             int logFd = open(path, O_RDONLY);" << std::endl;
+    f << "             int indexFd = open((std::string(path) + \".idx\").c_str(), O_RDONLY);" << std::endl;
+    f << "             char entry[8], header[4];" << std::endl;
+    f << "             bool result = (logFd >= 0 && indexFd >= 0 && pread(indexFd, entry, 8, indexInfo.st_size - 16) == 8);" << std::endl;
+    f << "             uint64_t offset = result ? " << base << "::Load8(entry) : 0;" << std::endl;
+    f << "             result = result && pread(logFd, header, 4, (off_t)offset) == 4;" << std::endl;
+    if(options.compression)
+        f << "             result = result && offset + 4 + (" << base << "::Load4(header) & ~kCompressed) == (uint64_t)logInfo.st_size;" << std::endl;
+    else
+        f << "             result = result && offset + 4 + " << base << "::Load4(header) == (uint64_t)logInfo.st_size;" << std::endl;
+    f << "             if(logFd >= 0)" << std::endl;
+    f << "                 close(logFd);" << std::endl;
+    f << "             if(indexFd >= 0)" << std::endl;
+    f << "                 close(indexFd);" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Rewrite the index of the log at path by scanning it, an incomplete or invalid" << std::endl;
+    f << "        // record at the end of the log (left by a crash) is truncated" << std::endl;
+    f << "        static bool RebuildIndex(const char* path)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             const char* log = 0;" << std::endl;
+    f << "             uint64_t size = 0;" << std::endl;
+    f << "             struct stat info;" << std::endl;
+    f << "             if(stat(path, &info) != 0)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 int fd = open(path, O_WRONLY | O_CREAT, 0644);" << std::endl;
+    f << "                 if(fd < 0)" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 close(fd);" << std::endl;
+    f << "             }" << std::endl;
+    f << "             if(!Map(path, &log, &size))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             std::string indexPath = std::string(path) + \".idx\";" << std::endl;
+    f << "             int indexFd = open(indexPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);" << std::endl;
+    f << "             bool result = (indexFd >= 0);" << std::endl;
+    f << "             std::string index;" << std::endl;
+    f << "             uint64_t position = 0;" << std::endl;
+    if(options.compression)
+    {
+        f << "             std::string block;" << std::endl;
+        f << "             uint32_t len, version, type;" << std::endl;
+        f << "             while(result && ReadRecord(log, size, position, &len))" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 if(" << base << "::Load4(log + position) & kCompressed)" << std::endl;
+        f << "                 {" << std::endl;
+        f << "                     // A block is indexed only if all its records are valid" << std::endl;
+        f << "                     std::string entries;" << std::endl;
+        f << "                     uint32_t blockPosition = 0, recordSize;" << std::endl;
+        f << "                     if(!ReadBlock(log + position, len, block))" << std::endl;
+        f << "                         break;" << std::endl;
+        f << "                     while(blockPosition < block.size() && ReadBlockRecord(block, blockPosition, &recordSize, &type))" << std::endl;
+        f << "                     {" << std::endl;
+        f << "                         char entry[16] = {0};" << std::endl;
+        f << "                         " << base << "::Store8(entry, position);" << std::endl;
+        f << "                         " << base << "::Store4(entry + 8, type);" << std::endl;
+        f << "                         " << base << "::Store4(entry + 12, blockPosition + 1);" << std::endl;
+        f << "                         entries.append(entry, 16);" << std::endl;
+        f << "                         blockPosition += 4 + recordSize;" << std::endl;
+        f << "                     }" << std::endl;
+        f << "                     if(blockPosition != block.size())" << std::endl;
+        f << "                         break;" << std::endl;
+        f << "                     index.append(entries);" << std::endl;
+        f << "                 }" << std::endl;
+        f << "                 else if(!" << base << "::InternalReadHeader(log + position + 4, len, &version, &type))" << std::endl;
+        f << "                     break;" << std::endl;
+        f << "                 else" << std::endl;
+        f << "                 {" << std::endl;
+        f << "                     char entry[16] = {0};" << std::endl;
+        f << "                     " << base << "::Store8(entry, position);" << std::endl;
+        f << "                     " << base << "::Store4(entry + 8, type);" << std::endl;
+        f << "                     index.append(entry, 16);" << std::endl;
+        f << "                 }" << std::endl;
+    }
+    else
+    {
+        f << "             uint32_t len, version, type;" << std::endl;
+        f << "             while(result && ReadRecord(log, size, position, &len) && " << base << "::InternalReadHeader(log + position + 4, len, &version, &type))" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 char entry[16] = {0};" << std::endl;
+        f << "                 " << base << "::Store8(entry, position);" << std::endl;
+        f << "                 " << base << "::Store4(entry + 8, type);" << std::endl;
+        f << "                 index.append(entry, 16);" << std::endl;
+    }
+    f << "                 if(index.size() >= (1 << 20))" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     result = WriteAll(indexFd, index);" << std::endl;
+    f << "                     index.clear();" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 position += 4 + (uint64_t)len;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             result = result && WriteAll(indexFd, index);" << std::endl;
+    f << "             if(log)" << std::endl;
+    f << "                 munmap((void*)log, size);" << std::endl;
+    f << "             if(indexFd >= 0)" << std::endl;
+    f << "                 close(indexFd);" << std::endl;
+    f << "             return result && (position == size || truncate(path, (off_t)position) == 0);" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        " << reader << "(const " << reader << "&);" << std::endl;
+    f << "        " << reader << "& operator=(const " << reader << "&);" << std::endl;
+    f << "        // Check the record at position fits in the log, and get the size of its message" << std::endl;
+    f << "        static bool ReadRecord(const char* log, uint64_t size, uint64_t position, uint32_t* len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(position > size || size - position < 4)" << std::endl;
+    f << "                 return false;" << std::endl;
+    if(options.compression)
+        f << "             *len = " << base << "::Load4(log + position) & ~kCompressed;" << std::endl;
+    else
+        f << "             *len = " << base << "::Load4(log + position);" << std::endl;
+    f << "             return size - position - 4 >= *len;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.compression)
+    {
+        f << "        static const uint32_t kCompressed = 0x80000000;" << std::endl;
+        f << "        // Decompress the block record at record, of len bytes after its size" << std::endl;
+        f << "        static bool ReadBlock(const char* record, uint32_t len, std::string& block)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t size = (len >= 4 ? " << base << "::Load4(record + 4) : 0);" << std::endl;
+        f << "             // A sequence of 2 bytes expands to 255 bytes at most, which bounds the allocation" << std::endl;
+        f << "             if(size == 0 || size / 255 > len)" << std::endl;
+        f << "                 return false;" << std::endl;
+        f << "             block.resize(size);" << std::endl;
+        f << "             return " << compressor << "::Decompress(record + 8, len - 4, &block[0], size);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Check the record at position in a block, and get the size and type of its message" << std::endl;
+        f << "        static bool ReadBlockRecord(const std::string& block, uint32_t position, uint32_t* len, uint32_t* type)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t version;" << std::endl;
+        f << "             return ReadRecord(block.data(), block.size(), position, len) && !(" << base << "::Load4(block.data() + position) & kCompressed)" << std::endl;
+        f << "                 && " << base << "::InternalReadHeader(block.data() + position + 4, *len, &version, type);" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "        // An empty file is mapped as a null pointer" << std::endl;
+    f << "        static bool Map(const char* path, const char** data, uint64_t* size)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             int fd = open(path, O_RDONLY);" << std::endl;
+    f << "             struct stat info;" << std::endl;
+    f << "             if(fd < 0 || fstat(fd, &info) != 0)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(fd >= 0)" << std::endl;
+    f << "                     close(fd);" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             *size = (uint64_t)info.st_size;" << std::endl;
+    f << "             *data = 0;" << std::endl;
+    f << "             void* p = *size ? mmap(0, (size_t)*size, PROT_READ, MAP_SHARED, fd, 0) : 0;" << std::endl;
+    f << "             close(fd);" << std::endl;
+    f << "             if(p == MAP_FAILED)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             *data = static_cast<const char*>(p);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static bool WriteAll(int fd, const std::string& buffer)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(size_t done = 0; done < buffer.size();)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 ssize_t written = write(fd, buffer.data() + done, buffer.size() - done);" << std::endl;
+    f << "                 if(written < 0 && errno != EINTR)" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 if(written > 0)" << std::endl;
+    f << "                     done += (size_t)written;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        const char* m_log;" << std::endl;
+    f << "        uint64_t m_logSize;" << std::endl;
+    f << "        const char* m_index;" << std::endl;
+    f << "        uint64_t m_indexSize;" << std::endl;
+    f << "        uint64_t m_count;" << std::endl;
+    f << "        uint64_t m_position;" << std::endl;
+    f << "        uint64_t m_sequence;" << std::endl;
+    if(options.compression)
+    {
+        f << "        // Last block decompressed, and position of the next record in the current block" << std::endl;
+        f << "        std::string m_block;" << std::endl;
+        f << "        uint64_t m_blockOffset;" << std::endl;
+        f << "        uint32_t m_blockPosition;" << std::endl;
+    }
+    f << "    friend class " << writer << ";" << std::endl;
+    f << "};" << std::endl;
+    f << "class " << writer << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // Writes are grouped in blocks of bufferSize bytes" << std::endl;
+    if(options.compression)
+        f << "        explicit " << writer << "(uint32_t bufferSize = 1 << 20) : m_logFd(-1), m_indexFd(-1), m_bufferSize(bufferSize), m_size(0), m_count(0), m_compressionThreshold(0)" << std::endl;
+    else
+        f << "        explicit " << writer << "(uint32_t bufferSize = 1 << 20) : m_logFd(-1), m_indexFd(-1), m_bufferSize(bufferSize), m_size(0), m_count(0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "        }" << std::endl;
+    f << "        ~" << writer << "()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Create the log, or append to an existing one (its index is rebuilt if it's not in sync)" << std::endl;
+    f << "        bool Open(const char* path)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "             std::string indexPath = std::string(path) + \".idx\";" << std::endl;
+    f << "             if(!" << reader << "::IsIndexValid(path) && !" << reader << "::RebuildIndex(path))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             m_logFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);" << std::endl;
+    f << "             m_indexFd = open(indexPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);" << std::endl;
+    f << "             struct stat logInfo, indexInfo;" << std::endl;
+    f << "             if(m_logFd < 0 || m_indexFd < 0 || fstat(m_logFd, &logInfo) != 0 || fstat(m_indexFd, &indexInfo) != 0)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 Close();" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             m_size = (uint64_t)logInfo.st_size;" << std::endl;
+    f << "             m_count = (uint64_t)indexInfo.st_size / 16;" << std::endl;
+    f << "             m_log.reserve(m_bufferSize);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Flush and close the files" << std::endl;
+    f << "        bool Close()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             bool result = Flush();" << std::endl;
+    f << "             if(m_logFd >= 0)" << std::endl;
+    f << "                 close(m_logFd);" << std::endl;
+    f << "             if(m_indexFd >= 0)" << std::endl;
+    f << "                 close(m_indexFd);" << std::endl;
+    f << "             m_logFd = -1;" << std::endl;
+    f << "             m_indexFd = -1;" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Append message, returns false if writing failed" << std::endl;
+    f << "        bool Append(const " << base << "& message)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t len = message.CalculateNeededSerializationSize();" << std::endl;
+    f << "             char* p = Prepare(message.GetType(), len);" << std::endl;
+    f << "             if(!p)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             message.ToBuffer(p, len);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Append a message already serialized with ToBuffer, returns false if it's invalid" << std::endl;
+    f << "        bool AppendSerialized(const char* buffer, uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size, version, type;" << std::endl;
+    f << "             if(" << factory << "::MeasureFrame(buffer, len, &size) != " << factory << "::NOERROR || !" << base << "::InternalReadHeader(buffer, size, &version, &type))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             char* p = Prepare((" << base << "::MESSAGE_TYPE)type, size);" << std::endl;
+    f << "             if(!p)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             memcpy(p, buffer, size);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.compression)
+    {
+        f << "        // Blocks of at least threshold bytes of records are compressed when flushed, if it saves" << std::endl;
+        f << "        // space. 0 (the default) never compresses" << std::endl;
+        f << "        void SetCompressionThreshold(uint32_t threshold)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             m_compressionThreshold = threshold;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "        // Write the buffered records, then their index entries" << std::endl;
+    f << "        bool Flush()" << std::endl;
+    f << "        {" << std::endl;
+    if(options.compression)
+    {
+        f << "             if(m_compressionThreshold && m_log.size() >= m_compressionThreshold)" << std::endl;
+        f << "                 Compress();" << std::endl;
+    }
+    f << "             bool result = " << reader << "::WriteAll(m_logFd, m_log) && " << reader << "::WriteAll(m_indexFd, m_index);" << std::endl;
+    f << "             m_log.clear();" << std::endl;
+    f << "             m_index.clear();" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Sequence number of the next message appended" << std::endl;
+    f << "        uint64_t GetCount() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_count;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        " << writer << "(const " << writer << "&);" << std::endl;
+    f << "        " << writer << "& operator=(const " << writer << "&);" << std::endl;
+    f << "        // Add the record header and the index entry, returns where to write the message" << std::endl;
+    f << "        char* Prepare(" << base << "::MESSAGE_TYPE type, uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    if(options.compression)
+        f << "             if(m_logFd < 0 || len >= " << reader << "::kCompressed)" << std::endl;
+    else
+        f << "             if(m_logFd < 0 || len == 0xffffffff)" << std::endl;
+    f << "                 return 0;" << std::endl;
+    f << "             if(m_log.size() + 4 + len > m_bufferSize && !Flush())" << std::endl;
+    f << "                 return 0;" << std::endl;
+    f << "             char entry[16] = {0};" << std::endl;
+    f << "             " << base << "::Store8(entry, m_size);" << std::endl;
+    f << "             " << base << "::Store4(entry + 8, (uint32_t)type);" << std::endl;
+    f << "             m_index.append(entry, 16);" << std::endl;
+    f << "             size_t offset = m_log.size();" << std::endl;
+    f << "             m_log.resize(offset + 4 + len);" << std::endl;
+    f << "             " << base << "::Store4(&m_log[offset], len);" << std::endl;
+    f << "             m_size += 4 + len;" << std::endl;
+    f << "             ++m_count;" << std::endl;
+    f << "             return &m_log[offset + 4];" << std::endl;
+    f << "        }" << std::endl;
+    if(options.compression)
+    {
+        f << "        // Replace the buffered records by a compressed block, if it saves space" << std::endl;
+        f << "        void Compress()" << std::endl;
+        f << "        {" << std::endl;
+        f << "             if(m_log.size() >= " << reader << "::kCompressed)" << std::endl;
+        f << "                 return;" << std::endl;
+        f << "             uint32_t size = (uint32_t)m_log.size();" << std::endl;
+        f << "             m_block.resize(8 + " << compressor << "::GetMaxCompressedSize(size));" << std::endl;
+        f << "             uint32_t blockSize = " << compressor << "::Compress(m_log.data(), size, &m_block[8]);" << std::endl;
+        f << "             if(8 + blockSize >= size)" << std::endl;
+        f << "                 return;" << std::endl;
+        f << "             " << base << "::Store4(&m_block[0], (4 + blockSize) | " << reader << "::kCompressed);" << std::endl;
+        f << "             " << base << "::Store4(&m_block[4], size);" << std::endl;
+        f << "             m_block.resize(8 + blockSize);" << std::endl;
+        f << "             // The index entries point to the block, with the position of their record in it" << std::endl;
+        f << "             uint64_t blockOffset = m_size - size;" << std::endl;
+        f << "             for(size_t i = 0; i < m_index.size(); i += 16)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 uint64_t offset = " << base << "::Load8(&m_index[i]);" << std::endl;
+        f << "                 " << base << "::Store8(&m_index[i], blockOffset);" << std::endl;
+        f << "                 " << base << "::Store4(&m_index[i + 12], (uint32_t)(offset - blockOffset) + 1);" << std::endl;
+        f << "             }" << std::endl;
+        f << "             m_log.swap(m_block);" << std::endl;
+        f << "             m_size = blockOffset + m_log.size();" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "        int m_logFd;" << std::endl;
+    f << "        int m_indexFd;" << std::endl;
+    f << "        uint32_t m_bufferSize;" << std::endl;
+    f << "        std::string m_log;" << std::endl;
+    f << "        std::string m_index;" << std::endl;
+    f << "        // Size of the log and count of messages, including what is buffered" << std::endl;
+    f << "        uint64_t m_size;" << std::endl;
+    f << "        uint64_t m_count;" << std::endl;
+    if(options.compression)
+    {
+        f << "        uint32_t m_compressionThreshold;" << std::endl;
+        f << "        std::string m_block;" << std::endl;
+    }
+    f << "};" << std::endl;
+    f << std::endl;
+
+    f << "#endif" << std::endl;
+    f << std::endl;
+}
+
+// Non-blocking socket connection and its epoll poller (see !connection)
+void WriteConnection(std::ostream& f, const Options& options)
+{
+    std::string base = options.baseclass;
+    std::string factory = options.baseclass + "Factory";
+    std::string connection = options.baseclass + "Connection";
+    std::string poller = options.baseclass + "Poller";
+    std::string task = options.baseclass + "Task";
+
+    f << "#ifndef _WIN32" << std::endl;
+    f << "// Messages over a non-blocking stream socket. Received data is read into an input buffer reused" << std::endl;
+    f << "// from one read to another and the messages are decoded in place from it: only the start of a" << std::endl;
+    f << "// message received partially is moved (to the front of the buffer) to make room for its end" << std::endl;
+    f << "// Sent messages are serialized into an output buffer (or referenced, see SendSerialized) and" << std::endl;
+    f << "// Flush() writes all of them at once, gathered by sendmsg()" << std::endl;
+    f << "// A connection is used by a single thread, e.g. the one running its " << poller << std::endl;
+    f << "class " << connection << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // Message received, in place in the input buffer: valid until the connection is read" << std::endl;
+    f << "        // again. Its type is the message type (see " << factory << "::PeekType), data can be read with the" << std::endl;
+    f << "        // views or " << factory << "::ParseInto" << std::endl;
+    f << "        struct Frame" << std::endl;
+    f << "        {" << std::endl;
+    f << "            uint32_t type;" << std::endl;
+    f << "            const char* data;" << std::endl;
+    f << "            uint32_t size;" << std::endl;
+    f << "            Frame() : type(0), data(0), size(0) {}" << std::endl;
+    f << "            bool IsValid() const" << std::endl;
+    f << "            {" << std::endl;
+    f << "                return data != 0;" << std::endl;
+    f << "            }" << std::endl;
+    f << "        };" << std::endl;
+    f << "        // The connection owns fd, a connected stream socket, which it makes non-blocking" << std::endl;
+    f << "        // Messages bigger than maxMessageSize are rejected with BAD_SIZE" << std::endl;
+    f << "        " << connection << "(int fd, uint32_t maxMessageSize = 64 * 1024 * 1024)" << std::endl;
+    f << "            : m_fd(fd), m_systemError(0), m_maxMessageSize(maxMessageSize), m_error(" << factory << "::NOERROR), m_in(kReadSize), m_begin(0), m_end(0)," << std::endl;
+    f << "              m_neededBytes(0), m_segmentIndex(0), m_sentBytes(0), m_pendingSize(0), m_iovecList(kMaxIovec)" << std::endl;
+    f << "#ifdef MSGBUF_COROUTINES" << std::endl;
+    f << "              , m_waitingFrame(0)" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        {" << std::endl;
+    f << "             int flags = fcntl(fd, F_GETFL, 0);" << std::endl;
+    f << "             if(flags >= 0)" << std::endl;
+    f << "                 fcntl(fd, F_SETFL, flags | O_NONBLOCK);" << std::endl;
+    f << "             // Flush() already gathers the messages, delaying small writes more only adds latency" << std::endl;
+    f << "             int on = 1;" << std::endl;
+    f << "             setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));" << std::endl;
+    f << "        }" << std::endl;
+    f << "        ~" << connection << "()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void Close()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(m_fd >= 0)" << std::endl;
+    f << "                 close(m_fd);" << std::endl;
+    f << "             m_fd = -1;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // False once closed, by Close(), by the peer or after a system error (see GetSystemError)" << std::endl;
+    f << "        bool IsOpen() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_fd >= 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        int GetFd() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_fd;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // errno of the read or write that closed the connection, 0 if it wasn't closed by an error" << std::endl;
+    f << "        int GetSystemError() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_systemError;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Error of the data received: the connection isn't read anymore once it isn't NOERROR" << std::endl;
+    f << "        " << factory << "::ERROR GetError() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_error;" << std::endl;
+    f << "        }" << std::endl;
+    f << std::endl;
+    f << "        // Read what the socket holds and pass every complete message to handler.On() (see" << std::endl;
+    f << "        // " << factory << "::Dispatch), until reading would block" << std::endl;
+    f << "        // Returns false once the connection can't be read anymore (see IsOpen and GetError)" << std::endl;
+    f << "        // handler may send messages, but must not close or destroy the connection" << std::endl;
+    if(options.framed)
+        f << "        // Messages of unknown types (e.g. from a newer schema) are skipped" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        bool Receive(Handler& handler)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalReceive(handler, (Decoded*)0);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Same, passing every message undecoded to handler.OnFrame(const Frame&) instead" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        bool ReceiveFrames(Handler& handler)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalReceive(handler, (Frame*)0);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Next complete message, reading the socket if none is buffered. Returns false when no" << std::endl;
+    f << "        // message can be read without blocking (or when the connection can't be read anymore)" << std::endl;
+    f << "        // The poller only reports new data: call it until it returns false before waiting again" << std::endl;
+    f << "        bool TryNext(Frame& frame)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             frame = Frame();" << std::endl;
+    f << "             for(;;)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(DeliverNext(frame, (Captured*)0))" << std::endl;
+    f << "                     return true;" << std::endl;
+    f << "                 if(m_error != " << factory << "::NOERROR || !Read())" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "#ifdef MSGBUF_COROUTINES" << std::endl;
+    f << "        // Awaiter returned by NextMessage()" << std::endl;
+    f << "        class MessageAwaiter" << std::endl;
+    f << "        {" << std::endl;
+    f << "            public:" << std::endl;
+    f << "                explicit MessageAwaiter(" << connection << "& connection) : m_connection(connection) {}" << std::endl;
+    f << "                bool await_ready()" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    return m_connection.TryNext(m_frame) || !m_connection.IsOpen() || m_connection.m_error != " << factory << "::NOERROR;" << std::endl;
+    f << "                }" << std::endl;
+    f << "                void await_suspend(std::coroutine_handle<> waiter)" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    m_connection.m_waiter = waiter;" << std::endl;
+    f << "                    m_connection.m_waitingFrame = &m_frame;" << std::endl;
+    f << "                }" << std::endl;
+    f << "                Frame await_resume()" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    return m_frame;" << std::endl;
+    f << "                }" << std::endl;
+    f << "            private:" << std::endl;
+    f << "                " << connection << "& m_connection;" << std::endl;
+    f << "                Frame m_frame;" << std::endl;
+    f << "        };" << std::endl;
+    f << "        // co_await connection.NextMessage() returns the next message received (see TryNext)," << std::endl;
+    f << "        // suspending the coroutine until the poller of the connection sees one arrive" << std::endl;
+    f << "        // The frame returned is invalid once the connection can't be read anymore" << std::endl;
+    f << "        MessageAwaiter NextMessage()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return MessageAwaiter(*this);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Resume the coroutine awaiting NextMessage() if a message arrived (or if the connection" << std::endl;
+    f << "        // can't be read anymore), returns false if no coroutine awaits one" << std::endl;
+    f << "        bool InternalResume()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(!m_waiter)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             if(TryNext(*m_waitingFrame) || m_fd < 0 || m_error != " << factory << "::NOERROR)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 std::coroutine_handle<> waiter = m_waiter;" << std::endl;
+    f << "                 m_waiter = std::coroutine_handle<>();" << std::endl;
+    f << "                 waiter.resume();" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "#endif" << std::endl;
+    f << std::endl;
+    f << "        // Serialize message at the end of the output buffer, written by the next Flush()" << std::endl;
+    f << "        void Send(const " << base << "& message)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             size_t offset = m_out.size();" << std::endl;
+    f << "             AddSegment(0, offset, message.AppendTo(m_out));" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Reference a message already serialized with ToBuffer, without copying it" << std::endl;
+    f << "        // buffer must stay valid until it has been written, returns false if it's invalid" << std::endl;
+    f << "        bool SendSerialized(const char* buffer, uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size;" << std::endl;
+    f << "             if(" << factory << "::MeasureFrame(buffer, len, &size) != " << factory << "::NOERROR)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             AddSegment(buffer, 0, size);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Write as much of what was sent as the socket takes, the poller writes the rest once the" << std::endl;
+    f << "        // socket is writable again. Returns false if the connection got closed" << std::endl;
+    f << "        bool Flush()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             while(m_segmentIndex < m_segmentList.size())" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(m_fd < 0)" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 size_t count = m_segmentList.size() - m_segmentIndex;" << std::endl;
+    f << "                 if(count > kMaxIovec)" << std::endl;
+    f << "                     count = kMaxIovec;" << std::endl;
+    f << "                 for(size_t i = 0; i < count; ++i)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     const Segment& segment = m_segmentList[m_segmentIndex + i];" << std::endl;
+    f << "                     size_t skip = (i == 0 ? m_sentBytes : 0);" << std::endl;
+    f << "                     m_iovecList[i].iov_base = (void*)((segment.external ? segment.external : &m_out[segment.offset]) + skip);" << std::endl;
+    f << "                     m_iovecList[i].iov_len = segment.len - skip;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 struct msghdr header;" << std::endl;
+    f << "                 memset(&header, 0, sizeof(header));" << std::endl;
+    f << "                 header.msg_iov = &m_iovecList[0];" << std::endl;
+    f << "                 header.msg_iovlen = count;" << std::endl;
+    f << "                 ssize_t written = sendmsg(m_fd, &header, kSendFlags);" << std::endl;
+    f << "                 if(written < 0)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     if(errno == EINTR)" << std::endl;
+    f << "                         continue;" << std::endl;
+    f << "                     if(errno == EAGAIN || errno == EWOULDBLOCK)" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         DropWritten();" << std::endl;
+    f << "                         return true;" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     Fail(errno);" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 // Skip what was written" << std::endl;
+    f << "                 m_pendingSize -= (size_t)written;" << std::endl;
+    f << "                 size_t left = (size_t)written;" << std::endl;
+    f << "                 while(left > 0)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     size_t rest = m_segmentList[m_segmentIndex].len - m_sentBytes;" << std::endl;
+    f << "                     if(left < rest)" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         m_sentBytes += left;" << std::endl;
+    f << "                         break;" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     left -= rest;" << std::endl;
+    f << "                     m_sentBytes = 0;" << std::endl;
+    f << "                     ++m_segmentIndex;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "             }" << std::endl;
+    f << "             // Everything was written, the buffer capacity is kept" << std::endl;
+    f << "             m_out.clear();" << std::endl;
+    f << "             m_segmentList.clear();" << std::endl;
+    f << "             m_segmentIndex = 0;" << std::endl;
+    f << "             m_sentBytes = 0;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Bytes sent but not written yet" << std::endl;
+    f << "        size_t GetPendingSize() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_pendingSize;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        " << connection << "(const " << connection << "&);" << std::endl;
+    f << "        " << connection << "& operator=(const " << connection << "&);" << std::endl;
+    f << "        // Size of the input buffer, and minimum room for a read" << std::endl;
+    f << "        static const size_t kReadSize = 64 * 1024;" << std::endl;
+    f << "        static const size_t kMinRead = 4 * 1024;" << std::endl;
+    f << "        // Segments written by one sendmsg()" << std::endl;
+    f << "        static const size_t kMaxIovec = 64;" << std::endl;
+    f << "        // No SIGPIPE when the peer is gone, the error is returned instead" << std::endl;
+    f << "#ifdef MSG_NOSIGNAL" << std::endl;
+    f << "        static const int kSendFlags = MSG_NOSIGNAL;" << std::endl;
+    f << "#else" << std::endl;
+    f << "        static const int kSendFlags = 0;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        struct Segment" << std::endl;
+    f << "        {" << std::endl;
+    f << "            const char* external; // 0 when stored in m_out at offset" << std::endl;
+    f << "            size_t offset;" << std::endl;
+    f << "            size_t len;" << std::endl;
+    f << "            Segment(const char* e, size_t o, size_t l) : external(e), offset(o), len(l) {}" << std::endl;
+    f << "        };" << std::endl;
+    f << "        // Kinds of delivery of the messages received" << std::endl;
+    f << "        struct Decoded {};" << std::endl;
+    f << "        struct Captured {};" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        static " << factory << "::ERROR Deliver(Handler& handler, const char* buffer, uint32_t len, uint32_t* size, Decoded*)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return " << factory << "::Dispatch(buffer, len, handler, size);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        static " << factory << "::ERROR Deliver(Handler& handler, const char* buffer, uint32_t len, uint32_t* size, Frame*)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Frame frame;" << std::endl;
+    f << "             " << factory << "::ERROR error = Deliver(frame, buffer, len, size, (Captured*)0);" << std::endl;
+    f << "             if(error == " << factory << "::NOERROR)" << std::endl;
+    f << "                 handler.OnFrame(frame);" << std::endl;
+    f << "             return error;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static " << factory << "::ERROR Deliver(Frame& frame, const char* buffer, uint32_t len, uint32_t* size, Captured*)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             " << factory << "::ERROR error = " << factory << "::MeasureFrame(buffer, len, size);" << std::endl;
+    f << "             if(error == " << factory << "::NOERROR)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 frame.type = " << factory << "::PeekType(buffer);" << std::endl;
+    f << "                 frame.data = buffer;" << std::endl;
+    f << "                 frame.size = *size;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return error;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Pass the first message buffered to handler, returns false if none is complete" << std::endl;
+    f << "        // (m_neededBytes is then the size it needs, if known) or on error (see m_error)" << std::endl;
+    f << "        template <class Handler, class Mode>" << std::endl;
+    f << "        bool DeliverNext(Handler& handler, Mode* mode)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             while(m_begin < m_end)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 uint32_t size;" << std::endl;
+    f << "                 " << factory << "::ERROR error = Deliver(handler, &m_in[m_begin], (uint32_t)(m_end - m_begin), &size, mode);" << std::endl;
+    f << "                 if(error == " << factory << "::NOERROR)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     m_begin += size;" << std::endl;
+    f << "                     return true;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 if(error == " << factory << "::NEED_MORE_DATA)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     if(size > m_maxMessageSize)" << std::endl;
+    f << "                         m_error = " << factory << "::BAD_SIZE;" << std::endl;
+    f << "                     m_neededBytes = size;" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 }" << std::endl;
+    if(options.framed)
+    {
+        f << "                 if(error != " << factory << "::INVALID_TYPE)" << std::endl;
+        f << "                 {" << std::endl;
+        f << "                     m_error = error;" << std::endl;
+        f << "                     return false;" << std::endl;
+        f << "                 }" << std::endl;
+        f << "                 // Unknown type (e.g. from a newer schema), skipped" << std::endl;
+        f << "                 m_begin += size;" << std::endl;
+    }
+    else
+    {
+        f << "                 m_error = error;" << std::endl;
+        f << "                 return false;" << std::endl;
+    }
+    f << "             }" << std::endl;
+    f << "             m_neededBytes = 0;" << std::endl;
+    f << "             return false;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        template <class Handler, class Mode>" << std::endl;
+    f << "        bool InternalReceive(Handler& handler, Mode* mode)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(;;)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 while(DeliverNext(handler, mode))" << std::endl;
+    f << "                     ;" << std::endl;
+    f << "                 if(m_error != " << factory << "::NOERROR)" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 if(!Read())" << std::endl;
+    f << "                     return m_fd >= 0;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Read once at the end of the input buffer, returns false if there was nothing to read" << std::endl;
+    f << "        // (or if the connection got closed)" << std::endl;
+    f << "        bool Read()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(m_fd < 0)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             // Room for the whole message being received, or for kMinRead bytes at least: the data" << std::endl;
+    f << "             // left is moved to the front if that's enough, the buffer grows otherwise" << std::endl;
+    f << "             size_t buffered = m_end - m_begin;" << std::endl;
+    f << "             size_t needed = (m_neededBytes > buffered + kMinRead ? m_neededBytes : buffered + kMinRead);" << std::endl;
+    f << "             if(m_in.size() - m_begin < needed || buffered == 0)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(buffered > 0)" << std::endl;
+    f << "                     memmove(&m_in[0], &m_in[m_begin], buffered);" << std::endl;
+    f << "                 m_begin = 0;" << std::endl;
+    f << "                 m_end = buffered;" << std::endl;
+    f << "                 if(m_in.size() < needed)" << std::endl;
+    f << "                     m_in.resize(needed);" << std::endl;
+    f << "             }" << std::endl;
+    f << "             for(;;)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 ssize_t count = read(m_fd, &m_in[m_end], m_in.size() - m_end);" << std::endl;
+    f << "                 if(count > 0)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     m_end += (size_t)count;" << std::endl;
+    f << "                     return true;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 if(count < 0 && errno == EINTR)" << std::endl;
+    f << "                     continue;" << std::endl;
+    f << "                 if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 // Closed by the peer (count is 0) or error" << std::endl;
+    f << "                 Fail(count < 0 ? errno : 0);" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void Fail(int error)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             m_systemError = error;" << std::endl;
+    f << "             Close();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Drop the segments already written, and the data they held once it's most of the output" << std::endl;
+    f << "        // buffer: a peer that never reads everything would make the buffer grow forever otherwise" << std::endl;
+    f << "        void DropWritten()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(m_segmentIndex > 0 && m_segmentIndex * 2 >= m_segmentList.size())" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 m_segmentList.erase(m_segmentList.begin(), m_segmentList.begin() + m_segmentIndex);" << std::endl;
+    f << "                 m_segmentIndex = 0;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             // Data of m_out written, up to the first byte that isn't. Messages sent while writing are" << std::endl;
+    f << "             // appended to the segment being written, which may thus never be written fully" << std::endl;
+    f << "             size_t written = m_out.size();" << std::endl;
+    f << "             for(size_t i = m_segmentIndex; i < m_segmentList.size(); ++i)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(!m_segmentList[i].external)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     written = m_segmentList[i].offset + (i == m_segmentIndex ? m_sentBytes : 0);" << std::endl;
+    f << "                     break;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "             }" << std::endl;
+    f << "             if(written == 0 || written * 2 < m_out.size())" << std::endl;
+    f << "                 return;" << std::endl;
+    f << "             m_out.erase(0, written);" << std::endl;
+    f << "             if(m_segmentIndex < m_segmentList.size() && !m_segmentList[m_segmentIndex].external)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 // Its written part is gone" << std::endl;
+    f << "                 m_segmentList[m_segmentIndex].offset += m_sentBytes;" << std::endl;
+    f << "                 m_segmentList[m_segmentIndex].len -= m_sentBytes;" << std::endl;
+    f << "                 m_sentBytes = 0;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             for(size_t i = m_segmentIndex; i < m_segmentList.size(); ++i)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(!m_segmentList[i].external)" << std::endl;
+    f << "                     m_segmentList[i].offset -= written;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void AddSegment(const char* external, size_t offset, size_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(!external && !m_segmentList.empty() && !m_segmentList.back().external && m_segmentList.back().offset + m_segmentList.back().len == offset)" << std::endl;
+    f << "                 m_segmentList.back().len += len;" << std::endl;
+    f << "             else" << std::endl;
+    f << "                 m_segmentList.push_back(Segment(external, offset, len));" << std::endl;
+    f << "             m_pendingSize += len;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        int m_fd;" << std::endl;
+    f << "        int m_systemError;" << std::endl;
+    f << "        uint32_t m_maxMessageSize;" << std::endl;
+    f << "        " << factory << "::ERROR m_error;" << std::endl;
+    f << "        // Data received, the part not delivered yet being from m_begin to m_end" << std::endl;
+    f << "        std::vector<char> m_in;" << std::endl;
+    f << "        size_t m_begin;" << std::endl;
+    f << "        size_t m_end;" << std::endl;
+    f << "        uint32_t m_neededBytes;" << std::endl;
+    f << "        // Data sent, the part not written yet starting at m_sentBytes in segment m_segmentIndex" << std::endl;
+    f << "        std::string m_out;" << std::endl;
+    f << "        std::vector<Segment> m_segmentList;" << std::endl;
+    f << "        size_t m_segmentIndex;" << std::endl;
+    f << "        size_t m_sentBytes;" << std::endl;
+    f << "        size_t m_pendingSize;" << std::endl;
+    f << "        std::vector<struct iovec> m_iovecList;" << std::endl;
+    f << "#ifdef MSGBUF_COROUTINES" << std::endl;
+    f << "        std::coroutine_handle<> m_waiter;" << std::endl;
+    f << "        Frame* m_waitingFrame;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "};" << std::endl;
+    f << "#ifdef MSGBUF_COROUTINES" << std::endl;
+    f << "// Return type of a coroutine started at once and destroyed when it ends, e.g. one serving a" << std::endl;
+    f << "// connection: " << task << " Serve(" << connection << "& connection) { ... co_await connection.NextMessage() ... }" << std::endl;
+    f << "struct " << task << std::endl;
+    f << "{" << std::endl;
+    f << "    struct promise_type" << std::endl;
+    f << "    {" << std::endl;
+    f << "        " << task << " get_return_object()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return " << task << "();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        std::suspend_never initial_suspend() noexcept" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return std::suspend_never();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        std::suspend_never final_suspend() noexcept" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return std::suspend_never();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void return_void()" << std::endl;
+    f << "        {" << std::endl;
+    f << "        }" << std::endl;
+    f << "        void unhandled_exception()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             std::terminate();" << std::endl;
+    f << "        }" << std::endl;
+    f << "    };" << std::endl;
+    f << "};" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#ifdef __linux__" << std::endl;
+    f << "// Edge triggered epoll of connections, e.g. all the ones of a thread. Waiting writes what is" << std::endl;
+    f << "// left to send on the connections that became writable, resumes the coroutines awaiting a" << std::endl;
+    f << "// message on the ones that became readable, and returns the other readable ones" << std::endl;
+    f << "class " << poller << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        " << poller << "() : m_fd(epoll_create1(EPOLL_CLOEXEC)), m_eventList(kMaxEvents)" << std::endl;
+    f << "        {" << std::endl;
+    f << "        }" << std::endl;
+    f << "        ~" << poller << "()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(m_fd >= 0)" << std::endl;
+    f << "                 close(m_fd);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        bool IsOpen() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_fd >= 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // connection must stay alive until it's removed or closed" << std::endl;
+    f << "        bool Add(" << connection << "& connection)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             struct epoll_event event;" << std::endl;
+    f << "             memset(&event, 0, sizeof(event));" << std::endl;
+    f << "             event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;" << std::endl;
+    f << "             event.data.ptr = &connection;" << std::endl;
+    f << "             return epoll_ctl(m_fd, EPOLL_CTL_ADD, connection.GetFd(), &event) == 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        bool Remove(" << connection << "& connection)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             struct epoll_event event;" << std::endl;
+    f << "             memset(&event, 0, sizeof(event));" << std::endl;
+    f << "             return epoll_ctl(m_fd, EPOLL_CTL_DEL, connection.GetFd(), &event) == 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Wait up to timeoutMs milliseconds (-1: forever) for events, and handle them" << std::endl;
+    f << "        // The connections that became readable (or got closed) and have no coroutine awaiting" << std::endl;
+    f << "        // a message are appended to ready if not 0, to be read with Receive() or TryNext()" << std::endl;
+    f << "        // Returns the number of events, -1 on error" << std::endl;
+    f << "        int Wait(int timeoutMs, std::vector<" << connection << "*>* ready = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             int count = epoll_wait(m_fd, &m_eventList[0], kMaxEvents, timeoutMs);" << std::endl;
+    f << "             for(int i = 0; i < count; ++i)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 " << connection << "* connection = (" << connection << "*)m_eventList[i].data.ptr;" << std::endl;
+    f << "                 uint32_t events = m_eventList[i].events;" << std::endl;
+    f << "                 if((events & EPOLLOUT) && connection->GetPendingSize() > 0)" << std::endl;
+    f << "                     connection->Flush();" << std::endl;
+    f << "                 if(!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && connection->IsOpen())" << std::endl;
+    f << "                     continue;" << std::endl;
+    f << "#ifdef MSGBUF_COROUTINES" << std::endl;
+    f << "                 // The connection might be gone once its coroutine is resumed, it isn't used after" << std::endl;
+    f << "                 if(connection->InternalResume())" << std::endl;
+    f << "                     continue;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "                 if(ready)" << std::endl;
+    f << "                     ready->push_back(connection);" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return count;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        " << poller << "(const " << poller << "&);" << std::endl;
+    f << "        " << poller << "& operator=(const " << poller << "&);" << std::endl;
+    f << "        static const int kMaxEvents = 256;" << std::endl;
+    f << "        int m_fd;" << std::endl;
+    f << "        std::vector<struct epoll_event> m_eventList;" << std::endl;
+    f << "};" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#endif" << std::endl;
+
+}
+
+// Per message type counters, only compiled in with MSGBUF_ENABLE_STATS
+void WriteStats(std::ostream& f, const MessageList& messageList, const Options& options)
+{
+    std::string stats = options.baseclass + "Stats";
+
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "// Counters per message type of the calling thread, updated when serializing (ToBuffer, AppendTo," << std::endl;
+    f << "// batches), decoding (the factory, ParseFixed, batches) with the size on the wire, nested messages" << std::endl;
+    f << "// being counted as part of their container," << std::endl;
+    f << "// and on " << options.baseclass << "Factory::CreateFromBuffer errors. Each thread exports its own Snapshot," << std::endl;
+    f << "// to be merged by the caller. MSGBUF_STATS_CYCLES also measures the CPU cycles of one call" << std::endl;
+    f << "// out of kCycleSamplingPeriod (x86 only)" << std::endl;
+    f << "class " << stats << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // The counters of type kTypeCount are for errors on unknown types" << std::endl;
+    f << "        static const uint32_t kTypeCount = " << messageList.size() << ";" << std::endl;
+    f << "        // Errors are indexed by " << options.baseclass << "Factory::ERROR" << std::endl;
+    f << "        static const uint32_t kErrorCount = " << (options.checksum ? 6 : 5) << ";" << std::endl;
+    f << "        static const uint64_t kCycleSamplingPeriod = 64;" << std::endl;
+    f << "        // Counters of a message type, on their own cache lines" << std::endl;
+    f << "        struct Counters" << std::endl;
+    f << "        {" << std::endl;
+    f << "            uint64_t encodeCount;" << std::endl;
+    f << "            uint64_t encodeBytes;" << std::endl;
+    f << "            uint64_t decodeCount;" << std::endl;
+    f << "            uint64_t decodeBytes;" << std::endl;
+    f << "            uint64_t errors[kErrorCount];" << std::endl;
+    f << "            // Cycles of the sampled calls, and the count of sampled calls" << std::endl;
+    f << "            uint64_t encodeCycles;" << std::endl;
+    f << "            uint64_t encodeSamples;" << std::endl;
+    f << "            uint64_t decodeCycles;" << std::endl;
+    f << "            uint64_t decodeSamples;" << std::endl;
+    f << "            char padding[128 - 13 * 8];" << std::endl;
+    f << "        };" << std::endl;
+    f << "        struct Snapshot" << std::endl;
+    f << "        {" << std::endl;
+    f << "            Counters types[kTypeCount + 1];" << std::endl;
+    f << "            void Merge(const Snapshot& other)" << std::endl;
+    f << "            {" << std::endl;
+    f << "                for(uint32_t i = 0; i <= kTypeCount; ++i)" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    Counters& a = types[i];" << std::endl;
+    f << "                    const Counters& b = other.types[i];" << std::endl;
+    f << "                    a.encodeCount += b.encodeCount;" << std::endl;
+    f << "                    a.encodeBytes += b.encodeBytes;" << std::endl;
+    f << "                    a.decodeCount += b.decodeCount;" << std::endl;
+    f << "                    a.decodeBytes += b.decodeBytes;" << std::endl;
+    f << "                    for(uint32_t j = 0; j < kErrorCount; ++j)" << std::endl;
+    f << "                        a.errors[j] += b.errors[j];" << std::endl;
+    f << "                    a.encodeCycles += b.encodeCycles;" << std::endl;
+    f << "                    a.encodeSamples += b.encodeSamples;" << std::endl;
+    f << "                    a.decodeCycles += b.decodeCycles;" << std::endl;
+    f << "                    a.decodeSamples += b.decodeSamples;" << std::endl;
+    f << "                }" << std::endl;
+    f << "            }" << std::endl;
+    f << "            void Clear()" << std::endl;
+    f << "            {" << std::endl;
+    f << "                memset(types, 0, sizeof(types));" << std::endl;
+    f << "            }" << std::endl;
+    f << "        };" << std::endl;
+    f << "        // Copy of the counters of the calling thread" << std::endl;
+    f << "        static Snapshot GetThreadSnapshot()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalThreadSnapshot();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void ResetThread()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             InternalThreadSnapshot().Clear();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Name of a message type, for exporting" << std::endl;
+    f << "        static const char* GetTypeName(uint32_t type)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             static const char* const names[kTypeCount + 1] = {";
+    for(size_t i = 0; i < messageList.size(); ++i)
+        f << "\"" << messageList[i].name << "\", ";
+    f << "\"unknown\"};" << std::endl;
+    f << "             return names[type < kTypeCount ? type : kTypeCount];" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static Counters& InternalGet(uint32_t type)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalThreadSnapshot().types[type < kTypeCount ? type : kTypeCount];" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Timestamp if this call is sampled, 0 otherwise" << std::endl;
+    f << "        static uint64_t InternalStart(uint64_t count)" << std::endl;
+    f << "        {" << std::endl;
+    f << "#if defined(MSGBUF_STATS_CYCLES) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))" << std::endl;
+    f << "             return (count % kCycleSamplingPeriod) == 0 ? __rdtsc() : 0;" << std::endl;
+    f << "#else" << std::endl;
+    f << "             (void)count;" << std::endl;
+    f << "             return 0;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint64_t InternalStartEncode(uint32_t type)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalStart(InternalGet(type).encodeCount);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint64_t InternalStartDecode(uint32_t type)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalStart(InternalGet(type).decodeCount);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void InternalEncoded(uint32_t type, uint64_t bytes, uint64_t start)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Counters& counters = InternalGet(type);" << std::endl;
+    f << "             ++counters.encodeCount;" << std::endl;
+    f << "             counters.encodeBytes += bytes;" << std::endl;
+    f << "             if(start)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 counters.encodeCycles += InternalElapsed(start);" << std::endl;
+    f << "                 ++counters.encodeSamples;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void InternalDecoded(uint32_t type, uint64_t bytes, uint64_t start)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Counters& counters = InternalGet(type);" << std::endl;
+    f << "             ++counters.decodeCount;" << std::endl;
+    f << "             counters.decodeBytes += bytes;" << std::endl;
+    f << "             if(start)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 counters.decodeCycles += InternalElapsed(start);" << std::endl;
+    f << "                 ++counters.decodeSamples;" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void InternalError(uint32_t type, int error)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             ++InternalGet(type).errors[error];" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        static uint64_t InternalElapsed(uint64_t start)" << std::endl;
+    f << "        {" << std::endl;
+    f << "#if defined(MSGBUF_STATS_CYCLES) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))" << std::endl;
+    f << "             return __rdtsc() - start;" << std::endl;
+    f << "#else" << std::endl;
+    f << "             (void)start;" << std::endl;
+    f << "             return 0;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Zero initialized, Snapshot being a POD" << std::endl;
+    f << "        static Snapshot& InternalThreadSnapshot()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             static MSGBUF_THREAD_LOCAL Snapshot snapshot;" << std::endl;
+    f << "             return snapshot;" << std::endl;
+    f << "        }" << std::endl;
+    f << "};" << std::endl;
+    f << "#endif" << std::endl;
+    f << std::endl;
+}
+
+// Start measuring an encode or decode of msg for the stats
+void WriteStatsStart(std::ostream& f, const Message& msg, const Options& options, const std::string& kind)
+{
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "             uint64_t " << MangleInternalKeyword("statsStart") << " = " << options.baseclass << "Stats::InternalStart" << kind << "(" << options.baseclass << "::MT_" << msg.name << ");" << std::endl;
+    f << "#endif" << std::endl;
+}
+
+// Count an encode or decode of msg of size bytes for the stats
+void WriteStatsEnd(std::ostream& f, const Message& msg, const Options& options, const std::string& kind, const std::string& bytes)
+{
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "             " << options.baseclass << "Stats::Internal" << kind << "d(" << options.baseclass << "::MT_" << msg.name << ", " << bytes << ", " << MangleInternalKeyword("statsStart") << ");" << std::endl;
+    f << "#endif" << std::endl;
+}
+
+// Incremental decoder for a stream of messages received in arbitrary chunks
+void WriteDecoder(std::ostream& f, const Options& options)
+{
+    std::string factory = options.baseclass + "Factory";
+
+    f << "// Decode a stream of messages received in chunks of any size (e.g. partial socket reads)" << std::endl;
+    f << "// Complete messages are decoded in place from the chunk, only a message straddling" << std::endl;
+    f << "// two chunks is copied (into an internal buffer reused from one message to another)" << std::endl;
+    f << "class " << options.baseclass << "Decoder" << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // Messages bigger than maxMessageSize are rejected with BAD_SIZE" << std::endl;
+    f << "        " << options.baseclass << "Decoder(uint32_t maxMessageSize = 64 * 1024 * 1024) : m_maxMessageSize(maxMessageSize), m_neededBytes(0) {}" << std::endl;
+    f << "        // Pass every complete message of data to handler.On() (see " << factory << "::Dispatch)" << std::endl;
+    f << "        // Returns NEED_MORE_DATA when data ends in the middle of a message, GetNeededBytes()" << std::endl;
+    f << "        // then tells how many more bytes are needed (at least), or NOERROR if data ends on a" << std::endl;
+    f << "        // message boundary. Any other error leaves the stream in an undefined state, call Reset()" << std::endl;
+    if(options.framed)
+        f << "        // Messages of unknown types (e.g. from a newer schema) are skipped" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        " << factory << "::ERROR Feed(const char* data, uint32_t len, Handler& handler)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size;" << std::endl;
+    f << "             " << factory << "::ERROR error;" << std::endl;
+    f << "             // Complete the message left over by the previous chunk" << std::endl;
+    f << "             while(!m_pending.empty())" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 error = " << factory << "::Dispatch(m_pending.data(), (uint32_t)m_pending.size(), handler, &size);" << std::endl;
+    f << "                 if(error == " << factory << "::NOERROR" << (options.framed ? " || error == " + factory + "::INVALID_TYPE" : "") << ")" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     m_pending.clear();" << std::endl;
+    f << "                     break;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 if(error != " << factory << "::NEED_MORE_DATA)" << std::endl;
+    f << "                     return error;" << std::endl;
+    f << "                 if(size > m_maxMessageSize)" << std::endl;
+    f << "                     return " << factory << "::BAD_SIZE;" << std::endl;
+    f << "                 // Only append what is known to be part of this message, the size might grow once" << std::endl;
+    f << "                 // more string lengths are readable" << std::endl;
+    f << "                 uint32_t missing = size - (uint32_t)m_pending.size();" << std::endl;
+    f << "                 if(len < missing)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     m_pending.append(data, len);" << std::endl;
+    f << "                     m_neededBytes = missing - len;" << std::endl;
+    f << "                     return " << factory << "::NEED_MORE_DATA;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 m_pending.append(data, missing);" << std::endl;
+    f << "                 data += missing;" << std::endl;
+    f << "                 len -= missing;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             // Decode in place" << std::endl;
+    f << "             while(len > 0)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 error = " << factory << "::Dispatch(data, len, handler, &size);" << std::endl;
+    f << "                 if(error == " << factory << "::NEED_MORE_DATA)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     if(size > m_maxMessageSize)" << std::endl;
+    f << "                         return " << factory << "::BAD_SIZE;" << std::endl;
+    f << "                     m_pending.assign(data, len);" << std::endl;
+    f << "                     m_neededBytes = size - len;" << std::endl;
+    f << "                     return error;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 if(error != " << factory << "::NOERROR" << (options.framed ? " && error != " + factory + "::INVALID_TYPE" : "") << ")" << std::endl;
+    f << "                     return error;" << std::endl;
+    f << "                 data += size;" << std::endl;
+    f << "                 len -= size;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             m_neededBytes = 0;" << std::endl;
+    f << "             return " << factory << "::NOERROR;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        uint32_t GetNeededBytes() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_neededBytes;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Drop any partially received message" << std::endl;
+    f << "        void Reset()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             m_pending.clear();" << std::endl;
+    f << "             m_neededBytes = 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        std::string m_pending;" << std::endl;
+    f << "        uint32_t m_maxMessageSize;" << std::endl;
+    f << "        uint32_t m_neededBytes;" << std::endl;
+    f << "};" << std::endl;
+}
+
+// Checksum of the messages and batches (see !checksum), used by the base class
+void WriteCrc32c(std::ostream& f, const Options& options)
+{
+    std::string crc = options.baseclass + "Crc32c";
+
+    f << "// CRC32C (Castagnoli polynomial, as in iSCSI or ext4) following every message and batch, see" << std::endl;
+    f << "// !checksum. The crc32 instructions of SSE 4.2 or ARMv8 are used when available, the CPU being" << std::endl;
+    f << "// checked on first use unless the compiler targets it, otherwise slicing-by-8 table lookups" << std::endl;
+    f << "class " << crc << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // CRC of len bytes of data, continuing crc, the CRC of the data preceding them (if any)" << std::endl;
+    f << "        static uint32_t Compute(const char* data, size_t len, uint32_t crc = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "#if defined(MSGBUF_X86_SIMD) && defined(__SSE4_2__)" << std::endl;
+    f << "             return ~UpdateSSE42(~crc, (const unsigned char*)data, len);" << std::endl;
+    f << "#elif defined(MSGBUF_ARM_CRC32)" << std::endl;
+    f << "             return ~UpdateARM(~crc, (const unsigned char*)data, len);" << std::endl;
+    f << "#else" << std::endl;
+    f << "             static const UpdateFunction update = SelectUpdate();" << std::endl;
+    f << "             return ~update(~crc, (const unsigned char*)data, len);" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        typedef uint32_t (*UpdateFunction)(uint32_t crc, const unsigned char* p, size_t len);" << std::endl;
+    f << "        // The crc32 instruction has a latency of 3 cycles but a throughput of 1 per cycle: big" << std::endl;
+    f << "        // buffers are processed as 3 interleaved blocks of kLongBlock (or kShortBlock) bytes, whose" << std::endl;
+    f << "        // CRCs are combined by shifting them over the following blocks (see Tables::Shift)" << std::endl;
+    f << "        enum { kShortBlock = 256, kLongBlock = 8192 };" << std::endl;
+    f << "        struct Tables" << std::endl;
+    f << "        {" << std::endl;
+    f << "            // Table k gives the CRC of a byte followed by k zero bytes, for the reflected polynomial" << std::endl;
+    f << "            uint32_t bytes[8][256];" << std::endl;
+    f << "            // Shift a CRC over kShortBlock or kLongBlock zero bytes, one table per byte of the CRC" << std::endl;
+    f << "            uint32_t shortZeros[4][256];" << std::endl;
+    f << "            uint32_t longZeros[4][256];" << std::endl;
+    f << "            Tables()" << std::endl;
+    f << "            {" << std::endl;
+    f << "                for(uint32_t i = 0; i < 256; ++i)" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    uint32_t crc = i;" << std::endl;
+    f << "                    for(int j = 0; j < 8; ++j)" << std::endl;
+    f << "                        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));" << std::endl;
+    f << "                    bytes[0][i] = crc;" << std::endl;
+    f << "                }" << std::endl;
+    f << "                for(int k = 1; k < 8; ++k)" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    for(uint32_t i = 0; i < 256; ++i)" << std::endl;
+    f << "                        bytes[k][i] = (bytes[k - 1][i] >> 8) ^ bytes[0][bytes[k - 1][i] & 0xff];" << std::endl;
+    f << "                }" << std::endl;
+    f << "                FillZeros(shortZeros, kShortBlock);" << std::endl;
+    f << "                FillZeros(longZeros, kLongBlock);" << std::endl;
+    f << "            }" << std::endl;
+    f << "            static uint32_t Shift(const uint32_t (*zeros)[256], uint32_t crc)" << std::endl;
+    f << "            {" << std::endl;
+    f << "                return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];" << std::endl;
+    f << "            }" << std::endl;
+    f << "            // Appending zero bits is linear over GF(2): it's computed as a 32x32 bit matrix (one" << std::endl;
+    f << "            // column per bit of the CRC), squared to double the number of zero bits" << std::endl;
+    f << "            static uint32_t Multiply(const uint32_t* matrix, uint32_t v)" << std::endl;
+    f << "            {" << std::endl;
+    f << "                uint32_t result = 0;" << std::endl;
+    f << "                for(; v; v >>= 1, ++matrix)" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    if(v & 1)" << std::endl;
+    f << "                        result ^= *matrix;" << std::endl;
+    f << "                }" << std::endl;
+    f << "                return result;" << std::endl;
+    f << "            }" << std::endl;
+    f << "            static void Square(uint32_t* square, const uint32_t* matrix)" << std::endl;
+    f << "            {" << std::endl;
+    f << "                for(int i = 0; i < 32; ++i)" << std::endl;
+    f << "                    square[i] = Multiply(matrix, matrix[i]);" << std::endl;
+    f << "            }" << std::endl;
+    f << "            // len must be a power of 2" << std::endl;
+    f << "            static void FillZeros(uint32_t (*zeros)[256], uint32_t len)" << std::endl;
+    f << "            {" << std::endl;
+    f << "                uint32_t matrix[32], square[32];" << std::endl;
+    f << "                matrix[0] = 0x82f63b78;" << std::endl;
+    f << "                for(int i = 1; i < 32; ++i)" << std::endl;
+    f << "                    matrix[i] = 1u << (i - 1);" << std::endl;
+    f << "                for(uint32_t bits = 1; bits < len * 8; bits *= 2)" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    Square(square, matrix);" << std::endl;
+    f << "                    memcpy(matrix, square, sizeof(matrix));" << std::endl;
+    f << "                }" << std::endl;
+    f << "                for(uint32_t i = 0; i < 256; ++i)" << std::endl;
+    f << "                {" << std::endl;
+    f << "                    for(int k = 0; k < 4; ++k)" << std::endl;
+    f << "                        zeros[k][i] = Multiply(matrix, i << (8 * k));" << std::endl;
+    f << "                }" << std::endl;
+    f << "            }" << std::endl;
+    f << "        };" << std::endl;
+    f << "        static const Tables& GetTables()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             static const Tables tables;" << std::endl;
+    f << "             return tables;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint32_t UpdateTable(uint32_t crc, const unsigned char* p, size_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             const uint32_t (*t)[256] = GetTables().bytes;" << std::endl;
+    f << "             for(; len >= 8; len -= 8, p += 8)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 uint32_t low = crc ^ (p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);" << std::endl;
+    f << "                 uint32_t high = p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;" << std::endl;
+    f << "                 crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24]" << std::endl;
+    f << "                     ^ t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];" << std::endl;
+    f << "             }" << std::endl;
+    f << "             for(; len > 0; --len, ++p)" << std::endl;
+    f << "                 crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);" << std::endl;
+    f << "             return crc;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint64_t Load8(const unsigned char* p)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t v;" << std::endl;
+    f << "             memcpy(&v, p, 8);" << std::endl;
+    f << "             return v;" << std::endl;
+    f << "        }" << std::endl;
+    f << "#ifdef MSGBUF_X86_SIMD" << std::endl;
+    f << "        static __attribute__((target(\"sse4.2\"))) uint32_t UpdateSSE42(uint32_t crc, const unsigned char* p, size_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "#ifdef __x86_64__" << std::endl;
+    f << "             uint64_t crc0 = crc;" << std::endl;
+    f << "             for(size_t block = kLongBlock; block >= kShortBlock && len >= 3 * kShortBlock; block /= kLongBlock / kShortBlock)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 const uint32_t (*zeros)[256] = (block == kLongBlock ? GetTables().longZeros : GetTables().shortZeros);" << std::endl;
+    f << "                 for(; len >= 3 * block; len -= 3 * block, p += 3 * block)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     uint64_t crc1 = 0, crc2 = 0;" << std::endl;
+    f << "                     for(size_t i = 0; i < block; i += 8)" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         crc0 = _mm_crc32_u64(crc0, Load8(p + i));" << std::endl;
+    f << "                         crc1 = _mm_crc32_u64(crc1, Load8(p + block + i));" << std::endl;
+    f << "                         crc2 = _mm_crc32_u64(crc2, Load8(p + 2 * block + i));" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     crc0 = Tables::Shift(zeros, (uint32_t)crc0) ^ crc1;" << std::endl;
+    f << "                     crc0 = Tables::Shift(zeros, (uint32_t)crc0) ^ crc2;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "             }" << std::endl;
+    f << "             for(; len >= 8; len -= 8, p += 8)" << std::endl;
+    f << "                 crc0 = _mm_crc32_u64(crc0, Load8(p));" << std::endl;
+    f << "             crc = (uint32_t)crc0;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "             for(; len > 0; --len, ++p)" << std::endl;
+    f << "                 crc = _mm_crc32_u8(crc, *p);" << std::endl;
+    f << "             return crc;" << std::endl;
+    f << "        }" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#ifdef MSGBUF_ARM_CRC32" << std::endl;
+    f << "        static uint32_t UpdateARM(uint32_t crc, const unsigned char* p, size_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(size_t block = kLongBlock; block >= kShortBlock && len >= 3 * kShortBlock; block /= kLongBlock / kShortBlock)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 const uint32_t (*zeros)[256] = (block == kLongBlock ? GetTables().longZeros : GetTables().shortZeros);" << std::endl;
+    f << "                 for(; len >= 3 * block; len -= 3 * block, p += 3 * block)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     uint32_t crc1 = 0, crc2 = 0;" << std::endl;
+    f << "                     for(size_t i = 0; i < block; i += 8)" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         crc = __crc32cd(crc, Load8(p + i));" << std::endl;
+    f << "                         crc1 = __crc32cd(crc1, Load8(p + block + i));" << std::endl;
+    f << "                         crc2 = __crc32cd(crc2, Load8(p + 2 * block + i));" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     crc = Tables::Shift(zeros, crc) ^ crc1;" << std::endl;
+    f << "                     crc = Tables::Shift(zeros, crc) ^ crc2;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "             }" << std::endl;
+    f << "             for(; len >= 8; len -= 8, p += 8)" << std::endl;
+    f << "                 crc = __crc32cd(crc, Load8(p));" << std::endl;
+    f << "             for(; len > 0; --len, ++p)" << std::endl;
+    f << "                 crc = __crc32cb(crc, *p);" << std::endl;
+    f << "             return crc;" << std::endl;
+    f << "        }" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        static UpdateFunction SelectUpdate()" << std::endl;
+    f << "        {" << std::endl;
+    f << "#ifdef MSGBUF_X86_SIMD" << std::endl;
+    f << "             __builtin_cpu_init();" << std::endl;
+    f << "             if(__builtin_cpu_supports(\"sse4.2\"))" << std::endl;
+    f << "                 return UpdateSSE42;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "             return UpdateTable;" << std::endl;
+    f << "        }" << std::endl;
+    f << "};" << std::endl;
+    f << std::endl;
+}
+
+// Dependency free block compression for big batches and logs (see !compression)
+void WriteCompressor(std::ostream& f, const Options& options)
+{
+    std::string compressor = options.baseclass + "Compressor";
+
+    f << "// Block compression in the LZ4 block format: a sequence is a token (literal count and match" << std::endl;
+    f << "// length, 4 bits each), the literals, and the match as an offset (2 bytes) in the previous 64KB" << std::endl;
+    f << "class " << compressor << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // Worst case size of the compression of len bytes" << std::endl;
+    f << "        static uint32_t GetMaxCompressedSize(uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return len + len / 255 + 16;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Compress len bytes of src into dst, which must hold GetMaxCompressedSize(len) bytes" << std::endl;
+    f << "        // Returns the compressed size" << std::endl;
+    f << "        static uint32_t Compress(const char* src, uint32_t len, char* dst)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             const uint8_t* base = (const uint8_t*)src;" << std::endl;
+    f << "             const uint8_t* end = base + len;" << std::endl;
+    f << "             const uint8_t* anchor = base;" << std::endl;
+    f << "             uint8_t* op = (uint8_t*)dst;" << std::endl;
+    f << "             if(len > kMinMatchStart)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 // No match starts in the last 12 bytes, and the last 5 bytes are literals" << std::endl;
+    f << "                 const uint8_t* matchLimit = end - kMinMatchStart;" << std::endl;
+    f << "                 const uint8_t* matchEnd = end - 5;" << std::endl;
+    f << "                 uint32_t table[1 << kHashBits];" << std::endl;
+    f << "                 memset(table, 0, sizeof(table));" << std::endl;
+    f << "                 const uint8_t* ip = base + 1;" << std::endl;
+    f << "                 while(ip <= matchLimit)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     uint32_t hash = Hash(Read4(ip));" << std::endl;
+    f << "                     const uint8_t* match = base + table[hash];" << std::endl;
+    f << "                     table[hash] = (uint32_t)(ip - base);" << std::endl;
+    f << "                     if((uint32_t)(ip - match) - 1 >= 0xffff || Read4(match) != Read4(ip))" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         // Skip faster and faster through data that doesn't compress" << std::endl;
+    f << "                         ip += 1 + ((ip - anchor) >> 6);" << std::endl;
+    f << "                         continue;" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     while(ip > anchor && match > base && ip[-1] == match[-1])" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         --ip;" << std::endl;
+    f << "                         --match;" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     uint32_t matchLength = 4 + MatchLength(ip + 4, match + 4, matchEnd);" << std::endl;
+    f << "                     op = WriteSequence(op, anchor, (uint32_t)(ip - anchor), (uint32_t)(ip - match), matchLength);" << std::endl;
+    f << "                     ip += matchLength;" << std::endl;
+    f << "                     anchor = ip;" << std::endl;
+    f << "                     if(ip <= matchLimit)" << std::endl;
+    f << "                         table[Hash(Read4(ip - 2))] = (uint32_t)(ip - 2 - base);" << std::endl;
+    f << "                 }" << std::endl;
+    f << "             }" << std::endl;
+    f << "             // Last literals, without match" << std::endl;
+    f << "             uint32_t count = (uint32_t)(end - anchor);" << std::endl;
+    f << "             *op++ = (uint8_t)((count < 15 ? count : 15) << 4);" << std::endl;
+    f << "             op = WriteLength(op, count);" << std::endl;
+    f << "             memcpy(op, anchor, count);" << std::endl;
+    f << "             return (uint32_t)(op + count - (uint8_t*)dst);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Decompress the len bytes of src into the size bytes of dst, returns false if src is" << std::endl;
+    f << "        // invalid or doesn't decompress to exactly size bytes" << std::endl;
+    f << "        static bool Decompress(const char* src, uint32_t len, char* dst, uint32_t size)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             const uint8_t* ip = (const uint8_t*)src;" << std::endl;
+    f << "             const uint8_t* end = ip + len;" << std::endl;
+    f << "             uint8_t* op = (uint8_t*)dst;" << std::endl;
+    f << "             uint8_t* outEnd = op + size;" << std::endl;
+    f << "             while(ip < end)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 uint32_t token = *ip++;" << std::endl;
+    f << "                 size_t count = token >> 4;" << std::endl;
+    f << "                 if(count < 15 && end - ip >= 32 && outEnd - op >= 64)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     // Most literal runs are short, copied at once when there is room (and the" << std::endl;
+    f << "                     // sequence isn't the last one, which ends the input)" << std::endl;
+    f << "                     memcpy(op, ip, 16);" << std::endl;
+    f << "                     ip += count;" << std::endl;
+    f << "                     op += count;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 else" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     if(count == 15 && !ReadLength(&ip, end, &count))" << std::endl;
+    f << "                         return false;" << std::endl;
+    f << "                     if(count > (size_t)(end - ip) || count > (size_t)(outEnd - op))" << std::endl;
+    f << "                         return false;" << std::endl;
+    f << "                     memcpy(op, ip, count);" << std::endl;
+    f << "                     ip += count;" << std::endl;
+    f << "                     op += count;" << std::endl;
+    f << "                     // The last sequence has no match" << std::endl;
+    f << "                     if(ip == end)" << std::endl;
+    f << "                         break;" << std::endl;
+    f << "                     if(end - ip < 2)" << std::endl;
+    f << "                         return false;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 size_t offset = ip[0] | ((size_t)ip[1] << 8);" << std::endl;
+    f << "                 ip += 2;" << std::endl;
+    f << "                 if(offset == 0 || offset > (size_t)(op - (uint8_t*)dst))" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 const uint8_t* match = op - offset;" << std::endl;
+    f << "                 count = token & 15;" << std::endl;
+    f << "                 if(count < 15 && offset >= 16 && outEnd - op >= 32)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     // Short match (18 bytes at most) not overlapping the first 16 bytes it writes" << std::endl;
+    f << "                     memcpy(op, match, 16);" << std::endl;
+    f << "                     memcpy(op + 16, match + 16, 16);" << std::endl;
+    f << "                     op += count + 4;" << std::endl;
+    f << "                     continue;" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 if(count == 15 && !ReadLength(&ip, end, &count))" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 count += 4;" << std::endl;
+    f << "                 if(count > (size_t)(outEnd - op))" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 if((size_t)(outEnd - op) >= count + 8)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     size_t i = 0;" << std::endl;
+    f << "                     if(offset < 8)" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         // Repeat the pattern over 8 bytes, then copy from a multiple of its length" << std::endl;
+    f << "                         for(; i < 8; ++i)" << std::endl;
+    f << "                             op[i] = match[i];" << std::endl;
+    f << "                         match = op - (7 + offset) / offset * offset;" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     // 8 bytes at a time, the source is always written before being read" << std::endl;
+    f << "                     for(; i < count; i += 8)" << std::endl;
+    f << "                         memcpy(op + i, match + i, 8);" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 else" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     for(size_t i = 0; i < count; ++i)" << std::endl;
+    f << "                         op[i] = match[i];" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 op += count;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return op == outEnd;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        static const uint32_t kHashBits = 12;" << std::endl;
+    f << "        static const uint32_t kMinMatchStart = 12;" << std::endl;
+    f << "        static uint32_t Read4(const uint8_t* p)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t v;" << std::endl;
+    f << "             memcpy(&v, p, 4);" << std::endl;
+    f << "             return v;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint32_t Hash(uint32_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return (v * 2654435761U) >> (32 - kHashBits);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Number of equal bytes at p and match, up to limit" << std::endl;
+    f << "        static uint32_t MatchLength(const uint8_t* p, const uint8_t* match, const uint8_t* limit)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             const uint8_t* start = p;" << std::endl;
+    f << "             while(p + 8 <= limit)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 uint64_t a, b;" << std::endl;
+    f << "                 memcpy(&a, p, 8);" << std::endl;
+    f << "                 memcpy(&b, match, 8);" << std::endl;
+    f << "                 if(a != b)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "#if (defined(__GNUC__) || defined(__clang__)) && MSGBUF_HOST_LITTLE_ENDIAN" << std::endl;
+    f << "                     return (uint32_t)(p - start) + (__builtin_ctzll(a ^ b) >> 3);" << std::endl;
+    f << "#else" << std::endl;
+    f << "                     while(*p == *match)" << std::endl;
+    f << "                     {" << std::endl;
+    f << "                         ++p;" << std::endl;
+    f << "                         ++match;" << std::endl;
+    f << "                     }" << std::endl;
+    f << "                     return (uint32_t)(p - start);" << std::endl;
+    f << "#endif" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 p += 8;" << std::endl;
+    f << "                 match += 8;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             while(p < limit && *p == *match)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 ++p;" << std::endl;
+    f << "                 ++match;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return (uint32_t)(p - start);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Rest of a length which didn't fit in its 4 bits: bytes added until one isn't 255" << std::endl;
+    f << "        static uint8_t* WriteLength(uint8_t* op, uint32_t length)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(length < 15)" << std::endl;
+    f << "                 return op;" << std::endl;
+    f << "             for(length -= 15; length >= 255; length -= 255)" << std::endl;
+    f << "                 *op++ = 255;" << std::endl;
+    f << "             *op++ = (uint8_t)length;" << std::endl;
+    f << "             return op;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static bool ReadLength(const uint8_t** p, const uint8_t* end, size_t* length)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t byte;" << std::endl;
+    f << "             do" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(*p >= end)" << std::endl;
+    f << "                     return false;" << std::endl;
+    f << "                 byte = *(*p)++;" << std::endl;
+    f << "                 *length += byte;" << std::endl;
+    f << "             } while(byte == 255);" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint8_t* WriteSequence(uint8_t* op, const uint8_t* literals, uint32_t count, uint32_t offset, uint32_t matchLength)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint8_t* token = op++;" << std::endl;
+    f << "             matchLength -= 4;" << std::endl;
+    f << "             *token = (uint8_t)(((count < 15 ? count : 15) << 4) | (matchLength < 15 ? matchLength : 15));" << std::endl;
+    f << "             op = WriteLength(op, count);" << std::endl;
+    f << "             memcpy(op, literals, count);" << std::endl;
+    f << "             op += count;" << std::endl;
+    f << "             *op++ = (uint8_t)offset;" << std::endl;
+    f << "             *op++ = (uint8_t)(offset >> 8);" << std::endl;
+    f << "             return WriteLength(op, matchLength);" << std::endl;
+    f << "        }" << std::endl;
+    f << "};" << std::endl;
+}
+
+// Pack many messages with a single header, so that they can be sent with a single system call
+void WriteBatch(std::ostream& f, const Options& options)
+{
+    std::string factory = options.baseclass + "Factory";
+    std::string writer = options.baseclass + "BatchWriter";
+    std::string reader = options.baseclass + "BatchReader";
+    std::string compressor = options.baseclass + "Compressor";
+
+    f << "// A batch is made of a header: version (4 bytes), message count (4 bytes) and payload size" << std::endl;
+    f << "// (4 bytes), followed by the messages, each one being its type (encoded like in the message" << std::endl;
+    f << "// header) and its body" << std::endl;
+    if(options.compression)
+    {
+        f << "// The top bit of the count is set when the payload is compressed: it is then the size of the" << std::endl;
+        f << "// messages (4 bytes), followed by their compression (see " << compressor << ")" << std::endl;
+    }
+    if(options.checksum)
+        f << "// The batch ends with the CRC32C of the header and of the payload (see " << options.baseclass << "Crc32c)" << std::endl;
+    f << "class " << writer << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    if(options.compression)
+        f << "        " << writer << "() : m_count(0), m_payloadSize(0), m_compressionThreshold(0)" << std::endl;
+    else
+        f << "        " << writer << "() : m_count(0), m_payloadSize(0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             Clear();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Serialize message at the end of the batch buffer" << std::endl;
+    f << "        void Append(const " << options.baseclass << "& message)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t type = (uint32_t)message.GetType();" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "             uint64_t statsStart = " << options.baseclass << "Stats::InternalStartEncode(type);" << std::endl;
+    f << "#endif" << std::endl;
+    f << "             uint32_t size = message.InternalCalculateNeededSerializationSize() - " << options.baseclass << "::InternalHeaderSize(message.GetType()) + " << options.baseclass << "::InternalU32Size(type);" << std::endl;
+    f << "             size_t offset = m_buffer.size();" << std::endl;
+    f << "             m_buffer.resize(offset + size);" << std::endl;
+    f << "             char* p = &m_buffer[offset];" << std::endl;
+    f << "             message.InternalSerializeBody(" << options.baseclass << "::InternalWriteU32(p, type));" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "             " << options.baseclass << "Stats::InternalEncoded(type, size, statsStart);" << std::endl;
+    f << "#endif" << std::endl;
+    f << "             Segment& last = m_segmentList.back();" << std::endl;
+    f << "             if(last.external || last.offset + last.len != offset)" << std::endl;
+    f << "                 m_segmentList.push_back(Segment(0, (uint32_t)offset, size));" << std::endl;
+    f << "             else" << std::endl;
+    f << "                 last.len += size;" << std::endl;
+    f << "             m_payloadSize += size;" << std::endl;
+    f << "             ++m_count;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Reference a message already serialized with ToBuffer, without copying it" << std::endl;
+    f << "        // buffer must stay valid until the batch has been sent, returns false if it's invalid" << std::endl;
+    f << "        bool AppendSerialized(const char* buffer, uint32_t len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size;" << std::endl;
+    f << "             if(" << factory << "::MeasureFrame(buffer, len, &size) != " << factory << "::NOERROR)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             uint32_t version, type;" << std::endl;
+    f << "             uint32_t headerSize = " << options.baseclass << "::InternalReadHeader(buffer, len, &version, &type);" << std::endl;
+    if(options.framed)
+    {
+        f << "             // Only the body is kept, not the end of the frame following it (if any)" << std::endl;
+        f << "             " << factory << "::MeasureBody(type, buffer + headerSize, size - headerSize, &size);" << std::endl;
+        f << "             size += headerSize;" << std::endl;
+        f << "             // Skip the frame size and the version, the message type is kept" << std::endl;
+    }
+    else
+    {
+        if(options.checksum)
+        {
+            f << "             // The checksum of the message isn't kept, the batch has its own" << std::endl;
+            f << "             size -= " << options.baseclass << "::kChecksumSize;" << std::endl;
+        }
+        f << "             // Skip the version, the message type is kept" << std::endl;
+    }
+    f << "             uint32_t skip = headerSize - " << options.baseclass << "::InternalU32Size(type);" << std::endl;
+    f << "             m_segmentList.push_back(Segment(buffer + skip, 0, size - skip));" << std::endl;
+    f << "             m_payloadSize += size - skip;" << std::endl;
+    f << "             ++m_count;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        uint32_t GetCount() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_count;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.compression)
+    {
+        f << "        // Size of the whole batch, header included, before compression" << std::endl;
+        f << "        uint32_t GetSize() const" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return " << (options.checksum ? "16" : "12") << " + m_payloadSize;" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Batches of at least threshold bytes of messages are compressed by GetIovec() and" << std::endl;
+        f << "        // ToStringBuffer(), when it saves space. 0 (the default) never compresses" << std::endl;
+        f << "        void SetCompressionThreshold(uint32_t threshold)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             m_compressionThreshold = threshold;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    else
+    {
+        f << "        // Size of the whole batch, header included" << std::endl;
+        f << "        uint32_t GetSize() const" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return " << (options.checksum ? "16" : "12") << " + m_payloadSize;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "#ifndef _WIN32" << std::endl;
+    f << "        // Describe the whole batch for writev(), valid until the next call to a non-const method" << std::endl;
+    f << "        // There is a single entry unless AppendSerialized() was used" << std::endl;
+    f << "        const struct iovec* GetIovec(int* count)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             WriteHeader();" << std::endl;
+    if(options.compression)
+    {
+        f << "             if(Compress())" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 m_iovecList.resize(1);" << std::endl;
+        f << "                 m_iovecList[0].iov_base = (void*)m_compressed.data();" << std::endl;
+        f << "                 m_iovecList[0].iov_len = m_compressed.size();" << std::endl;
+        f << "                 *count = 1;" << std::endl;
+        f << "                 return &m_iovecList[0];" << std::endl;
+        f << "             }" << std::endl;
+    }
+    f << "             m_iovecList.resize(m_segmentList.size()" << (options.checksum ? " + 1" : "") << ");" << std::endl;
+    f << "             for(size_t i = 0; i < m_segmentList.size(); ++i)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 const Segment& segment = m_segmentList[i];" << std::endl;
+    f << "                 m_iovecList[i].iov_base = (void*)(segment.external ? segment.external : &m_buffer[segment.offset]);" << std::endl;
+    f << "                 m_iovecList[i].iov_len = segment.len;" << std::endl;
+    f << "             }" << std::endl;
+    if(options.checksum)
+    {
+        f << "             WriteChecksum();" << std::endl;
+        f << "             m_iovecList.back().iov_base = m_checksum;" << std::endl;
+        f << "             m_iovecList.back().iov_len = " << options.baseclass << "::kChecksumSize;" << std::endl;
+    }
+    f << "             *count = (int)m_iovecList.size();" << std::endl;
+    f << "             return &m_iovecList[0];" << std::endl;
+    f << "        }" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        // Copy the whole batch into a single buffer" << std::endl;
+    f << "        std::string ToStringBuffer()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             WriteHeader();" << std::endl;
+    if(options.compression)
+    {
+        f << "             if(Compress())" << std::endl;
+        f << "                 return m_compressed;" << std::endl;
+    }
+    if(options.checksum)
+    {
+        f << "             WriteChecksum();" << std::endl;
+        f << "             std::string result = Gather();" << std::endl;
+        f << "             result.append(m_checksum, " << options.baseclass << "::kChecksumSize);" << std::endl;
+        f << "             return result;" << std::endl;
+    }
+    else
+    {
+        f << "             if(m_segmentList.size() == 1)" << std::endl;
+        f << "                 return m_buffer;" << std::endl;
+        f << "             return Gather();" << std::endl;
+    }
+    f << "        }" << std::endl;
+    f << "        // Start a new batch, the buffer capacity is kept" << std::endl;
+    f << "        void Clear()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             m_buffer.resize(12);" << std::endl;
+    f << "             m_segmentList.clear();" << std::endl;
+    f << "             m_segmentList.push_back(Segment(0, 0, 12));" << std::endl;
+    f << "             m_count = 0;" << std::endl;
+    f << "             m_payloadSize = 0;" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        struct Segment" << std::endl;
+    f << "        {" << std::endl;
+    f << "            const char* external; // 0 when stored in m_buffer at offset" << std::endl;
+    f << "            uint32_t offset;" << std::endl;
+    f << "            uint32_t len;" << std::endl;
+    f << "            Segment(const char* e, uint32_t o, uint32_t l) : external(e), offset(o), len(l) {}" << std::endl;
+    f << "        };" << std::endl;
+    f << "        void WriteHeader()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             " << options.baseclass << "::Store4(&m_buffer[0], " << options.baseclass << "::GetVersion());" << std::endl;
+    f << "             " << options.baseclass << "::Store4(&m_buffer[4], m_count);" << std::endl;
+    f << "             " << options.baseclass << "::Store4(&m_buffer[8], m_payloadSize);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Copy the segments into a single buffer" << std::endl;
+    f << "        std::string Gather() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             std::string result;" << std::endl;
+    f << "             result.reserve(GetSize());" << std::endl;
+    f << "             for(size_t i = 0; i < m_segmentList.size(); ++i)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 const Segment& segment = m_segmentList[i];" << std::endl;
+    f << "                 result.append(segment.external ? segment.external : &m_buffer[segment.offset], segment.len);" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.checksum)
+    {
+        f << "        // CRC32C of the segments into m_checksum" << std::endl;
+        f << "        void WriteChecksum()" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t crc = 0;" << std::endl;
+        f << "             for(size_t i = 0; i < m_segmentList.size(); ++i)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 const Segment& segment = m_segmentList[i];" << std::endl;
+        f << "                 crc = " << options.baseclass << "Crc32c::Compute(segment.external ? segment.external : &m_buffer[segment.offset], segment.len, crc);" << std::endl;
+        f << "             }" << std::endl;
+        f << "             " << options.baseclass << "::Store4(m_checksum, crc);" << std::endl;
+        f << "        }" << std::endl;
+    }
+    if(options.compression)
+    {
+        f << "        // Compress the batch into m_compressed, returns false if it's too small or doesn't compress" << std::endl;
+        f << "        bool Compress()" << std::endl;
+        f << "        {" << std::endl;
+        f << "             if(!m_compressionThreshold || m_payloadSize < m_compressionThreshold || m_count >= 0x80000000 || m_payloadSize > 0x7fffffff)" << std::endl;
+        f << "                 return false;" << std::endl;
+        f << "             std::string gathered;" << std::endl;
+        f << "             if(m_segmentList.size() > 1)" << std::endl;
+        f << "                 gathered = Gather();" << std::endl;
+        f << "             const char* payload = (m_segmentList.size() > 1 ? gathered.data() : m_buffer.data()) + 12;" << std::endl;
+        f << "             m_compressed.resize(16 + " << compressor << "::GetMaxCompressedSize(m_payloadSize));" << std::endl;
+        f << "             uint32_t size = " << compressor << "::Compress(payload, m_payloadSize, &m_compressed[16]);" << std::endl;
+        f << "             if(4 + size >= m_payloadSize)" << std::endl;
+        f << "                 return false;" << std::endl;
+        f << "             " << options.baseclass << "::Store4(&m_compressed[0], " << options.baseclass << "::GetVersion());" << std::endl;
+        f << "             " << options.baseclass << "::Store4(&m_compressed[4], m_count | 0x80000000);" << std::endl;
+        f << "             " << options.baseclass << "::Store4(&m_compressed[8], 4 + size);" << std::endl;
+        f << "             " << options.baseclass << "::Store4(&m_compressed[12], m_payloadSize);" << std::endl;
+        f << "             m_compressed.resize(16 + size" << (options.checksum ? " + " + options.baseclass + "::kChecksumSize" : "") << ");" << std::endl;
+        if(options.checksum)
+            f << "             " << options.baseclass << "::InternalStoreChecksum(&m_compressed[0], (uint32_t)m_compressed.size());" << std::endl;
+        f << "             return true;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "        std::string m_buffer;" << std::endl;
+    f << "        std::vector<Segment> m_segmentList;" << std::endl;
+    f << "#ifndef _WIN32" << std::endl;
+    f << "        std::vector<struct iovec> m_iovecList;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        uint32_t m_count;" << std::endl;
+    f << "        uint32_t m_payloadSize;" << std::endl;
+    if(options.compression)
+    {
+        f << "        uint32_t m_compressionThreshold;" << std::endl;
+        f << "        std::string m_compressed;" << std::endl;
+    }
+    if(options.checksum)
+        f << "        char m_checksum[" << options.baseclass << "::kChecksumSize];" << std::endl;
+    f << "};" << std::endl;
+
+    f << "// Iterate over the messages of a batch written by " << writer << ", without copying them" << std::endl;
+    f << "class " << reader << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // buffer must stay alive as long as the reader (and the bodies it returns) are used" << std::endl;
+    f << "        " << reader << "(const char* buffer, uint32_t len) : m_buffer(buffer), m_size(12), m_end(12), m_position(12), m_count(0), m_index(0), m_error(" << factory << "::NOERROR)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(len < 12)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 m_error = " << factory << "::NEED_MORE_DATA;" << std::endl;
+    f << "                 return;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             if(" << options.baseclass << "::Load4(buffer) != " << options.baseclass << "::GetVersion())" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 m_error = " << factory << "::BAD_VERSION;" << std::endl;
+    f << "                 return;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             m_count = " << options.baseclass << "::Load4(buffer + 4);" << std::endl;
+    f << "             uint32_t payloadSize = " << options.baseclass << "::Load4(buffer + 8);" << std::endl;
+    if(options.checksum)
+    {
+        f << "             m_size = (payloadSize > 0xffffffff - 16) ? 0xffffffff : 16 + payloadSize;" << std::endl;
+        f << "             m_end = m_size - " << options.baseclass << "::kChecksumSize;" << std::endl;
+        f << "             if(len < m_size)" << std::endl;
+        f << "                 m_error = " << factory << "::NEED_MORE_DATA;" << std::endl;
+        f << "             else if(!" << options.baseclass << "::InternalCheckChecksum(buffer, m_size))" << std::endl;
+        f << "                 m_error = " << factory << "::BAD_CHECKSUM;" << std::endl;
+    }
+    else
+    {
+        f << "             m_size = (payloadSize > 0xffffffff - 12) ? 0xffffffff : 12 + payloadSize;" << std::endl;
+        f << "             m_end = m_size;" << std::endl;
+        f << "             if(len < m_size)" << std::endl;
+        f << "                 m_error = " << factory << "::NEED_MORE_DATA;" << std::endl;
+    }
+    if(options.compression)
+    {
+        f << "             else if(m_count & 0x80000000)" << std::endl;
+        f << "                 Decompress();" << std::endl;
+    }
+    f << "        }" << std::endl;
+    f << "        // NEED_MORE_DATA means the buffer doesn't hold the whole batch, GetSize() tells the size needed" << std::endl;
+    f << "        " << factory << "::ERROR GetError() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_error;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        uint32_t GetCount() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_count;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Size of the whole batch, header included" << std::endl;
+    f << "        uint32_t GetSize() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return m_size;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Get the next message without decoding it, body points into the batch buffer" << std::endl;
+    if(options.compression)
+        f << "        // (into the reader when the batch is compressed)" << std::endl;
+    f << "        // returns false at the end of the batch, or on error (see GetError())" << std::endl;
+    f << "        bool Next(" << options.baseclass << "::MESSAGE_TYPE* type, const char** body, uint32_t* bodySize)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t len;" << std::endl;
+    f << "             if(!Prepare(type, body, &len))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             " << factory << "::ERROR error = " << factory << "::MeasureBody(*type, *body, len, bodySize);" << std::endl;
+    f << "             return Advance(error, *body + *bodySize);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Decode the next message and pass it to handler.On(), see " << factory << "::Dispatch" << std::endl;
+    f << "        // returns false at the end of the batch, or on error (see GetError())" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        bool DispatchNext(Handler& handler)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             " << options.baseclass << "::MESSAGE_TYPE type;" << std::endl;
+    f << "             const char* body;" << std::endl;
+    f << "             uint32_t len, bodySize;" << std::endl;
+    f << "             const char* start = m_buffer + m_position;" << std::endl;
+    f << "             if(!Prepare(&type, &body, &len))" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             " << factory << "::ERROR error = " << factory << "::DispatchBody(type, body, len, handler, &bodySize, (uint32_t)(body - start));" << std::endl;
+    f << "             return Advance(error, body + bodySize);" << std::endl;
+    f << "        }" << std::endl;
+    f << "    private:" << std::endl;
+    f << "        // len receives the number of bytes available for the body" << std::endl;
+    f << "        bool Prepare(" << options.baseclass << "::MESSAGE_TYPE* type, const char** body, uint32_t* len)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(m_error != " << factory << "::NOERROR || m_index >= m_count)" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             uint32_t value;" << std::endl;
+    f << "             uint32_t typeSize = " << options.baseclass << "::InternalReadU32(m_buffer + m_position, m_end - m_position, &value);" << std::endl;
+    f << "             if(!typeSize)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 m_error = " << factory << "::BAD_SIZE;" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             // Without the body size, the messages following an unknown type can't be found" << std::endl;
+    f << "             if(value >= " << options.baseclass << "::kMessageTypeCount)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 m_error = " << factory << "::INVALID_TYPE;" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             *type = (" << options.baseclass << "::MESSAGE_TYPE)value;" << std::endl;
+    f << "             *body = m_buffer + m_position + typeSize;" << std::endl;
+    f << "             *len = m_end - m_position - typeSize;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        bool Advance(" << factory << "::ERROR error, const char* end)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(error != " << factory << "::NOERROR)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 // The batch is complete, a message can't need more data" << std::endl;
+    f << "                 m_error = (error == " << factory << "::NEED_MORE_DATA ? " << factory << "::BAD_SIZE : error);" << std::endl;
+    f << "                 return false;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             m_position = (uint32_t)(end - m_buffer);" << std::endl;
+    f << "             ++m_index;" << std::endl;
+    f << "             return true;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.compression)
+    {
+        f << "        // The messages are then read from m_decompressed, which the reader can't share" << std::endl;
+        f << "        " << reader << "(const " << reader << "&);" << std::endl;
+        f << "        " << reader << "& operator=(const " << reader << "&);" << std::endl;
+        f << "        void Decompress()" << std::endl;
+        f << "        {" << std::endl;
+        f << "             m_count &= 0x7fffffff;" << std::endl;
+        f << "             uint32_t compressedSize = m_end - 12;" << std::endl;
+        f << "             uint32_t payloadSize = (compressedSize >= 4 ? " << options.baseclass << "::Load4(m_buffer + 12) : 0);" << std::endl;
+        f << "             // A sequence of 2 bytes expands to 255 bytes at most, which bounds the allocation" << std::endl;
+        f << "             if(compressedSize < 4 || payloadSize == 0 || payloadSize > 0xffffffff - 12 || payloadSize / 255 > compressedSize)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 m_error = " << factory << "::BAD_SIZE;" << std::endl;
+        f << "                 return;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             m_decompressed.resize(12 + payloadSize);" << std::endl;
+        f << "             memcpy(&m_decompressed[0], m_buffer, 12);" << std::endl;
+        f << "             if(!" << compressor << "::Decompress(m_buffer + 16, compressedSize - 4, &m_decompressed[12], payloadSize))" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 m_error = " << factory << "::BAD_SIZE;" << std::endl;
+        f << "                 return;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             m_buffer = m_decompressed.data();" << std::endl;
+        f << "             m_end = 12 + payloadSize;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "        const char* m_buffer;" << std::endl;
+    f << "        // Size of the batch, and end of the messages in m_buffer" << std::endl;
+    f << "        uint32_t m_size;" << std::endl;
+    f << "        uint32_t m_end;" << std::endl;
+    f << "        uint32_t m_position;" << std::endl;
+    f << "        uint32_t m_count;" << std::endl;
+    f << "        uint32_t m_index;" << std::endl;
+    f << "        " << factory << "::ERROR m_error;" << std::endl;
+    if(options.compression)
+        f << "        std::string m_decompressed;" << std::endl;
+    f << "};" << std::endl;
+}
+
+// Includes and configuration macros at the top of every generated header
+void WriteIncludes(std::ostream& f, const Options& options)
+{
+    f << "#include <string>" << std::endl;
+    f << "#include <cstring>" << std::endl;
+    f << "#include <vector>" << std::endl;
+    f << "#include <stdint.h>" << std::endl;
+    f << "#ifndef _WIN32" << std::endl;
+    f << "#include <sys/uio.h>" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#ifdef _MSC_VER" << std::endl;
+    f << "#include <stdlib.h>" << std::endl;
+    f << "#endif" << std::endl;
+    f << "// Parallel batch encoding and decoding need C++11 threads, they're only compiled in with" << std::endl;
+    f << "// MSGBUF_ENABLE_THREADS so that the other sources including this header don't pay for them" << std::endl;
+    f << "#if (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)) && defined(MSGBUF_ENABLE_THREADS)" << std::endl;
+    f << "#include <atomic>" << std::endl;
+    f << "#include <condition_variable>" << std::endl;
+    f << "#include <functional>" << std::endl;
+    f << "#include <mutex>" << std::endl;
+    f << "#include <thread>" << std::endl;
+    f << "#ifndef MSGBUF_THREADS" << std::endl;
+    f << "#define MSGBUF_THREADS" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#endif" << std::endl;
+    if(options.shmRing || options.log)
+    {
+        // Shared memory and files
+        f << "#ifndef _WIN32" << std::endl;
+        f << "#include <cerrno>" << std::endl;
+        f << "#include <new>" << std::endl;
+        f << "#include <fcntl.h>" << std::endl;
+        f << "#include <sys/mman.h>" << std::endl;
+        f << "#include <sys/stat.h>" << std::endl;
+        f << "#include <unistd.h>" << std::endl;
+        f << "#endif" << std::endl;
+    }
+    if(options.shmRing)
+    {
+        // The ring only needs C++11 atomics
+        f << "#if (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)) && !defined(_WIN32)" << std::endl;
+        f << "#include <atomic>" << std::endl;
+        f << "#ifndef MSGBUF_SHM_RING" << std::endl;
+        f << "#define MSGBUF_SHM_RING" << std::endl;
+        f << "#endif" << std::endl;
+        f << "#endif" << std::endl;
+    }
+    if(options.connection)
+    {
+        // Sockets, epoll on Linux, and co_await support (C++20)
+        f << "#ifndef _WIN32" << std::endl;
+        f << "#include <cerrno>" << std::endl;
+        f << "#include <fcntl.h>" << std::endl;
+        f << "#include <netinet/in.h>" << std::endl;
+        f << "#include <netinet/tcp.h>" << std::endl;
+        f << "#include <sys/socket.h>" << std::endl;
+        f << "#include <unistd.h>" << std::endl;
+        f << "#ifdef __linux__" << std::endl;
+        f << "#include <sys/epoll.h>" << std::endl;
+        f << "#endif" << std::endl;
+        f << "#endif" << std::endl;
+        f << "// co_await NextMessage() on the connections needs C++20 coroutines, MSGBUF_NO_COROUTINES disables it" << std::endl;
+        f << "#if defined(__cpp_impl_coroutine) && defined(__has_include) && !defined(MSGBUF_NO_COROUTINES)" << std::endl;
+        f << "#if __has_include(<coroutine>)" << std::endl;
+        f << "#include <coroutine>" << std::endl;
+        f << "#include <exception>" << std::endl;
+        f << "#ifndef MSGBUF_COROUTINES" << std::endl;
+        f << "#define MSGBUF_COROUTINES" << std::endl;
+        f << "#endif" << std::endl;
+        f << "#endif" << std::endl;
+        f << "#endif" << std::endl;
+    }
+    f << "// Per message type counters (see " << options.baseclass << "Stats), off by default" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "#ifndef MSGBUF_THREAD_LOCAL" << std::endl;
+    f << "#if __cplusplus >= 201103L" << std::endl;
+    f << "#define MSGBUF_THREAD_LOCAL thread_local" << std::endl;
+    f << "#elif defined(_MSC_VER)" << std::endl;
+    f << "#define MSGBUF_THREAD_LOCAL __declspec(thread)" << std::endl;
+    f << "#else" << std::endl;
+    f << "#define MSGBUF_THREAD_LOCAL __thread" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#if defined(MSGBUF_STATS_CYCLES) && defined(_MSC_VER)" << std::endl;
+    f << "#include <intrin.h>" << std::endl;
+    f << "#elif defined(MSGBUF_STATS_CYCLES) && (defined(__x86_64__) || defined(__i386__))" << std::endl;
+    f << "#include <x86intrin.h>" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#endif" << std::endl;
+    f << "// Host byte order, detected at compile time (define it to 1 or 0 if the detection fails)" << std::endl;
+    f << "#ifndef MSGBUF_HOST_LITTLE_ENDIAN" << std::endl;
+    f << "#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)" << std::endl;
+    f << "#define MSGBUF_HOST_LITTLE_ENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)" << std::endl;
+    f << "#elif defined(_WIN32) || defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)" << std::endl;
+    f << "#define MSGBUF_HOST_LITTLE_ENDIAN 1" << std::endl;
+    f << "#else" << std::endl;
+    f << "#error Unknown host byte order, define MSGBUF_HOST_LITTLE_ENDIAN" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#endif" << std::endl;
+    f << "// Vectorized byte swapping of arrays, MSGBUF_NO_SIMD disables it" << std::endl;
+    f << "#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(MSGBUF_NO_SIMD)" << std::endl;
+    f << "#include <immintrin.h>" << std::endl;
+    f << "#ifndef MSGBUF_X86_SIMD" << std::endl;
+    f << "#define MSGBUF_X86_SIMD" << std::endl;
+    f << "#endif" << std::endl;
+    f << "#endif" << std::endl;
+    if(options.checksum)
+    {
+        f << "// Hardware CRC32C when the compiler targets ARMv8 with its CRC extension (e.g. -march=armv8-a+crc)" << std::endl;
+        f << "#if defined(__ARM_FEATURE_CRC32) && !defined(MSGBUF_NO_SIMD)" << std::endl;
+        f << "#include <arm_acle.h>" << std::endl;
+        f << "#ifndef MSGBUF_ARM_CRC32" << std::endl;
+        f << "#define MSGBUF_ARM_CRC32" << std::endl;
+        f << "#endif" << std::endl;
+        f << "#endif" << std::endl;
+    }
+}
+
+// Enums, statistics and the base class, everything the messages need
+void WriteBase(std::ostream& f, const MessageList& messageList, const EnumList& enumList, const Options& options)
+{
+    for(size_t i = 0; i < enumList.size(); ++i)
+    {
+        const Enum& e = enumList[i];
+        f << std::endl;
+        f << "enum " << e.name << " {";
+        for(size_t j = 0; j < e.nameList.size(); ++j)
+            f << (j ? ", " : "") << e.nameList[j] << " = " << e.valueList[j];
+        f << "};" << std::endl;
+    }
+
+    f << std::endl;
+    f << "class " << options.baseclass << "Factory;" << std::endl;
+    f << std::endl;
+    WriteStats(f, messageList, options);
+    if(options.checksum)
+        WriteCrc32c(f, options);
+
+    f << "class " << options.baseclass << std::endl;
+    f << "{" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        enum MESSAGE_TYPE {";
+    for(size_t i = 0; i < messageList.size(); ++i)
+    {
+        const Message& msg = messageList[i];
+        f << "MT_" << msg.name;
+        if(i != messageList.size() - 1)
+            f << ", ";
+    }
+    f << "};" << std::endl;
+    f << "        // Types read from the wire are checked against it before being cast to MESSAGE_TYPE" << std::endl;
+    f << "        static const uint32_t kMessageTypeCount = " << messageList.size() << ";" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // Reference to a string stored in a serialized buffer (not null terminated)" << std::endl;
+    f << "        struct StringRef" << std::endl;
+    f << "        {" << std::endl;
+    f << "            const char* data;" << std::endl;
+    f << "            uint32_t length;" << std::endl;
+    f << "            StringRef() : data(0), length(0) {}" << std::endl;
+    f << "            StringRef(const char* d, uint32_t l) : data(d), length(l) {}" << std::endl;
+    f << "            std::string ToString() const { return std::string(data, length); }" << std::endl;
+    f << "        };" << std::endl;
+    f << "        // Reference to the elements of a vec stored in a serialized buffer, in wire byte order" << std::endl;
+    f << "        // and not necessarily aligned: data can be used directly when no swap is needed" << std::endl;
+    f << "        template <typename T>" << std::endl;
+    f << "        struct ArrayRef" << std::endl;
+    f << "        {" << std::endl;
+    f << "            const char* data;" << std::endl;
+    f << "            uint32_t count;" << std::endl;
+    f << "            ArrayRef() : data(0), count(0) {}" << std::endl;
+    f << "            ArrayRef(const char* d, uint32_t c) : data(d), count(c) {}" << std::endl;
+    f << "            T operator[](uint32_t i) const" << std::endl;
+    f << "            {" << std::endl;
+    f << "                T value;" << std::endl;
+    f << "                InternalLoadElement(data + i * sizeof(T), &value);" << std::endl;
+    f << "                return value;" << std::endl;
+    f << "            }" << std::endl;
+    f << "            // Copy (and byte swap) the count elements to dst" << std::endl;
+    f << "            void CopyTo(T* dst) const { InternalCopyBlock((char*)dst, data, count, sizeof(T)); }" << std::endl;
+    f << "            std::vector<T> ToVector() const" << std::endl;
+    f << "            {" << std::endl;
+    f << "                std::vector<T> result(count);" << std::endl;
+    f << "                if(count)" << std::endl;
+    f << "                    CopyTo(&result[0]);" << std::endl;
+    f << "                return result;" << std::endl;
+    f << "            }" << std::endl;
+    f << "        };" << std::endl;
+    f << "    public:" << std::endl;
+    f << "        // The messages returned by " << options.baseclass << "Factory::CreateFromBuffer are deleted through this class" << std::endl;
+    f << "        virtual ~" << options.baseclass << "() {}" << std::endl;
+    f << "        virtual MESSAGE_TYPE GetType() const = 0;" << std::endl;
+    f << "        // Output to a user-allocated buffer, make sure there is enough" << std::endl;
+    f << "        // len must be greater or equal to the value returned by CalculateNeededSerializationSize)" << std::endl;
+    f << "        // returns the length stored in buffer" << std::endl;
+    f << "        uint32_t ToBuffer(char* buffer, uint32_t len) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalSerializeToBuffer(buffer, len);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        std::string ToStringBuffer() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalSerializeToStringBuffer();" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Serialize at the end of buffer, which is grown only once (its capacity is reused)" << std::endl;
+    f << "        // returns the length appended" << std::endl;
+    f << "        uint32_t AppendTo(std::string& buffer) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size = CalculateNeededSerializationSize();" << std::endl;
+    f << "             size_t offset = buffer.size();" << std::endl;
+    f << "             buffer.resize(offset + size);" << std::endl;
+    f << "             return SerializeTo(&buffer[offset], size);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        uint32_t AppendTo(std::vector<char>& buffer) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size = CalculateNeededSerializationSize();" << std::endl;
+    f << "             size_t offset = buffer.size();" << std::endl;
+    f << "             buffer.resize(offset + size);" << std::endl;
+    f << "             return SerializeTo(&buffer[offset], size);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Same as ToBuffer, when the size is already known: len MUST be the value returned by" << std::endl;
+    f << "        // CalculateNeededSerializationSize for the current content, it isn't computed again" << std::endl;
+    f << "        uint32_t SerializeTo(char* buffer, uint32_t len) const" << std::endl;
+    f << "        {" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "             uint64_t start = " << options.baseclass << "Stats::InternalStartEncode(GetType());" << std::endl;
+    f << "#endif" << std::endl;
+    f << "             InternalSerializeBody(InternalWriteHeader(buffer, GetType(), len));" << std::endl;
+    if(options.checksum)
+        f << "             InternalStoreChecksum(buffer, len);" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "             " << options.baseclass << "Stats::InternalEncoded(GetType(), len, start);" << std::endl;
+    f << "#endif" << std::endl;
+    f << "             return len;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint32_t GetVersion()" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return " << options.version << ";" << std::endl;
+    f << "        }" << std::endl;
+    if(options.checksum)
+    {
+        f << "        // Size of the CRC32C (see " << options.baseclass << "Crc32c) ending every message, it's included in" << std::endl;
+        f << "        // CalculateNeededSerializationSize() and in the frame size" << std::endl;
+        f << "        static const uint32_t kChecksumSize = 4;" << std::endl;
+    }
+    f << "        uint32_t CalculateNeededSerializationSize() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return InternalCalculateNeededSerializationSize()" << (options.checksum ? " + kChecksumSize" : "") << ";" << std::endl;
+    f << "        }" << std::endl;
+    f << "    protected:" << std::endl;
+    f << "        virtual uint32_t InternalSerializeToBuffer(char* p, uint32_t len) const = 0;" << std::endl;
+    f << "        // Body (de)serialization, returns the end of the body" << std::endl;
+    f << "        virtual char* InternalSerializeBody(char* p) const = 0;" << std::endl;
+    f << "        virtual std::string InternalSerializeToStringBuffer() const = 0;" << std::endl;
+    f << "        virtual const char* InternalCreateFromBuffer(const char* p) = 0;" << std::endl;
+    f << "        virtual uint32_t InternalCalculateNeededSerializationSize() const = 0;" << std::endl;
+    f << "    protected:" << std::endl;
+    f << "        // Wire byte order: " << options.byteorder << std::endl;
+    f << "        static bool ShouldSwap()" << std::endl;
+    f << "        {" << std::endl;
+    if(options.byteorder == "big")
+        f << "             return MSGBUF_HOST_LITTLE_ENDIAN != 0;" << std::endl;
+    else if(options.byteorder == "little")
+        f << "             return MSGBUF_HOST_LITTLE_ENDIAN == 0;" << std::endl;
+    else
+        f << "             return false;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint16_t ByteSwap2(uint16_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "#if defined(__GNUC__) || defined(__clang__)" << std::endl;
+    f << "             return __builtin_bswap16(v);" << std::endl;
+    f << "#elif defined(_MSC_VER)" << std::endl;
+    f << "             return _byteswap_ushort(v);" << std::endl;
+    f << "#else" << std::endl;
+    f << "             return (uint16_t)((v >> 8) | (v << 8));" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint32_t ByteSwap4(uint32_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "#if defined(__GNUC__) || defined(__clang__)" << std::endl;
+    f << "             return __builtin_bswap32(v);" << std::endl;
+    f << "#elif defined(_MSC_VER)" << std::endl;
+    f << "             return _byteswap_ulong(v);" << std::endl;
+    f << "#else" << std::endl;
+    f << "             return ((uint32_t)ByteSwap2((uint16_t)v) << 16) | ByteSwap2((uint16_t)(v >> 16));" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint64_t ByteSwap8(uint64_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "#if defined(__GNUC__) || defined(__clang__)" << std::endl;
+    f << "             return __builtin_bswap64(v);" << std::endl;
+    f << "#elif defined(_MSC_VER)" << std::endl;
+    f << "             return _byteswap_uint64(v);" << std::endl;
+    f << "#else" << std::endl;
+    f << "             return ((uint64_t)ByteSwap4((uint32_t)v) << 32) | ByteSwap4((uint32_t)(v >> 32));" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint16_t SwapByte2(uint16_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return ShouldSwap() ? ByteSwap2(v) : v;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint32_t SwapByte4(uint32_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return ShouldSwap() ? ByteSwap4(v) : v;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint64_t SwapByte8(uint64_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return ShouldSwap() ? ByteSwap8(v) : v;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Read (Load) or write (Store) a value in wire byte order, p doesn't need to be aligned" << std::endl;
+    f << "        static uint16_t Load2(const char* p)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint16_t v;" << std::endl;
+    f << "             memcpy(&v, p, 2);" << std::endl;
+    f << "             return SwapByte2(v);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint32_t Load4(const char* p)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t v;" << std::endl;
+    f << "             memcpy(&v, p, 4);" << std::endl;
+    f << "             return SwapByte4(v);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static uint64_t Load8(const char* p)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t v;" << std::endl;
+    f << "             memcpy(&v, p, 8);" << std::endl;
+    f << "             return SwapByte8(v);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static float Load4f(const char* p)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t v = Load4(p);" << std::endl;
+    f << "             float result;" << std::endl;
+    f << "             memcpy(&result, &v, 4);" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static double Load8f(const char* p)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t v = Load8(p);" << std::endl;
+    f << "             double result;" << std::endl;
+    f << "             memcpy(&result, &v, 8);" << std::endl;
+    f << "             return result;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void Store2(char* p, uint16_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             v = SwapByte2(v);" << std::endl;
+    f << "             memcpy(p, &v, 2);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void Store4(char* p, uint32_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             v = SwapByte4(v);" << std::endl;
+    f << "             memcpy(p, &v, 4);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void Store8(char* p, uint64_t v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             v = SwapByte8(v);" << std::endl;
+    f << "             memcpy(p, &v, 8);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void Store4f(char* p, float v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t bits;" << std::endl;
+    f << "             memcpy(&bits, &v, 4);" << std::endl;
+    f << "             Store4(p, bits);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void Store8f(char* p, double v)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t bits;" << std::endl;
+    f << "             memcpy(&bits, &v, 8);" << std::endl;
+    f << "             Store8(p, bits);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        // Words of packed bits are stored least significant byte first, on n bytes (1 to 8)" << std::endl;
+    f << "        static uint64_t InternalLoadBits(const char* p, uint32_t n)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint64_t bits = 0;" << std::endl;
+    f << "             for(uint32_t i = 0; i < n; ++i)" << std::endl;
+    f << "                 bits |= (uint64_t)(uint8_t)p[i] << (8 * i);" << std::endl;
+    f << "             return bits;" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static void InternalStoreBits(char* p, uint64_t bits, uint32_t n)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(uint32_t i = 0; i < n; ++i)" << std::endl;
+    f << "                 p[i] = (char)(bits >> (8 * i));" << std::endl;
+    f << "        }" << std::endl;
+    // One overload per vec element type, used by ArrayRef
+    for(size_t i = 0; i < sizeof(typeList) / sizeof(Type); ++i)
+    {
+        std::string type = typeList[i].type;
+        if(type == "str")
+            continue;
+        std::string nativeType = typeList[i].nativeType;
+        f << "        static void InternalLoadElement(const char* p, " << nativeType << "* value)" << std::endl;
+        if(GetTypeSize(type) == 1)
+            f << "        { *value = (" << nativeType << ")*p; }" << std::endl;
+        else
+            f << "        { *value = (" << nativeType << ")Load" << GetSwapByteSuffix(type) << "(p); }" << std::endl;
+    }
+    f << "        // Copy count elements of width bytes (1, 2, 4 or 8) between host and wire byte order" << std::endl;
+    f << "        // dst and src don't need to be aligned, but must not overlap" << std::endl;
+    f << "        static void InternalCopyBlock(char* dst, const char* src, uint32_t count, uint32_t width)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             if(!ShouldSwap() || width == 1)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 memcpy(dst, src, count * width);" << std::endl;
+    f << "                 return;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             // The best implementation for the CPU is selected on first use" << std::endl;
+    f << "             static const SwapBlockFunction swapBlock = SelectSwapBlock();" << std::endl;
+    f << "             swapBlock(dst, src, count, width);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        typedef void (*SwapBlockFunction)(char* dst, const char* src, uint32_t count, uint32_t width);" << std::endl;
+    f << "        static void SwapBlockScalar(char* dst, const char* src, uint32_t count, uint32_t width)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(uint32_t i = 0; i < count; ++i, dst += width, src += width)" << std::endl;
+    f << "             {" << std::endl;
+    f << "                 if(width == 2)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     uint16_t v;" << std::endl;
+    f << "                     memcpy(&v, src, 2);" << std::endl;
+    f << "                     v = ByteSwap2(v);" << std::endl;
+    f << "                     memcpy(dst, &v, 2);" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 else if(width == 4)" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     uint32_t v;" << std::endl;
+    f << "                     memcpy(&v, src, 4);" << std::endl;
+    f << "                     v = ByteSwap4(v);" << std::endl;
+    f << "                     memcpy(dst, &v, 4);" << std::endl;
+    f << "                 }" << std::endl;
+    f << "                 else" << std::endl;
+    f << "                 {" << std::endl;
+    f << "                     uint64_t v;" << std::endl;
+    f << "                     memcpy(&v, src, 8);" << std::endl;
+    f << "                     v = ByteSwap8(v);" << std::endl;
+    f << "                     memcpy(dst, &v, 8);" << std::endl;
+    f << "                 }" << std::endl;
+    f << "             }" << std::endl;
+    f << "        }" << std::endl;
+    f << "#ifdef MSGBUF_X86_SIMD" << std::endl;
+    f << "        // Shuffle mask reversing the bytes of every element in each 16 bytes lane" << std::endl;
+    f << "        static void SwapBlockMask(char* mask, int size, uint32_t width)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             for(int i = 0; i < size; ++i)" << std::endl;
+    f << "                 mask[i] = (char)((i % 16) / width * width + width - 1 - (i % 16) % width);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static __attribute__((target(\"ssse3\"))) void SwapBlockSSSE3(char* dst, const char* src, uint32_t count, uint32_t width)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             char m[16];" << std::endl;
+    f << "             SwapBlockMask(m, 16, width);" << std::endl;
+    f << "             __m128i mask = _mm_loadu_si128((const __m128i*)m);" << std::endl;
+    f << "             uint32_t size = count * width, i = 0;" << std::endl;
+    f << "             for(; i + 16 <= size; i += 16)" << std::endl;
+    f << "                 _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), mask));" << std::endl;
+    f << "             SwapBlockScalar(dst + i, src + i, (size - i) / width, width);" << std::endl;
+    f << "        }" << std::endl;
+    f << "        static __attribute__((target(\"avx2\"))) void SwapBlockAVX2(char* dst, const char* src, uint32_t count, uint32_t width)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             char m[32];" << std::endl;
+    f << "             SwapBlockMask(m, 32, width);" << std::endl;
+    f << "             __m256i mask = _mm256_loadu_si256((const __m256i*)m);" << std::endl;
+    f << "             uint32_t size = count * width, i = 0;" << std::endl;
+    f << "             for(; i + 32 <= size; i += 32)" << std::endl;
+    f << "                 _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i)), mask));" << std::endl;
+    f << "             SwapBlockScalar(dst + i, src + i, (size - i) / width, width);" << std::endl;
+    f << "        }" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        static SwapBlockFunction SelectSwapBlock()" << std::endl;
+    f << "        {" << std::endl;
+    f << "#ifdef MSGBUF_X86_SIMD" << std::endl;
+    f << "             __builtin_cpu_init();" << std::endl;
+    f << "             if(__builtin_cpu_supports(\"avx2\"))" << std::endl;
+    f << "                 return SwapBlockAVX2;" << std::endl;
+    f << "             if(__builtin_cpu_supports(\"ssse3\"))" << std::endl;
+    f << "                 return SwapBlockSSSE3;" << std::endl;
+    f << "#endif" << std::endl;
+    f << "             return SwapBlockScalar;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.compact)
+    {
+        f << "        // LEB128 variable length integers, 7 bits per byte, least significant group first" << std::endl;
+        f << "        static uint32_t VarintSize(uint64_t v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "#if defined(__GNUC__)" << std::endl;
+        f << "             return (uint32_t)(((64 - __builtin_clzll(v | 1)) * 9 + 64) / 64);" << std::endl;
+        f << "#else" << std::endl;
+        f << "             uint32_t size = 1;" << std::endl;
+        f << "             while(v >= 0x80)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 v >>= 7;" << std::endl;
+        f << "                 ++size;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             return size;" << std::endl;
+        f << "#endif" << std::endl;
+        f << "        }" << std::endl;
+        f << "        static char* WriteVarint(char* p, uint64_t v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             while(v >= 0x80)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 *p++ = (char)(v | 0x80);" << std::endl;
+        f << "                 v >>= 7;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             *p++ = (char)v;" << std::endl;
+        f << "             return p;" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // The varint must have been validated with MeasureVarint, returns the end of the varint" << std::endl;
+        f << "        static const char* ReadVarint(const char* p, uint64_t* v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint64_t value = 0;" << std::endl;
+        f << "             for(int shift = 0; shift < 64; shift += 7)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 uint8_t byte = (uint8_t)*p++;" << std::endl;
+        f << "                 value |= (uint64_t)(byte & 0x7f) << shift;" << std::endl;
+        f << "                 if(!(byte & 0x80))" << std::endl;
+        f << "                     break;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             *v = value;" << std::endl;
+        f << "             return p;" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Length of the varint at p, or 0 if it doesn't end within len bytes" << std::endl;
+        f << "        // A varint is never longer than 10 bytes, the 10th byte always ends it" << std::endl;
+        f << "        static uint32_t MeasureVarint(const char* p, uint32_t len)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t max = (len < 10 ? len : 10);" << std::endl;
+        f << "             for(uint32_t i = 0; i < max; ++i)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 if(!(p[i] & 0x80) || i == 9)" << std::endl;
+        f << "                     return i + 1;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             return 0;" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Signed integers are zigzag encoded so that small negative values stay short" << std::endl;
+        f << "        static uint64_t ZigZag(int64_t v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        static int64_t UnZigZag(uint64_t v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return (int64_t)((v >> 1) ^ (0 - (v & 1)));" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Header fields (version and message type) are varints" << std::endl;
+        f << "        static uint32_t InternalU32Size(uint32_t v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return VarintSize(v);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        static char* InternalWriteU32(char* p, uint32_t v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return WriteVarint(p, v);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Returns the number of bytes read, or 0 if len is too small" << std::endl;
+        f << "        static uint32_t InternalReadU32(const char* p, uint32_t len, uint32_t* v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t size = MeasureVarint(p, len);" << std::endl;
+        f << "             if(size)" << std::endl;
+        f << "             {" << std::endl;
+        f << "                 uint64_t value;" << std::endl;
+        f << "                 ReadVarint(p, &value);" << std::endl;
+        f << "                 *v = (uint32_t)value;" << std::endl;
+        f << "             }" << std::endl;
+        f << "             return size;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    else
+    {
+        f << "        // Header fields (version and message type) are 4 bytes" << std::endl;
+        f << "        static uint32_t InternalU32Size(uint32_t)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return 4;" << std::endl;
+        f << "        }" << std::endl;
+        f << "        static char* InternalWriteU32(char* p, uint32_t v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             Store4(p, v);" << std::endl;
+        f << "             return p + 4;" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Returns the number of bytes read, or 0 if len is too small" << std::endl;
+        f << "        static uint32_t InternalReadU32(const char* p, uint32_t len, uint32_t* v)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             if(len < 4)" << std::endl;
+        f << "                 return 0;" << std::endl;
+        f << "             *v = Load4(p);" << std::endl;
+        f << "             return 4;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    if(options.framed)
+    {
+        f << "        // The header starts with the total size of the message (4 bytes), then the version and type" << std::endl;
+        f << "        static uint32_t InternalHeaderSize(MESSAGE_TYPE type)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return 4 + InternalU32Size(GetVersion()) + InternalU32Size((uint32_t)type);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // size is the total size of the message, header included" << std::endl;
+        f << "        static char* InternalWriteHeader(char* p, MESSAGE_TYPE type, uint32_t size)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             Store4(p, size);" << std::endl;
+        f << "             return InternalWriteU32(InternalWriteU32(p + 4, GetVersion()), (uint32_t)type);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Returns the header size, or 0 if len is too small (the frame size isn't checked)" << std::endl;
+        f << "        static uint32_t InternalReadHeader(const char* p, uint32_t len, uint32_t* version, uint32_t* type)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             if(len < 4)" << std::endl;
+        f << "                 return 0;" << std::endl;
+        f << "             uint32_t versionSize = InternalReadU32(p + 4, len - 4, version);" << std::endl;
+        f << "             if(!versionSize)" << std::endl;
+        f << "                 return 0;" << std::endl;
+        f << "             uint32_t typeSize = InternalReadU32(p + 4 + versionSize, len - 4 - versionSize, type);" << std::endl;
+        f << "             return typeSize ? 4 + versionSize + typeSize : 0;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    else
+    {
+        f << "        static uint32_t InternalHeaderSize(MESSAGE_TYPE type)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return InternalU32Size(GetVersion()) + InternalU32Size((uint32_t)type);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // size is the total size of the message, unused without framing" << std::endl;
+        f << "        static char* InternalWriteHeader(char* p, MESSAGE_TYPE type, uint32_t size)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             (void)size;" << std::endl;
+        f << "             return InternalWriteU32(InternalWriteU32(p, GetVersion()), (uint32_t)type);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Returns the header size, or 0 if len is too small" << std::endl;
+        f << "        static uint32_t InternalReadHeader(const char* p, uint32_t len, uint32_t* version, uint32_t* type)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t versionSize = InternalReadU32(p, len, version);" << std::endl;
+        f << "             if(!versionSize)" << std::endl;
+        f << "                 return 0;" << std::endl;
+        f << "             uint32_t typeSize = InternalReadU32(p + versionSize, len - versionSize, type);" << std::endl;
+        f << "             return typeSize ? versionSize + typeSize : 0;" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "        static uint32_t SaturateSize(uint64_t size)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             return (size > 0xffffffff ? 0xffffffff : (uint32_t)size);" << std::endl;
+    f << "        }" << std::endl;
+    if(options.checksum)
+    {
+        f << "        // The last kChecksumSize bytes of the size bytes at p are the CRC32C of the others" << std::endl;
+        f << "        // It's computed right after serializing them, while they are still in the cache" << std::endl;
+        f << "        static void InternalStoreChecksum(char* p, uint32_t size)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             Store4(p + size - kChecksumSize, " << options.baseclass << "Crc32c::Compute(p, size - kChecksumSize));" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // size must be at least kChecksumSize" << std::endl;
+        f << "        static bool InternalCheckChecksum(const char* p, uint32_t size)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return Load4(p + size - kChecksumSize) == " << options.baseclass << "Crc32c::Compute(p, size - kChecksumSize);" << std::endl;
+        f << "        }" << std::endl;
+    }
+    f << "    friend class " << options.baseclass << "Factory;" << std::endl;
+    f << "    friend class " << options.baseclass << "BatchWriter;" << std::endl;
+    f << "    friend class " << options.baseclass << "BatchReader;" << std::endl;
+    if(options.log)
+    {
+        f << "    friend class " << options.baseclass << "LogWriter;" << std::endl;
+        f << "    friend class " << options.baseclass << "LogReader;" << std::endl;
+    }
+    f << "};" << std::endl;
+}
+
+// Message class and its view
+void WriteMessage(std::ostream& f, const Message& msg, const Options& options)
+{
+    f << "class " << msg.name << " : public " << options.baseclass << std::endl;
+    f << "{" << std::endl;
+
+    f << "    public:" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        f << "        " << member.nativeType << " " << member.name;
+        if(member.count != 1)
+            f << "[" << member.count << "]";
+        f << ";" << std::endl;
+    }
+    std::string presence = MangleInternalKeyword("presence");
+    int bitmapSize = GetPresenceBitmapSize(msg);
+    // Numbers, bools and enums (arrays included) are zeroed, a bool or enum left with any bit
+    // pattern can't even be copied. Strings, vecs and nested messages construct themselves
+    std::string defaultInitializer;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(member.type == "str" || member.type == "vec" || member.nested)
+            continue;
+        defaultInitializer += (defaultInitializer != "" ? ", " : " : ") + member.name + "()";
+    }
+    if(bitmapSize > 0)
+    {
+        // Optional members are absent by default
+        f << "        " << msg.name << "()" << defaultInitializer << std::endl;
+        f << "        {" << std::endl;
+        f << "             memset(" << presence << ", 0, " << bitmapSize << ");" << std::endl;
+        f << "        }" << std::endl;
+    }
+    else
+        f << "        " << msg.name << "()" << defaultInitializer << " {}" << std::endl;
+    std::string ctorParams;
+    std::string ctorInitializer;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        // Strings and vecs are taken by value and swapped in, so that temporaries are moved instead of copied
+        if(member.count == 1 && (member.type == "str" || member.type == "vec"))
+            ctorParams += member.nativeType + " n_" + MangleInternalKeyword(member.name);
+        else if(member.count == 1)
+            ctorParams += "const " + member.nativeType + "& n_" + MangleInternalKeyword(member.name);
+        else
+            ctorParams += "const " + member.nativeType + " n_" + MangleInternalKeyword(member.name) + "[" + ToString(member.count) + "]";
+        if(member.count == 1 && member.type != "str" && member.type != "vec")
+        {
+            if(ctorInitializer != "")
+                ctorInitializer += ", ";
+            ctorInitializer +=  member.name + "(n_" + MangleInternalKeyword(member.name) + ")";
+        }
+        if(j != msg.memberList.size() - 1)
+            ctorParams += ", ";
+    }
+    f << "        " << msg.name << "(" << ctorParams << ")" << (ctorInitializer != "" ? " : " : "") << ctorInitializer << std::endl;
+    f << "        {" << std::endl;
+    // Every member is given a value, optional ones are present
+    for(int b = 0; b < bitmapSize; ++b)
+    {
+        int bits = (b == bitmapSize - 1 && msg.optionalCount % 8 ? msg.optionalCount % 8 : 8);
+        f << "             " << presence << "[" << b << "] = " << (1 << bits) - 1 << ";" << std::endl;
+    }
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(member.count == 1 && (member.type == "str" || member.type == "vec"))
+            f << "             " << member.name << ".swap(n_" << MangleInternalKeyword(member.name) << ");" << std::endl;
+        if(member.count > 1)
+        {
+            f << "             for(int " << MangleInternalKeyword("i") << " = 0; " << MangleInternalKeyword("i") << " < " << member.count << "; ++" << MangleInternalKeyword("i") << ")" << std::endl;
+            f << "                 " << member.name << "[" << MangleInternalKeyword("i") << "] = n_" << MangleInternalKeyword(member.name) << "[" << MangleInternalKeyword("i") << "];" << std::endl;
+        }
+    }
+    f << "        }" << std::endl;
+    //---------------------------------------------------------------------
+    f << "        virtual " << options.baseclass << "::MESSAGE_TYPE GetType() const { return " << options.baseclass << "::MT_" << msg.name << "; }" << std::endl;
+    f << "    friend class " << options.baseclass << "Factory;" << std::endl;
+    for(size_t j = 0; j < msg.memberList.size(); ++j)
+    {
+        const DataMember& member = msg.memberList[j];
+        if(!member.optional)
+            continue;
+        std::string byte = presence + "[" + ToString(member.presenceIndex / 8) + "]";
+        int bit = 1 << (member.presenceIndex % 8);
+        f << "        bool has_" << member.name << "() const { return " << PresenceTest(member, presence) << " != 0; }" << std::endl;
+        f << "        void clear_" << member.name << "() { " << byte << " &= (uint8_t)~" << bit << "; }" << std::endl;
+        if(member.count == 1)
+        {
+            f << "        void set_" << member.name << "(const " << member.nativeType << "& value) { " << member.name << " = value; " << byte << " |= " << bit << "; }" << std::endl;
+            f << "        " << member.nativeType << "& mutable_" << member.name << "() { " << byte << " |= " << bit << "; return " << member.name << "; }" << std::endl;
+        }
+        else
+            f << "        " << member.nativeType << "* mutable_" << member.name << "() { " << byte << " |= " << bit << "; return " << member.name << "; }" << std::endl;
+    }
+    if(options.views)
+        f << "    friend class " << msg.name << "View;" << std::endl;
+    if(options.columns)
+        f << "    friend class " << msg.name << "Columns;" << std::endl;
+    // Messages this one is nested in
+    bool nested = !msg.containerList.empty();
+    for(size_t k = 0; k < msg.containerList.size(); ++k)
+        f << "    friend class " << msg.containerList[k] << ";" << std::endl;
+    if(HasFixedSize(msg, options))
+    {
+        f << "        static const uint32_t kWireSize = " << GetStaticStorageSize(msg, options) + (options.checksum ? 4 : 0) << ";" << std::endl;
+        WriteFixedSerialization(f, msg, options);
+    }
+    if(options.delta)
+        WriteDelta(f, msg, options);
+    f << "    protected:" << std::endl;
+
+    //---------------------------------------------------------------------
+    f << "        virtual uint32_t InternalSerializeToBuffer(char* " << MangleInternalKeyword("p") << ", uint32_t " << MangleInternalKeyword("len") << ") const" << std::endl;
+    f << "        {" << std::endl;
+    WriteStatsStart(f, msg, options, "Encode");
+    if(HasFixedSize(msg, options))
+    {
+        f << "             if(" << MangleInternalKeyword("len") << " < kWireSize)" << std::endl;
+        f << "                 return 0;" << std::endl;
+        f << "             SerializeFixed(" << MangleInternalKeyword("p") << ");" << std::endl;
+        WriteStatsEnd(f, msg, options, "Encode", "kWireSize");
+        f << "             return kWireSize;" << std::endl;
+    }
+    else
+    {
+        f << "             uint32_t " << MangleInternalKeyword("storageSize") << " = InternalCalculateNeededSerializationSize()" << (options.checksum ? " + kChecksumSize" : "") << ";" << std::endl;
         f << "             if(" << MangleInternalKeyword("len") << " < " << MangleInternalKeyword("storageSize") << ")" << std::endl;
         f << "                 return 0;" << std::endl;
-        // Version and message type
-        f << "             // Version" << std::endl;
-        //f << "             uint32_t version = GetVersion();" << std::endl;
-        f << "             *((uint32_t*)" << MangleInternalKeyword("p") << ") = SwapByte4((uint32_t)GetVersion());" << std::endl;
-        f << "             " << MangleInternalKeyword("p") << " += 4;" << std::endl;
-        f << "             // Message type" << std::endl;
-        //f << "             uint32_t type = GetType();" << std::endl;
-        f << "             *((uint32_t*)" << MangleInternalKeyword("p") << ") = SwapByte4((uint32_t)GetType());" << std::endl;
-        f << "             " << MangleInternalKeyword("p") << " += 4;" << std::endl;
+        f << "             // Version and message type" << std::endl;
+        f << "             InternalWriteHeader(" << MangleInternalKeyword("p") << ", " << options.baseclass << "::MT_" << msg.name << ", " << MangleInternalKeyword("storageSize") << ");" << std::endl;
+        f << "             " << msg.name << "::InternalSerializeBody(" << MangleInternalKeyword("p") << " + " << GetHeaderSize(msg, options) << ");" << std::endl;
+        if(options.checksum)
+            f << "             InternalStoreChecksum(" << MangleInternalKeyword("p") << ", " << MangleInternalKeyword("storageSize") << ");" << std::endl;
+        WriteStatsEnd(f, msg, options, "Encode", MangleInternalKeyword("storageSize"));
+        f << "             return " << MangleInternalKeyword("storageSize") << ";" << std::endl;
+    }
+    f << "        }" << std::endl;
+
+    //---------------------------------------------------------------------
+    f << "        virtual char* InternalSerializeBody(char* " << MangleInternalKeyword("p") << ") const" << std::endl;
+    f << "        {" << std::endl;
+    if(HasFixedSize(msg, options))
+    {
+        int offset = msg.packedSize;
+        if(msg.packedSize > 0)
+            WritePackedCopy(f, msg, MangleInternalKeyword("p"), false, "             ");
         for(size_t j = 0; j < msg.memberList.size(); ++j)
         {
-            const DataMember& member = msg.memberList[j];
-            f << "             // " << member.name << std::endl;
-            if(member.count > 1)
-            {
-                f << "             for(int " << MangleInternalKeyword("i") << " = 0; " << MangleInternalKeyword("i") << " < " << member.count << "; ++" << MangleInternalKeyword("i") << ")" << std::endl;
-                f << "             {" << std::endl;
-            }
-            if(member.type == "str")
-            {
-                //f << "             uint32_t len" << " = " << member.name << (member.count > 1 ? "[i]" : "") << ".length();" << std::endl;
-                f << "             *((uint32_t*)" << MangleInternalKeyword("p") << ") = SwapByte4((uint32_t)" << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << ".length()" << ");" << std::endl;
-                f << "             " << MangleInternalKeyword("p") << " += 4;" << std::endl;
-                f << "             memcpy(" << MangleInternalKeyword("p") << ", " << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << ".c_str(), " << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << ".length());" << std::endl;
-            }
-            else if(GetTypeStorageSize(member.type) == 1)
-                f << "             *" << MangleInternalKeyword("p") << " = *((char*)&" << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << ");" << std::endl;
-            else
-            {
-                f << "            *((" << member.nativeType << "*)" << MangleInternalKeyword("p") << ") = (" << member.nativeType << ")SwapByte" << GetSwapByteSuffix(member.type) << "(" << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << ");" << std::endl;
-            }
-            if(j != msg.memberList.size() - 1)
-            {
-                if(member.type == "str")
-                    f << "             " << MangleInternalKeyword("p") << " += " << member.name + (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") + ".length()" << ";" << std::endl;
-                else
-                    f << "             " << MangleInternalKeyword("p") << " += " << GetTypeStorageSize(member.type) << ";" << std::endl;
-            }
-            if(member.count > 1)
-            {
-                f << "             }" << std::endl;
-            }
+            if(IsPacked(msg.memberList[j]))
+                continue;
+            WriteFixedMemberCopy(f, msg.memberList[j], offset, false);
+            offset += GetTypeStorageSize(msg.memberList[j].type) * msg.memberList[j].count;
         }
-        f << "             return " << MangleInternalKeyword("storageSize") << ";" << std::endl;
-        f << "        }" << std::endl;
+        f << "             return " << MangleInternalKeyword("p") << " + " << offset << ";" << std::endl;
+    }
+    else
+    {
+        WriteBodyCopy(f, msg, options, false);
+        f << "             return " << MangleInternalKeyword("p") << ";" << std::endl;
+    }
+    f << "        }" << std::endl;
 
-        //---------------------------------------------------------------------
-        f << "        virtual std::string InternalSerializeToStringBuffer() const" << std::endl;
-        f << "        {" << std::endl;
-        f << "             int " << MangleInternalKeyword("storageSize") << "= InternalCalculateNeededSerializationSize();" << std::endl;
-        f << "             char* " << MangleInternalKeyword("buffer") << " = new char[" << MangleInternalKeyword("storageSize") << "];" << std::endl;
-        f << "             InternalSerializeToBuffer(" << MangleInternalKeyword("buffer") << ", " << MangleInternalKeyword("storageSize") << ");" << std::endl;
-        f << "             std::string " << MangleInternalKeyword("result") << "(" << MangleInternalKeyword("buffer") << ", " << MangleInternalKeyword("storageSize") << ");" << std::endl;
-        f << "             delete [] " << MangleInternalKeyword("buffer") << ";" << std::endl;
-        f << "             return " << MangleInternalKeyword("result") << ";" << std::endl;
-        f << "        }" << std::endl;
+    //---------------------------------------------------------------------
+    f << "        virtual std::string InternalSerializeToStringBuffer() const" << std::endl;
+    f << "        {" << std::endl;
+    f << "             std::string " << MangleInternalKeyword("result") << ";" << std::endl;
+    f << "             AppendTo(" << MangleInternalKeyword("result") << ");" << std::endl;
+    f << "             return " << MangleInternalKeyword("result") << ";" << std::endl;
+    f << "        }" << std::endl;
 
 
-        //---------------------------------------------------------------------
-        f << "        virtual void InternalCreateFromBuffer(const char* " << MangleInternalKeyword("p") << ")" << std::endl;
-        f << "        {" << std::endl;
+    //---------------------------------------------------------------------
+    f << "        // Decode a top level message whose body is at p, counted in the stats with extraSize, the size" << std::endl;
+    f << "        // of the rest of the message (header, checksum). Nested messages aren't counted on their own" << std::endl;
+    f << "        const char* InternalDecode(const char* " << MangleInternalKeyword("p") << ", uint32_t extraSize)" << std::endl;
+    f << "        {" << std::endl;
+    // Already in an #ifdef, the stats calls are written here rather than by WriteStatsStart / WriteStatsEnd
+    std::string stats = options.baseclass + "Stats";
+    std::string type = options.baseclass + "::MT_" + msg.name;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "             uint64_t " << MangleInternalKeyword("statsStart") << " = " << stats << "::InternalStartDecode(" << type << ");" << std::endl;
+    f << "             const char* " << MangleInternalKeyword("end") << " = " << msg.name << "::InternalCreateFromBuffer(" << MangleInternalKeyword("p") << ");" << std::endl;
+    f << "             " << stats << "::InternalDecoded(" << type << ", (uint64_t)(" << MangleInternalKeyword("end") << " - " << MangleInternalKeyword("p") << ") + extraSize, " << MangleInternalKeyword("statsStart") << ");" << std::endl;
+    f << "             return " << MangleInternalKeyword("end") << ";" << std::endl;
+    f << "#else" << std::endl;
+    f << "             (void)extraSize;" << std::endl;
+    f << "             return " << msg.name << "::InternalCreateFromBuffer(" << MangleInternalKeyword("p") << ");" << std::endl;
+    f << "#endif" << std::endl;
+    f << "        }" << std::endl;
+    f << "        virtual const char* InternalCreateFromBuffer(const char* " << MangleInternalKeyword("p") << ")" << std::endl;
+    f << "        {" << std::endl;
+    if(HasFixedSize(msg, options))
+    {
+        int offset = msg.packedSize;
+        if(msg.packedSize > 0)
+            WritePackedCopy(f, msg, MangleInternalKeyword("p"), true, "             ");
         for(size_t j = 0; j < msg.memberList.size(); ++j)
         {
-            const DataMember& member = msg.memberList[j];
-            f << "             // " << member.name << std::endl;
-            if(member.count > 1)
-            {
-                f << "             for(int " << MangleInternalKeyword("i") << " = 0; " << MangleInternalKeyword("i") << " < " << member.count << "; ++" << MangleInternalKeyword("i") << ")" << std::endl;
-                f << "             {" << std::endl;
-            }
-            if(member.type == "str")
-            {
-
-                f << "             uint32_t len_" << member.name << " = SwapByte4(*(uint32_t*)" << MangleInternalKeyword("p") << ");" << std::endl;
-                f << "             " << MangleInternalKeyword("p") << " += 4;" << std::endl;
-                f << "             " << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << " = std::string(" << MangleInternalKeyword("p") << ", len_" << member.name << ");" << std::endl;
-                if(j != msg.memberList.size() - 1)
-                    f << "             " << MangleInternalKeyword("p") << " += len_" << member.name << ";" << std::endl;
-            }
-            else if(GetTypeStorageSize(member.type) == 1)
-            {
-                f << "             " << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << " = (" << member.nativeType << ")*" << MangleInternalKeyword("p") << ";" << std::endl;
-                if(j != msg.memberList.size() - 1)
-                    f << "             " << MangleInternalKeyword("p") << "++;" << std::endl;
-            }
-            else
-            {
-                f << "             " << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << " = (" << member.nativeType << ")SwapByte" << GetSwapByteSuffix(member.type) << "(*(" << member.nativeType << "*)" << MangleInternalKeyword("p") << ");" << std::endl;
-                if(j != msg.memberList.size() - 1)
-                    f << "             " << MangleInternalKeyword("p") << " += " << GetTypeStorageSize(member.type) << ";" << std::endl;
-            }
-            if(member.count > 1)
-            {
-                f << "             }" << std::endl;
-            }
+            if(IsPacked(msg.memberList[j]))
+                continue;
+            WriteFixedMemberCopy(f, msg.memberList[j], offset, true);
+            offset += GetTypeStorageSize(msg.memberList[j].type) * msg.memberList[j].count;
         }
-        f << "        }" << std::endl;
+        f << "             return " << MangleInternalKeyword("p") << " + " << offset << ";" << std::endl;
+    }
+    else
+    {
+        WriteBodyCopy(f, msg, options, true);
+        f << "             return " << MangleInternalKeyword("p") << ";" << std::endl;
+    }
+    f << "        }" << std::endl;
 
-        //---------------------------------------------------------------------
-        f << "        virtual uint32_t InternalCalculateNeededSerializationSize() const" << std::endl;
-        f << "        {" << std::endl;
-        int size = 8; // version(4  bytes) and message type (4 bytes)
-        for(size_t j = 0; j < msg.memberList.size(); ++j)
-        {
-            const DataMember& member = msg.memberList[j];
-            size += GetTypeStorageSize(member.type) * member.count;
-        }
-        f << "             int " << MangleInternalKeyword("size") << " = " << size << ";" << std::endl;
+    //---------------------------------------------------------------------
+    f << "        virtual uint32_t InternalCalculateNeededSerializationSize() const" << std::endl;
+    f << "        {" << std::endl;
+    if(HasFixedSize(msg, options))
+    {
+        f << "             return kWireSize" << (options.checksum ? " - kChecksumSize" : "") << ";" << std::endl;
+    }
+    else
+    {
+        f << "             uint32_t " << MangleInternalKeyword("size") << " = " << GetStaticStorageSize(msg, options) << ";" << std::endl;
         for(size_t j = 0; j < msg.memberList.size(); ++j)
-        {
-            const DataMember& member = msg.memberList[j];
-            if(member.type == "str")
-            {
-                if(member.count > 1)
-                {
-                    f << "             for(int " << MangleInternalKeyword("i") << " = 0; " << MangleInternalKeyword("i") << " < " << member.count << "; ++" << MangleInternalKeyword("i") << ")" << std::endl;
-                    f << "             {" << std::endl;
-                    f << "    ";
-                }
-                f << "             " << MangleInternalKeyword("size") << " += " << member.name << (member.count > 1 ? "[" + MangleInternalKeyword("i") + "]" : "") << ".length();" << std::endl;
-                if(member.count > 1)
-                {
-                    f << "             }" << std::endl;
-                }
-            }
-        }
+            WriteMemberSizeComputation(f, msg.memberList[j], options);
         f << "             return " << MangleInternalKeyword("size") << ";" << std::endl;
-        f << "        }" << std::endl;
-        f << "};" << std::endl;
     }
+    f << "        }" << std::endl;
 
+    //---------------------------------------------------------------------
+    WriteMeasure(f, msg, options);
+    if(options.delta)
+    {
+        WriteDeltaInternals(f, msg, options);
+        if(nested)
+            WriteEquals(f, msg);
+    }
+    if(bitmapSize > 0)
+    {
+        f << "        // Bit set for each optional member present" << std::endl;
+        f << "        uint8_t " << presence << "[" << bitmapSize << "];" << std::endl;
+    }
+    f << "};" << std::endl;
 
+    if(options.views)
+        WriteView(f, msg, options);
+}
 
-
-
-
-
-
-
+// Factory and everything working on any message: decoder, batches, ring and log
+void WriteFactory(std::ostream& f, const MessageList& messageList, const Options& options)
+{
     f << "class " << options.baseclass << "Factory" << std::endl;
     f << "{" << std::endl;
     f << "    public:" << std::endl;
-    f << "        enum ERROR { NOERROR, INVALID_TYPE, BAD_VERSION };" << std::endl;
+    f << "        enum ERROR { NOERROR, INVALID_TYPE, BAD_VERSION, NEED_MORE_DATA, BAD_SIZE" << (options.checksum ? ", BAD_CHECKSUM" : "") << " };" << std::endl;
     f << "    public:" << std::endl;
     // Decode buffer and return a message
     //---------------------------------------------------------------------
-    f << "        static " << options.baseclass << "* CreateFromBuffer(const char* buffer, ERROR* errorCode = 0)" << std::endl;
+    if(options.checksum)
+    {
+        f << "        // Verifying the checksum needs the message size: buffer must hold a whole message" << std::endl;
+        f << "        static " << options.baseclass << "* CreateFromBuffer(const char* buffer, ERROR* errorCode = 0)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return CreateFromBufferChecked(buffer, 0xffffffff, errorCode);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Same as CreateFromBuffer for a message already validated by MeasureFrame, whose checksum" << std::endl;
+        f << "        // isn't verified again" << std::endl;
+        f << "        static " << options.baseclass << "* CreateVerified(const char* buffer, ERROR* errorCode = 0)" << std::endl;
+    }
+    else
+        f << "        static " << options.baseclass << "* CreateFromBuffer(const char* buffer, ERROR* errorCode = 0)" << std::endl;
     f << "        {" << std::endl;
-    f << "             uint32_t version = " << options.baseclass << "::SwapByte4(*((uint32_t*)buffer));" << std::endl;
-    f << "             buffer += 4;" << std::endl;
+    f << "             // Left as is when the header can't be read" << std::endl;
+    f << "             uint32_t version = 0, type = 0xffffffff;" << std::endl;
+    f << "             uint32_t headerSize = " << options.baseclass << "::InternalReadHeader(buffer, 0xffffffff, &version, &type);" << std::endl;
     f << "             if(version != " << options.baseclass << "::GetVersion())" << std::endl;
     f << "             {" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "                 " << options.baseclass << "Stats::InternalError(type, BAD_VERSION);" << std::endl;
+    f << "#endif" << std::endl;
     f << "                 if(errorCode)" << std::endl;
     f << "                     *errorCode = BAD_VERSION;" << std::endl;
     f << "                 return 0;" << std::endl;
     f << "             }" << std::endl;
-    f << "             uint32_t type = " << options.baseclass << "::SwapByte4(*((uint32_t*)buffer));" << std::endl;
-    f << "             buffer += 4;" << std::endl;
     f << "             " << options.baseclass << "* message = 0;" << std::endl;
     f << "             switch(type)" << std::endl;
     f << "             {" << std::endl;
@@ -602,39 +6073,427 @@ bool WriteOutput(const std::string& output, const MessageList& messageList, cons
     {
         const Message& msg = messageList[i];
         f << "                 case " << options.baseclass << "::MT_" << msg.name << ":" <<  std::endl;
-        f << "                     message = new " << msg.name << "();" <<  std::endl;
+        f << "                 {" <<  std::endl;
+        f << "                     " << msg.name << "* decoded = new " << msg.name << "();" <<  std::endl;
+        f << "                     decoded->" << msg.name << "::InternalDecode(buffer + headerSize, headerSize" << (options.checksum ? " + " + options.baseclass + "::kChecksumSize" : "") << ");" <<  std::endl;
+        f << "                     message = decoded;" <<  std::endl;
         f << "                     break;" <<  std::endl;
+        f << "                 }" <<  std::endl;
     }
     f << "             }" << std::endl;
     f << "             if(!message)" << std::endl;
     f << "             {" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "                 " << options.baseclass << "Stats::InternalError(type, INVALID_TYPE);" << std::endl;
+    f << "#endif" << std::endl;
     f << "                 if(errorCode)" << std::endl;
     f << "                     *errorCode = INVALID_TYPE;" << std::endl;
     f << "                 return 0;" << std::endl;
     f << "             }" << std::endl;
-    f << "             message->InternalCreateFromBuffer(buffer);" << std::endl;
     f << "             if(errorCode)" << std::endl;
     f << "                 *errorCode = NOERROR;" << std::endl;
     f << "             return message;" << std::endl;
     f << "        }" << std::endl;
 
+    //---------------------------------------------------------------------
+    f << "        // Same as above, but fails with NEED_MORE_DATA instead of reading past len bytes" << std::endl;
+    f << "        // It isn't an overload of CreateFromBuffer, with which CreateFromBuffer(buffer, 0) would be ambiguous" << std::endl;
+    f << "        static " << options.baseclass << "* CreateFromBufferChecked(const char* buffer, uint32_t len, ERROR* errorCode = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t size;" << std::endl;
+    f << "             ERROR error = MeasureFrame(buffer, len, &size);" << std::endl;
+    f << "             if(error != NOERROR)" << std::endl;
+    f << "             {" << std::endl;
+    f << "#ifdef MSGBUF_ENABLE_STATS" << std::endl;
+    f << "                 // The type is unknown when the header itself is truncated" << std::endl;
+    f << "                 uint32_t version = 0, type = " << options.baseclass << "Stats::kTypeCount;" << std::endl;
+    f << "                 " << options.baseclass << "::InternalReadHeader(buffer, len, &version, &type);" << std::endl;
+    f << "                 " << options.baseclass << "Stats::InternalError(type, error);" << std::endl;
+    f << "#endif" << std::endl;
+    f << "                 if(errorCode)" << std::endl;
+    f << "                     *errorCode = error;" << std::endl;
+    f << "                 return 0;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return " << (options.checksum ? "CreateVerified" : "CreateFromBuffer") << "(buffer, errorCode);" << std::endl;
+    f << "        }" << std::endl;
+
     //---------------------------------------------------------------------
     f << "        static " << options.baseclass << "* CreateFromStringBuffer(const std::string& buffer, ERROR* errorCode = 0)" << std::endl;
     f << "        {" << std::endl;
-    f << "             return CreateFromBuffer(buffer.c_str(), errorCode);" << std::endl;
+    f << "             return CreateFromBufferChecked(buffer.c_str(), (uint32_t)buffer.length(), errorCode);" << std::endl;
+    f << "        }" << std::endl;
+
+    // Check the bounds of a message without decoding it
+    //---------------------------------------------------------------------
+    f << "        // Validate the header and the bounds of the message stored in buffer, without decoding it" << std::endl;
+    f << "        // size receives the message size on success, or the minimum buffer size needed on NEED_MORE_DATA" << std::endl;
+    if(options.framed)
+    {
+        f << "        // With the framing, size receives the frame size as soon as it's known (even if an error is" << std::endl;
+        f << "        // returned, so that messages of unknown types can be skipped), the body must fit in the frame" << std::endl;
+    }
+    f << "        static ERROR MeasureFrame(const char* buffer, uint32_t len, uint32_t* size)" << std::endl;
+    f << "        {" << std::endl;
+    WriteReadFrameHeader(f, options);
+    f << "             ERROR error = MeasureBody(type, buffer + headerSize, len - headerSize, size);" << std::endl;
+    WriteFrameSize(f, options, "             ");
+    f << "             return error;" << std::endl;
+    f << "        }" << std::endl;
+
+    //---------------------------------------------------------------------
+    f << "        // Same as MeasureFrame for a message body (what follows the version and type)" << std::endl;
+    f << "        static ERROR MeasureBody(uint32_t type, const char* body, uint32_t len, uint32_t* size)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             bool complete;" << std::endl;
+    f << "             switch(type)" << std::endl;
+    f << "             {" << std::endl;
+    for(size_t i = 0; i < messageList.size(); ++i)
+    {
+        const Message& msg = messageList[i];
+        f << "                 case " << options.baseclass << "::MT_" << msg.name << ":" <<  std::endl;
+        f << "                     complete = " << msg.name << "::InternalMeasureBody(body, len, size);" <<  std::endl;
+        f << "                     break;" <<  std::endl;
+    }
+    f << "                 default:" << std::endl;
+    f << "                     *size = 0;" << std::endl;
+    f << "                     return INVALID_TYPE;" << std::endl;
+    f << "             }" << std::endl;
+    f << "             return complete ? NOERROR : NEED_MORE_DATA;" << std::endl;
+    f << "        }" << std::endl;
+
+    // Routing without decoding
+    //---------------------------------------------------------------------
+    f << "        // Type of the message in buffer, which must hold its whole header, without decoding it" << std::endl;
+    f << "        // Types unknown to this version are returned as is" << std::endl;
+    f << "        static uint32_t PeekType(const char* buffer)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t version, type;" << std::endl;
+    f << "             " << options.baseclass << "::InternalReadHeader(buffer, 0xffffffff, &version, &type);" << std::endl;
+    f << "             return type;" << std::endl;
+    f << "        }" << std::endl;
+    if(options.framed)
+    {
+        f << "        // Total size of the message in buffer (read from the first 4 bytes of its header), whatever" << std::endl;
+        f << "        // its type. It isn't validated, see MeasureFrame" << std::endl;
+        f << "        static uint32_t PeekSize(const char* buffer)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return " << options.baseclass << "::Load4(buffer);" << std::endl;
+        f << "        }" << std::endl;
+        f << "        // Start of the message following the one in buffer" << std::endl;
+        f << "        static const char* SkipMessage(const char* buffer)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             return buffer + PeekSize(buffer);" << std::endl;
+        f << "        }" << std::endl;
+    }
+
+    // Decode buffer into an existing message
+    //---------------------------------------------------------------------
+    // Added to the header size for the stats (see InternalDecode)
+    std::string checksumSize = options.checksum ? " + " + options.baseclass + "::kChecksumSize" : "";
+    for(size_t i = 0; i < messageList.size(); ++i)
+    {
+        const Message& msg = messageList[i];
+        if(i == 0)
+        {
+            f << "        // Decode buffer into message, overwriting its fields in place: the capacity of its strings" << std::endl;
+            f << "        // is reused, so decoding into a long-lived message doesn't allocate once it's warmed up" << std::endl;
+            f << "        // Returns INVALID_TYPE if buffer holds another message type, size is the same as with MeasureFrame" << std::endl;
+        }
+        f << "        static ERROR ParseInto(" << msg.name << "& message, const char* buffer, uint32_t len, uint32_t* size = 0)" << std::endl;
+        f << "        {" << std::endl;
+        f << "             uint32_t frameSize;" << std::endl;
+        f << "             if(!size)" << std::endl;
+        f << "                 size = &frameSize;" << std::endl;
+        WriteReadFrameHeader(f, options);
+        f << "             if(type != (uint32_t)" << options.baseclass << "::MT_" << msg.name << ")" << std::endl;
+        f << "                 return INVALID_TYPE;" << std::endl;
+        f << "             bool complete = " << msg.name << "::InternalMeasureBody(buffer + headerSize, len - headerSize, size);" << std::endl;
+        f << "             ERROR error = (complete ? NOERROR : NEED_MORE_DATA);" << std::endl;
+        WriteFrameSize(f, options, "             ");
+        f << "             if(error != NOERROR)" << std::endl;
+        f << "                 return error;" << std::endl;
+        f << "             message." << msg.name << "::InternalDecode(buffer + headerSize, headerSize" << checksumSize << ");" << std::endl;
+        f << "             return NOERROR;" << std::endl;
+        f << "        }" << std::endl;
+    }
+
+    // Decode buffer into a local message and hand it to handler.On(const Foo&)
+    //---------------------------------------------------------------------
+    f << "        // Decode buffer into a stack-local message of the right type and call handler.On() with it" << std::endl;
+    f << "        // no heap allocation (besides the content of str members) and no virtual call are involved" << std::endl;
+    f << "        // Handler must provide an On(const Foo&) overload for every message type" << std::endl;
+    f << "        // size receives the same value as with MeasureFrame" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        static ERROR Dispatch(const char* buffer, uint32_t len, Handler& handler, uint32_t* size = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             uint32_t frameSize;" << std::endl;
+    f << "             if(!size)" << std::endl;
+    f << "                 size = &frameSize;" << std::endl;
+    WriteReadFrameHeader(f, options);
+    if(options.checksum && !options.framed)
+    {
+        f << "             // The checksum following the body is verified before handing the message out" << std::endl;
+        f << "             ERROR error = MeasureBody(type, buffer + headerSize, len - headerSize, size);" << std::endl;
+        WriteFrameSize(f, options, "             ");
+        f << "             if(error != NOERROR)" << std::endl;
+        f << "                 return error;" << std::endl;
+        f << "             uint32_t bodySize;" << std::endl;
+        f << "             return DispatchBody(type, buffer + headerSize, len - headerSize, handler, &bodySize, headerSize" << checksumSize << ");" << std::endl;
+    }
+    else
+    {
+        f << "             ERROR error = DispatchBody(type, buffer + headerSize, len - headerSize, handler, size, headerSize" << checksumSize << ");" << std::endl;
+        WriteFrameSize(f, options, "             ");
+        f << "             return error;" << std::endl;
+    }
+    f << "        }" << std::endl;
+
+    //---------------------------------------------------------------------
+    f << "        // Same as Dispatch for a message body (what follows the version and type)" << std::endl;
+    f << "        // extraSize is the size of the rest of the message, only used by the stats" << std::endl;
+    f << "        template <class Handler>" << std::endl;
+    f << "        static ERROR DispatchBody(uint32_t type, const char* body, uint32_t len, Handler& handler, uint32_t* size, uint32_t extraSize = 0)" << std::endl;
+    f << "        {" << std::endl;
+    f << "             switch(type)" << std::endl;
+    f << "             {" << std::endl;
+    for(size_t i = 0; i < messageList.size(); ++i)
+    {
+        const Message& msg = messageList[i];
+        f << "                 case " << options.baseclass << "::MT_" << msg.name << ":" <<  std::endl;
+        f << "                 {" <<  std::endl;
+        f << "                     if(!" << msg.name << "::InternalMeasureBody(body, len, size))" <<  std::endl;
+        f << "                         return NEED_MORE_DATA;" <<  std::endl;
+        f << "                     " << msg.name << " message;" <<  std::endl;
+        f << "                     message." << msg.name << "::InternalDecode(body, extraSize);" <<  std::endl;
+        f << "                     handler.On(message);" <<  std::endl;
+        f << "                     return NOERROR;" <<  std::endl;
+        f << "                 }" <<  std::endl;
+    }
+    f << "             }" << std::endl;
+    f << "             *size = 0;" << std::endl;
+    f << "             return INVALID_TYPE;" << std::endl;
     f << "        }" << std::endl;
     f << "};" << std::endl;
 
+    WriteDecoder(f, options);
+    if(options.compression)
+        WriteCompressor(f, options);
+    WriteBatch(f, options);
+    WriteParallelBatch(f, options);
+    if(options.shmRing)
+        WriteShmRing(f, options);
+    if(options.log)
+        WriteLog(f, options);
+    if(options.connection)
+        WriteConnection(f, options);
+}
+
+// Comment line identifying the schema a file was generated from, see HashSchema
+std::string GetHashLine(uint64_t hash)
+{
+    std::ostringstream ss;
+    ss << "// Schema hash: " << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return ss.str();
+}
+
+// Version of the generated code, to be bumped whenever the code msgbuf emits changes: headers
+// generated by an older msgbuf don't match the hash anymore, and are generated again
+const char* kGeneratorVersion = "msgbuf 8";
+
+// 64 bits FNV-1a hash of kGeneratorVersion and of the schema file (its options included), returns
+// false if the file can't be read
+bool HashSchema(const std::string& filename, uint64_t* hash)
+{
+    std::ifstream f(filename.c_str());
+    if(!f.is_open())
+        return false;
+
+    std::string content(kGeneratorVersion);
+    content += '\n';
+    content.append((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    *hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < content.size(); ++i)
+    {
+        *hash ^= (uint8_t)content[i];
+        *hash *= 1099511628211ULL;
+    }
+    return true;
+}
+
+// Header of a message (or of the factory) in a split generation: output.h gives output_Name.h
+std::string GetSplitHeader(const std::string& output, const std::string& name)
+{
+    std::string::size_type dot = output.rfind('.');
+    std::string::size_type slash = output.find_last_of("/\\");
+    if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return output + "_" + name + ".h";
+    return output.substr(0, dot) + "_" + name + output.substr(dot);
+}
+
+// Path without its directories, the generated headers include each other from the same directory
+std::string GetFileName(const std::string& path)
+{
+    std::string::size_type slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// The file holding the schema hash is written last: the header, or the factory one when split
+std::string GetHashedOutput(const std::string& output, const Options& options)
+{
+    return options.split ? GetSplitHeader(output, "factory") : output;
+}
+
+// True if the output was generated from this schema, and nothing needs to be written
+bool IsUpToDate(const std::string& output, const MessageList& messageList, const Options& options, uint64_t hash)
+{
+    std::ifstream f(GetHashedOutput(output, options).c_str());
+    std::string line;
+    bool found = false;
+    for(int i = 0; i < 8 && !found && std::getline(f, line); ++i)
+        found = (line == GetHashLine(hash));
+    if(!found || !options.split)
+        return found;
+
+    if(!std::ifstream(output.c_str()).is_open())
+        return false;
+    for(size_t i = 0; i < messageList.size(); ++i)
+    {
+        if(!std::ifstream(GetSplitHeader(output, messageList[i].name).c_str()).is_open()
+           || (options.columns && !std::ifstream(GetSplitHeader(output, messageList[i].name + "Columns").c_str()).is_open()))
+            return false;
+    }
+    return true;
+}
+
+// Write content to path, unless it already holds it: the file date doesn't change, and
+// whatever includes it isn't rebuilt
+bool WriteFile(const std::string& path, const std::string& content)
+{
+    std::ifstream in(path.c_str());
+    if(in.is_open())
+    {
+        std::string current((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if(current == content)
+            return true;
+        in.close();
+    }
+
+    std::ofstream f(path.c_str());
+    if(!f.is_open())
+        return false;
+    f << content;
+    f.close();
+    return !f.fail();
+}
 
+void WriteHeaderStart(std::ostream& f, const std::string& includeGuard, const std::string& hashLine)
+{
+    f << "#ifndef " << includeGuard << std::endl;
+    f << "#define " << includeGuard << std::endl;
 
+    f << std::endl;
+    f << "// DO NOT MODIFY, THIS FILE WAS AUTO-GENERATED BY MSGBUF" << std::endl;
+    if(hashLine != "")
+        f << hashLine << std::endl;
 
+    f << std::endl;
+}
 
+void WriteHeaderEnd(std::ostream& f, const std::string& includeGuard)
+{
     f << "}" << std::endl; // End of namespace
     f << "#endif // " << includeGuard << std::endl;
+}
 
+// The headers are generated in memory and only the files whose content changed are written.
+// Everything goes to output, unless the schema asks for a split output (!output split): output
+// then only holds the base class, each message gets its own header (output_Name.h) including the
+// headers of its nested messages, the factory header (output_factory.h) includes them all, and the
+// columns of each message (!columns on) are in output_NameColumns.h
+bool WriteOutput(const std::string& output, const MessageList& messageList, const EnumList& enumList, const Options& options, uint64_t hash)
+{
+    std::string guardPrefix = "MSGBUF_" + options.package + "_" + options.baseclass + "_" + ToString(options.version);
+    std::string includeGuard = guardPrefix + "_INCLUDED__";
 
-    f.close();
-    return true;
+    std::ostringstream f;
+    WriteHeaderStart(f, includeGuard, options.split ? "" : GetHashLine(hash));
+    WriteIncludes(f, options);
+    f << std::endl;
+    f << "namespace " << options.package << " {" << std::endl;
+    WriteBase(f, messageList, enumList, options);
+    if(!options.split)
+    {
+        for(size_t i = 0; i < messageList.size(); ++i)
+            WriteMessage(f, messageList[i], options);
+        WriteFactory(f, messageList, options);
+        for(size_t i = 0; options.columns && i < messageList.size(); ++i)
+            WriteColumns(f, messageList[i], options);
+    }
+    WriteHeaderEnd(f, includeGuard);
+    if(!WriteFile(output, f.str()))
+        return false;
+    if(!options.split)
+        return true;
+
+    for(size_t i = 0; i < messageList.size(); ++i)
+    {
+        const Message& msg = messageList[i];
+        std::string lowerName;
+        for(size_t j = 0; j < msg.name.size(); ++j)
+            lowerName += (char)tolower(msg.name[j]);
+        if(lowerName == "factory")
+        {
+            std::cout << "Invalid message name with a split output (used by the factory header): " << msg.name << std::endl;
+            return false;
+        }
+
+        std::string messageGuard = guardPrefix + "_MT_" + msg.name + "_INCLUDED__";
+        std::ostringstream m;
+        WriteHeaderStart(m, messageGuard, "");
+        m << "#include \"" << GetFileName(output) << "\"" << std::endl;
+        for(size_t j = 0; j < msg.memberList.size(); ++j)
+        {
+            bool included = false;
+            for(size_t k = 0; k < j; ++k)
+                included = included || (msg.memberList[k].nested && msg.memberList[k].type == msg.memberList[j].type);
+            if(msg.memberList[j].nested && !included)
+                m << "#include \"" << GetFileName(GetSplitHeader(output, msg.memberList[j].type)) << "\"" << std::endl;
+        }
+        m << std::endl;
+        m << "namespace " << options.package << " {" << std::endl;
+        WriteMessage(m, msg, options);
+        WriteHeaderEnd(m, messageGuard);
+        if(!WriteFile(GetSplitHeader(output, msg.name), m.str()))
+            return false;
+    }
+
+    // The columns are big and seldom used, they get their own header (output_NameColumns.h)
+    for(size_t i = 0; options.columns && i < messageList.size(); ++i)
+    {
+        const Message& msg = messageList[i];
+        std::string columnsGuard = guardPrefix + "_MT_" + msg.name + "_COLUMNS_INCLUDED__";
+        std::ostringstream c;
+        WriteHeaderStart(c, columnsGuard, "");
+        c << "#include \"" << GetFileName(GetSplitHeader(output, "factory")) << "\"" << std::endl;
+        c << std::endl;
+        c << "namespace " << options.package << " {" << std::endl;
+        WriteColumns(c, msg, options);
+        WriteHeaderEnd(c, columnsGuard);
+        if(!WriteFile(GetSplitHeader(output, msg.name + "Columns"), c.str()))
+            return false;
+    }
+
+    std::string factoryGuard = guardPrefix + "_FACTORY_INCLUDED__";
+    std::ostringstream factory;
+    WriteHeaderStart(factory, factoryGuard, GetHashLine(hash));
+    factory << "#include \"" << GetFileName(output) << "\"" << std::endl;
+    for(size_t i = 0; i < messageList.size(); ++i)
+        factory << "#include \"" << GetFileName(GetSplitHeader(output, messageList[i].name)) << "\"" << std::endl;
+    factory << std::endl;
+    factory << "namespace " << options.package << " {" << std::endl;
+    WriteFactory(factory, messageList, options);
+    WriteHeaderEnd(factory, factoryGuard);
+    return WriteFile(GetHashedOutput(output, options), factory.str());
 }
 
 int main(int argc, char* argv[])
@@ -649,9 +6508,16 @@ int main(int argc, char* argv[])
     std::string output(argv[2]);
 
     MessageList messageList;
+    EnumList enumList;
 
     Options options;
 
-    if(ProcessInputFile(input, messageList, options))
-        WriteOutput(output, messageList, options);
+    uint64_t hash = 0;
+    if(HashSchema(input, &hash) && ProcessInputFile(input, messageList, enumList, options))
+    {
+        if(IsUpToDate(output, messageList, options, hash))
+            std::cout << output << " is up to date" << std::endl;
+        else
+            WriteOutput(output, messageList, enumList, options, hash);
+    }
 }
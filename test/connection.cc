@@ -0,0 +1,137 @@
+// MessageConnection over a socketpair: messages of every size received in order and as sent,
+// and a bounded output buffer when the peer reads slower than messages are sent
+#include "connection.h"
+#include "test.h"
+#include <new>
+#include <sys/socket.h>
+
+using namespace Test;
+
+// Bytes allocated and not freed yet, each allocation storing its size before the memory returned
+static size_t liveBytes = 0;
+
+void* operator new(size_t size)
+{
+    size_t* p = (size_t*)malloc(size + sizeof(max_align_t));
+    if(!p)
+        throw std::bad_alloc();
+    *p = size;
+    liveBytes += size;
+    return (char*)p + sizeof(max_align_t);
+}
+
+void operator delete(void* p) noexcept
+{
+    if(!p)
+        return;
+    size_t* block = (size_t*)((char*)p - sizeof(max_align_t));
+    liveBytes -= *block;
+    free(block);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+struct Checker
+{
+    uint32_t quotes;
+    uint32_t trades;
+    Checker() : quotes(0), trades(0) {}
+    void On(const Quote& quote)
+    {
+        CHECK(quote.seq == quotes);
+        CHECK(quote.symbol.size() == (quote.seq % 100 == 0 ? 200000 : quote.seq % 16));
+        ++quotes;
+    }
+    void On(const Trade& trade)
+    {
+        CHECK(trade.seq == trades && trade.price == trade.seq * 3ull);
+        ++trades;
+    }
+};
+
+void TestOrder()
+{
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    MessageConnection sender(fds[0]), receiver(fds[1]);
+    Checker checker;
+    const uint32_t count = 20000;
+    Quote quote;
+    Trade trade;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        // Every 100th quote is bigger than the input buffer, and than the socket buffer
+        quote.seq = i;
+        quote.symbol.assign(i % 100 == 0 ? 200000 : i % 16, 'q');
+        sender.Send(quote);
+        trade.seq = i;
+        trade.price = i * 3ull;
+        sender.Send(trade);
+        // Partial writes: whatever the socket didn't take is written by the next Flush
+        CHECK(sender.Flush());
+        CHECK(receiver.Receive(checker));
+    }
+    while(sender.GetPendingSize() > 0)
+    {
+        CHECK(sender.Flush());
+        CHECK(receiver.Receive(checker));
+    }
+    CHECK(receiver.Receive(checker));
+    CHECK(checker.quotes == count && checker.trades == count);
+    CHECK(receiver.GetError() == MessageFactory::NOERROR);
+
+    // Closed by the peer
+    sender.Close();
+    CHECK(!receiver.Receive(checker));
+    CHECK(!receiver.IsOpen() && receiver.GetSystemError() == 0);
+}
+
+void TestSlowReader()
+{
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    MessageConnection sender(fds[0]), receiver(fds[1]);
+    Quote quote;
+    quote.symbol = "ABCDEFGH";
+    uint32_t received = 0;
+    size_t baseline = liveBytes, peak = 0;
+    // The reader takes fewer messages than are sent whenever the sender is close to blocking, so
+    // that what's sent is never written completely
+    for(uint32_t i = 0; i < 20000; ++i)
+    {
+        if(sender.GetPendingSize() < 256 * 1024)
+        {
+            for(uint32_t j = 0; j < 100; ++j)
+            {
+                sender.Send(quote);
+                ++quote.seq;
+            }
+        }
+        CHECK(sender.Flush());
+        MessageConnection::Frame frame;
+        for(uint32_t j = 0; j < 90 && receiver.TryNext(frame); ++j)
+        {
+            Quote decoded;
+            CHECK(MessageFactory::ParseInto(decoded, frame.data, frame.size) == MessageFactory::NOERROR);
+            CHECK(decoded.seq == received);
+            ++received;
+        }
+        if(liveBytes - baseline > peak)
+            peak = liveBytes - baseline;
+    }
+    CHECK(sender.GetPendingSize() > 0);
+    // About 40MB were sent, the output buffer holds at most twice what's pending
+    CHECK(quote.seq > 1000000);
+    CHECK(peak < 4 * 1024 * 1024);
+}
+
+int main()
+{
+    TestOrder();
+    TestSlowReader();
+    printf("connection: ok\n");
+    return 0;
+}
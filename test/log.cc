@@ -0,0 +1,187 @@
+// MessageLogWriter / MessageLogReader: appending to a reopened log, seeking through the index,
+// recovering from a torn tail with RebuildIndex, compressed blocks, and records of unknown types
+#include "log.h"
+#include "test.h"
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Test;
+
+std::string path;
+
+// Event i has i % 50 bytes of data, every 10th message is a Mark
+void Append(MessageLogWriter& writer, uint32_t begin, uint32_t end)
+{
+    for(uint32_t i = begin; i < end; ++i)
+    {
+        if(i % 10 == 9)
+        {
+            Mark mark;
+            mark.seq = i;
+            CHECK(writer.Append(mark));
+        }
+        else
+        {
+            Event event;
+            event.seq = i;
+            event.data.assign(i % 50, 'e');
+            CHECK(writer.Append(event));
+        }
+    }
+}
+
+struct Checker
+{
+    uint32_t next;
+    explicit Checker(uint32_t first) : next(first) {}
+    void On(const Event& event)
+    {
+        CHECK(next % 10 != 9 && event.seq == next && event.data.size() == next % 50);
+        ++next;
+    }
+    void On(const Mark& mark)
+    {
+        CHECK(next % 10 == 9 && mark.seq == next);
+        ++next;
+    }
+};
+
+// Read the whole log, which must hold messages 0 to count - 1
+void CheckLog(uint32_t count)
+{
+    CHECK(MessageLogReader::IsIndexValid(path.c_str()));
+    MessageLogReader reader;
+    CHECK(reader.Open(path.c_str()));
+    CHECK(reader.GetCount() == count);
+    Checker checker(0);
+    MessageFactory::ERROR error;
+    while(reader.DispatchNext(checker, &error))
+        CHECK(error == MessageFactory::NOERROR);
+    CHECK(checker.next == count && reader.GetSequence() == count);
+
+    // Seek anywhere, in both directions
+    const uint32_t targets[] = { count - 1, 0, count / 2, 9, count / 3 };
+    for(size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i)
+    {
+        uint32_t target = targets[i];
+        CHECK(reader.Seek(target) && reader.GetSequence() == target);
+        Message::MESSAGE_TYPE type;
+        CHECK(reader.GetType(target, &type));
+        CHECK(type == (target % 10 == 9 ? Message::MT_Mark : Message::MT_Event));
+        Checker single(target);
+        CHECK(reader.DispatchNext(single, &error) && error == MessageFactory::NOERROR && single.next == target + 1);
+    }
+    CHECK(!reader.Seek(count));
+}
+
+uint64_t FileSize(const std::string& file)
+{
+    struct stat info;
+    CHECK(stat(file.c_str(), &info) == 0);
+    return (uint64_t)info.st_size;
+}
+
+void Remove()
+{
+    unlink(path.c_str());
+    unlink((path + ".idx").c_str());
+}
+
+void TestAppend(uint32_t compressionThreshold)
+{
+    Remove();
+    {
+        // Small buffer: many flushes (and blocks, when compressed)
+        MessageLogWriter writer(4096);
+        writer.SetCompressionThreshold(compressionThreshold);
+        CHECK(writer.Open(path.c_str()));
+        Append(writer, 0, 3000);
+        CHECK(writer.Close());
+    }
+    CheckLog(3000);
+    {
+        MessageLogWriter writer(4096);
+        writer.SetCompressionThreshold(compressionThreshold);
+        CHECK(writer.Open(path.c_str()));
+        CHECK(writer.GetCount() == 3000);
+        Append(writer, 3000, 5000);
+        CHECK(writer.Close());
+    }
+    CheckLog(5000);
+}
+
+// A crash in the middle of a write leaves a partial record and a stale index
+void TestTornTail(uint32_t compressionThreshold)
+{
+    TestAppend(compressionThreshold);
+    uint64_t size = FileSize(path);
+    CHECK(truncate(path.c_str(), size - 3) == 0);
+    CHECK(!MessageLogReader::IsIndexValid(path.c_str()));
+    CHECK(MessageLogReader::RebuildIndex(path.c_str()));
+    CHECK(FileSize(path) < size - 3);
+    MessageLogReader reader;
+    CHECK(reader.Open(path.c_str()));
+    uint32_t count = (uint32_t)reader.GetCount();
+    // Only the end is lost: a single record, or the last block
+    CHECK(count < 5000 && count >= (compressionThreshold ? 4000 : 4999));
+    reader.Close();
+    CheckLog(count);
+
+    // Appending after the recovery continues the sequence
+    MessageLogWriter writer;
+    CHECK(writer.Open(path.c_str()));
+    CHECK(writer.GetCount() == count);
+    Append(writer, count, count + 100);
+    CHECK(writer.Close());
+    CheckLog(count + 100);
+}
+
+// A record of a type this version doesn't know (e.g. written by a newer schema)
+void TestUnknownType()
+{
+    Remove();
+    MessageLogWriter writer;
+    CHECK(writer.Open(path.c_str()));
+    Append(writer, 0, 10);
+    CHECK(writer.Close());
+
+    // Message 9 is the last record: its size (4 bytes) and a Mark (version, type, seq)
+    uint64_t size = FileSize(path);
+    const char type[4] = { '\xff', '\xff', '\xff', '\xff' };
+    FILE* log = fopen(path.c_str(), "r+b");
+    CHECK(log && fseek(log, (long)(size - 8), SEEK_SET) == 0 && fwrite(type, 4, 1, log) == 1 && fclose(log) == 0);
+    FILE* index = fopen((path + ".idx").c_str(), "r+b");
+    CHECK(index && fseek(index, 9 * 16 + 8, SEEK_SET) == 0 && fwrite(type, 4, 1, index) == 1 && fclose(index) == 0);
+
+    MessageLogReader reader;
+    CHECK(reader.Open(path.c_str()));
+    Message::MESSAGE_TYPE messageType;
+    CHECK(reader.GetType(8, &messageType) && messageType == Message::MT_Event);
+    CHECK(!reader.GetType(9, &messageType));
+    CHECK(reader.Seek(9));
+    const char* message;
+    uint32_t len;
+    CHECK(!reader.Next(&messageType, &message, &len));
+    CHECK(reader.GetSequence() == 9);
+    Checker checker(9);
+    MessageFactory::ERROR error;
+    CHECK(reader.DispatchNext(checker, &error) && error == MessageFactory::INVALID_TYPE);
+    CHECK(reader.GetSequence() == 10 && !reader.DispatchNext(checker, &error));
+}
+
+int main()
+{
+    char directory[] = "/tmp/msgbuf_log_XXXXXX";
+    CHECK(mkdtemp(directory));
+    path = std::string(directory) + "/test.log";
+    TestAppend(0);
+    TestAppend(1024);
+    TestTornTail(0);
+    TestTornTail(1024);
+    TestUnknownType();
+    Remove();
+    rmdir(directory);
+    printf("log: ok\n");
+    return 0;
+}
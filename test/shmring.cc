@@ -0,0 +1,157 @@
+// MessageShmRing between forked processes: every message received once and in order, through
+// many wraparounds of a small ring, with one producer or several
+#include "shmring.h"
+#include "test.h"
+#include <algorithm>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Test;
+
+// Messages written by each producer, with a padding of a varying size so that records end
+// anywhere in the ring
+const uint32_t kCount = 200000;
+// Small enough for the ring to wrap around every few dozens of messages
+const uint32_t kCapacity = 4096;
+
+void Produce(MessageShmRing& ring, uint32_t producer)
+{
+    Tick tick;
+    tick.producer = producer;
+    for(uint32_t i = 0; i < kCount; ++i)
+    {
+        tick.seq = i;
+        tick.pad.assign(i % 97, (char)('a' + i % 26));
+        while(!ring.Write(tick))
+            sched_yield();
+    }
+}
+
+struct Consumer
+{
+    std::vector<uint32_t> next;
+    uint32_t received;
+    explicit Consumer(uint32_t producerCount) : next(producerCount, 0), received(0) {}
+    void On(const Tick& tick)
+    {
+        CHECK(tick.producer < next.size());
+        CHECK(tick.seq == next[tick.producer]);
+        CHECK(tick.pad.size() == tick.seq % 97);
+        CHECK(tick.pad.empty() || tick.pad[0] == (char)('a' + tick.seq % 26));
+        ++next[tick.producer];
+        ++received;
+    }
+};
+
+// Every other message is read with Peek() and Release(), the others with DispatchNext()
+void Consume(MessageShmRing& ring, uint32_t producerCount)
+{
+    Consumer consumer(producerCount);
+    while(consumer.received < kCount * producerCount)
+    {
+        if(consumer.received % 2)
+        {
+            uint32_t len;
+            const char* message = ring.Peek(&len);
+            if(!message)
+            {
+                sched_yield();
+                continue;
+            }
+            Tick tick;
+            CHECK(MessageFactory::ParseInto(tick, message, len) == MessageFactory::NOERROR);
+            consumer.On(tick);
+            ring.Release();
+        }
+        else
+        {
+            MessageFactory::ERROR error;
+            if(ring.DispatchNext(consumer, &error))
+                CHECK(error == MessageFactory::NOERROR);
+            else
+                sched_yield();
+        }
+    }
+    for(uint32_t i = 0; i < producerCount; ++i)
+        CHECK(consumer.next[i] == kCount);
+    uint32_t len;
+    CHECK(ring.Peek(&len) == 0);
+}
+
+// Run f in a child process, returns its pid
+template <class F>
+pid_t Fork(F f)
+{
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if(pid == 0)
+    {
+        f();
+        _exit(0);
+    }
+    return pid;
+}
+
+// Wait for all the children, the others are killed as soon as one fails (its peers would wait
+// for it forever)
+void Wait(std::vector<pid_t> children)
+{
+    while(!children.empty())
+    {
+        int status;
+        pid_t pid = wait(&status);
+        CHECK(pid > 0);
+        children.erase(std::remove(children.begin(), children.end(), pid), children.end());
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            for(size_t i = 0; i < children.size(); ++i)
+                kill(children[i], SIGKILL);
+            CHECK(!"child process failed");
+        }
+    }
+}
+
+void TestProducers(MessageShmRing::MODE mode, uint32_t producerCount)
+{
+    MessageShmRing ring;
+    CHECK(ring.CreateAnonymous(kCapacity, mode));
+    CHECK(ring.GetMaxMessageSize() < kCapacity);
+    std::vector<pid_t> children;
+    children.push_back(Fork([&]() { Consume(ring, producerCount); }));
+    for(uint32_t i = 0; i < producerCount; ++i)
+        children.push_back(Fork([&]() { Produce(ring, i); }));
+    Wait(children);
+}
+
+void TestNamed()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/msgbuf_test_%d", (int)getpid());
+    MessageShmRing ring;
+    CHECK(ring.Create(name, kCapacity));
+    std::vector<pid_t> children;
+    children.push_back(Fork([&]() {
+        MessageShmRing other;
+        CHECK(other.Open(name));
+        Produce(other, 0);
+    }));
+    children.push_back(Fork([&]() { Consume(ring, 1); }));
+    Wait(children);
+    CHECK(MessageShmRing::Unlink(name));
+    MessageShmRing missing;
+    CHECK(!missing.Open(name));
+}
+
+int main()
+{
+    MessageShmRing invalid;
+    CHECK(!invalid.CreateAnonymous(1000));
+    TestProducers(MessageShmRing::SINGLE_PRODUCER, 1);
+    TestProducers(MessageShmRing::MULTI_PRODUCER, 3);
+    TestNamed();
+    printf("shmring: ok\n");
+    return 0;
+}
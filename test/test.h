@@ -0,0 +1,14 @@
+// Test helpers, included by each test once it has included its generated header
+#include <cstdio>
+#include <cstdlib>
+
+// Stop the test with the failed condition and its location when cond is false
+#define CHECK(cond) \
+    do \
+    { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while(0)